@@ -30,8 +30,75 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+/* slots shared by all workers, each one holds the pid of the worker using it or 0 when free */
+typedef struct {
+    ngx_uint_t                              size;
+    ngx_atomic_t                            waiting;                        /* number of workers set on waiters */
+    ngx_atomic_t                            waiters[NGX_MAX_PROCESSES];     /* pid of the workers waiting for a slot, by worker number */
+    ngx_atomic_t                            owners[1];
+} ngx_http_video_thumbextractor_shm_t;
+
+/* blocks with the headers and index of remote videos, shared by the extractors of all workers */
+typedef struct {
+    ngx_rbtree_t                            rbtree;
+    ngx_rbtree_node_t                       sentinel;
+    ngx_queue_t                             lru;
+} ngx_http_video_thumbextractor_remote_cache_t;
+
+typedef struct ngx_http_video_thumbextractor_remote_s ngx_http_video_thumbextractor_remote_t;
+
+/* stream parameters and keyframes of the videos already probed, shared by the extractors of all workers */
+typedef struct {
+    ngx_rbtree_t                            rbtree;
+    ngx_rbtree_node_t                       sentinel;
+    ngx_queue_t                             lru;
+} ngx_http_video_thumbextractor_index_cache_t;
+
+typedef enum {
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_HIGH = 0,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITIES
+} ngx_http_video_thumbextractor_priority_e;
+
+typedef enum {
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_IO_PREAD = 0,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_IO_MMAP
+} ngx_http_video_thumbextractor_io_mode_e;
+
+typedef enum {
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_NORMAL = 0,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_FAST
+} ngx_http_video_thumbextractor_decode_quality_e;
+
+typedef enum {
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_BICUBIC = 0,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_BILINEAR,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_FAST_BILINEAR,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_AREA
+} ngx_http_video_thumbextractor_scaler_e;
+
+typedef enum {
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_PIPE = 0,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD
+} ngx_http_video_thumbextractor_result_transport_e;
+
 typedef struct {
     ngx_uint_t                              processes_per_worker;
+    ngx_flag_t                              persistent_processes;
+    ngx_uint_t                              process_max_requests;
+    ngx_uint_t                              shared_processes;
+    ngx_uint_t                              max_queue_size;
+    ngx_uint_t                              high_priority_weight;
+    ngx_uint_t                              reserved_processes;
+    ngx_uint_t                              batch_size;
+    ngx_uint_t                              result_transport;
+    ngx_shm_zone_t                         *shm_zone;
+    ngx_http_video_thumbextractor_shm_t    *shm;
+    ngx_shm_zone_t                         *remote_cache_zone;
+    time_t                                  remote_cache_valid;
+    ngx_http_video_thumbextractor_remote_cache_t *remote_cache;
+    ngx_shm_zone_t                         *index_cache_zone;
+    ngx_http_video_thumbextractor_index_cache_t *index_cache;
 } ngx_http_video_thumbextractor_main_conf_t;
 
 typedef struct {
@@ -49,6 +116,15 @@ typedef struct {
     ngx_http_complex_value_t               *tile_padding;
     ngx_str_t                               tile_color;
 
+    ngx_http_complex_value_t               *priority;
+
+    ngx_http_complex_value_t               *remote_url;
+    size_t                                  remote_block_size;
+    ngx_uint_t                              remote_blocks;
+    ngx_msec_t                              remote_timeout;
+
+    ngx_http_complex_value_t               *index_path;
+
     ngx_uint_t                              jpeg_baseline;
     ngx_uint_t                              jpeg_progressive_mode;
     ngx_uint_t                              jpeg_optimize;
@@ -58,18 +134,85 @@ typedef struct {
 
     ngx_flag_t                              only_keyframe;
     ngx_flag_t                              next_time;
+    ngx_flag_t                              coalesce_requests;
+    ngx_flag_t                              stream_output;
+    size_t                                  stream_buffer_size;
+    ngx_uint_t                              io_mode;
+    size_t                                  io_buffer_size;
+    size_t                                  readahead;
+    size_t                                  probesize;
+    ngx_msec_t                              analyzeduration;
+    ngx_int_t                               fpsprobesize;
+    ngx_flag_t                              adaptive_probe;
+    ngx_uint_t                              decode_quality;
+    ngx_uint_t                              scaler;
+    ngx_uint_t                              tile_decoders;
+    size_t                                  early_start;
+    ngx_msec_t                              queue_timeout;
+    time_t                                  retry_after;
+    ngx_msec_t                              extract_timeout;
+    ngx_msec_t                              extract_cpu_time;
+    off_t                                   extract_max_bytes;
+    ngx_uint_t                              extract_max_packets;
+    ngx_uint_t                              extract_max_frames;
 
     ngx_str_t                               threads;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t                      *thread_pool;
+#endif
+
     ngx_flag_t                              enabled;
 } ngx_http_video_thumbextractor_loc_conf_t;
 
+/* resources used by an extraction, checked against the limits of the location */
+typedef struct ngx_http_video_thumbextractor_budget_s ngx_http_video_thumbextractor_budget_t;
+
+struct ngx_http_video_thumbextractor_budget_s {
+    ngx_http_video_thumbextractor_loc_conf_t *cf;
+    ngx_atomic_t                     bytes;
+    ngx_atomic_t                     packets;
+    ngx_atomic_t                     frames;
+    ngx_msec_t                       cpu_start;
+    ngx_flag_t                       per_thread;
+    ngx_atomic_t                     exceeded;
+    ngx_http_video_thumbextractor_budget_t *shared;    /* counts on the budget of the first decoder of a sprite */
+};
+
+/* time spent waiting on the reads of the video file, logged when it is closed */
+typedef struct {
+    ngx_uint_t                       reads;
+    off_t                            bytes;
+    uint64_t                         usec;
+    uint64_t                         max_usec;
+    ngx_uint_t                       hints;
+    off_t                            probe_bytes;   /* read until the stream information was found */
+    ngx_uint_t                       probe_rounds;
+} ngx_http_video_thumbextractor_io_stats_t;
+
 typedef struct {
     int64_t                          size;
     int64_t                          offset;
+    int64_t                          position;  /* relative to offset */
+    u_char                          *map;       /* whole file, when read through mmap */
+    size_t                           readahead;
+    int64_t                          hint_start;
+    int64_t                          hint_end;
+    ngx_http_video_thumbextractor_io_stats_t stats;
+    ngx_fd_t                         fd;        /* opened by the worker through the open file cache */
+    off_t                            file_size;
+    time_t                           mtime;     /* zero when unknown, the video is not kept on the index cache */
+    ngx_flag_t                       remote;    /* the filename is an http url read with range requests */
+    ngx_http_video_thumbextractor_remote_t *remote_source;
     ngx_file_t                       file;
+    ngx_atomic_t                    *cancelled;
+    ngx_flag_t                       in_worker; /* extracted on a thread of the nginx worker */
+    ngx_http_video_thumbextractor_budget_t budget;
 } ngx_http_video_thumbextractor_file_info_t;
 
+/* receives the encoded image in blocks while it is being compressed */
+typedef ngx_int_t (*ngx_http_video_thumbextractor_output_pt)(void *data, u_char *buf, size_t len);
+
 typedef struct {
     ngx_http_video_thumbextractor_file_info_t   file_info;
     ngx_int_t                                   second;
@@ -84,12 +227,19 @@ typedef struct {
     ngx_int_t                                   tile_padding;
     ngx_str_t                                   tile_color;
     ngx_str_t                                   filename;
+    ngx_str_t                                   index_path;
+    ngx_http_video_thumbextractor_output_pt     output;
+    void                                       *output_data;
 } ngx_http_video_thumbextractor_thumb_ctx_t;
 
 typedef enum {
-    NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC = 1,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_JOB = 1,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC,
     NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN,
     NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN,
+    NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_DATA,
     NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED
 } ngx_http_video_thumbextractor_transfer_step;
 
@@ -97,23 +247,62 @@ typedef struct {
     ngx_http_video_thumbextractor_transfer_step     step;
     ngx_buf_t                                       buffer;
     ngx_http_video_thumbextractor_thumb_ctx_t       thumb_ctx;
-    caddr_t                                         data;
+    ngx_chain_t                                    *out;
     size_t                                          size;
     ngx_int_t                                       rc;
+    ngx_fd_t                                        fd;
     ngx_pool_t                                     *pool;
     ngx_connection_t                               *conn;
 } ngx_http_video_thumbextractor_transfer_t;
 
-typedef struct {
+typedef struct ngx_http_video_thumbextractor_ctx_s ngx_http_video_thumbextractor_ctx_t;
+typedef struct ngx_http_video_thumbextractor_thread_job_s ngx_http_video_thumbextractor_thread_job_t;
+
+struct ngx_http_video_thumbextractor_ctx_s {
     ngx_queue_t                                 queue;
     ngx_int_t                                   slot;
     ngx_http_request_t                         *request;
     ngx_http_video_thumbextractor_thumb_ctx_t   thumb_ctx;
     ngx_http_video_thumbextractor_transfer_t    transfer;
-} ngx_http_video_thumbextractor_ctx_t;
+
+    /* identical requests waiting for the same extraction */
+    ngx_rbtree_node_t                           node;
+    ngx_flag_t                                  registered;
+    ngx_queue_t                                 waiters;
+    ngx_queue_t                                 waiting;
+    ngx_http_video_thumbextractor_ctx_t        *leader;
+    ngx_http_video_thumbextractor_thread_job_t *thread_job;
+    ngx_queue_t                                 batch;
+    ngx_uint_t                                  skip;       /* results of batch requests gone away which follow this one */
+
+    ngx_uint_t                                  priority;
+    ngx_event_t                                 deadline;
+    ngx_msec_t                                  queued_at;
+    ngx_msec_t                                  queue_time;
+    ngx_flag_t                                  dequeued;
+    ngx_flag_t                                  retry_after;
+
+    /* buffers of the streamed image, reused once the client took them */
+    ngx_chain_t                                *stream_chunk;
+    ngx_chain_t                                *stream_free;
+    ngx_chain_t                                *stream_busy;
+    ngx_http_event_handler_pt                   write_event_handler;
+
+    /* file where the proxied body is being written, the extraction may start before it is complete */
+    ngx_file_t                                 *body_file;
+    off_t                                       body_start;
+    off_t                                       body_end;
+    ngx_flag_t                                  early;
+    ngx_flag_t                                  early_tried;
+    ngx_flag_t                                  body_complete;
+};
 
 ngx_int_t ngx_http_video_thumbextractor_access_handler(ngx_http_request_t *r);
+ngx_int_t ngx_http_video_thumbextractor_remote_handler(ngx_http_request_t *r);
 ngx_int_t ngx_http_video_thumbextractor_filter_init(ngx_conf_t *cf);
+void      ngx_http_video_thumbextractor_finalize_request(ngx_http_request_t *r);
+ngx_int_t ngx_http_video_thumbextractor_queue_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_http_video_thumbextractor_queue_size_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 
 
 static ngx_str_t NGX_HTTP_VIDEO_THUMBEXTRACTOR_CONTENT_TYPE = ngx_string("image/jpeg");
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2011 Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ * This file is part of Nginx Video Thumb Extractor Module.
+ *
+ * Nginx Video Thumb Extractor Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Video Thumb Extractor Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Video Thumb Extractor Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * ngx_http_video_thumbextractor_module_index.h
+ *
+ * Created:  Nov 22, 2011
+ * Author:   Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ */
+#ifndef NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_INDEX_H_
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_INDEX_H_
+
+#include <ngx_http_video_thumbextractor_module.h>
+#include <ngx_http_video_thumbextractor_module_index_file.h>
+#include <libavformat/avformat.h>
+
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_MAX_KEYFRAMES  16384
+
+/* what previous extractions, or the index file, tell about a video, the keyframes are followed by the name and the extradata */
+typedef struct {
+    ngx_rbtree_node_t                               node;
+    ngx_queue_t                                     queue;
+    size_t                                          len;        /* of the whole entry */
+    off_t                                           size;
+    time_t                                          mtime;
+    u_char                                          format[NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN];
+    int                                             stream;
+    int                                             rotate;
+    int64_t                                         duration;
+    int64_t                                         start_time;
+    ngx_http_video_thumbextractor_index_params_t    params;
+    size_t                                          name_len;
+    size_t                                          extradata_size;
+    ngx_uint_t                                      nkeyframes;
+    u_char                                          data[1];
+} ngx_http_video_thumbextractor_index_node_t;
+
+static ngx_http_video_thumbextractor_index_node_t *ngx_http_video_thumbextractor_index_lookup(ngx_str_t *name, off_t size, time_t mtime, ngx_log_t *log);
+static ngx_int_t    ngx_http_video_thumbextractor_index_restore(ngx_http_video_thumbextractor_index_node_t *index, AVFormatContext *format_ctx);
+static void         ngx_http_video_thumbextractor_index_store(ngx_str_t *name, off_t size, time_t mtime, AVFormatContext *format_ctx, int stream, int rotate);
+static ngx_http_video_thumbextractor_index_node_t *ngx_http_video_thumbextractor_index_read_file(ngx_str_t *path, off_t size, time_t mtime, ngx_log_t *log);
+static ngx_flag_t   ngx_http_video_thumbextractor_index_learns(AVFormatContext *format_ctx);
+static ngx_flag_t   ngx_http_video_thumbextractor_index_restores(AVFormatContext *format_ctx);
+static ngx_uint_t   ngx_http_video_thumbextractor_index_keyframes(AVStream *stream);
+ngx_int_t           ngx_http_video_thumbextractor_index_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+#endif /* NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_INDEX_H_ */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2011 Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ * This file is part of Nginx Video Thumb Extractor Module.
+ *
+ * Nginx Video Thumb Extractor Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Video Thumb Extractor Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Video Thumb Extractor Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * ngx_http_video_thumbextractor_module_index_file.h
+ *
+ * Created:  Nov 22, 2011
+ * Author:   Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ */
+#ifndef NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_INDEX_FILE_H_
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_INDEX_FILE_H_
+
+#include <stdint.h>
+
+/* shared by the module and the tool writing the sidecar index files, it does not depend on nginx */
+
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FILE_MAGIC      "THUMBIDX"
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FILE_VERSION    1
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN      32
+
+/* parameters of the video stream which are only known after avformat_find_stream_info */
+typedef struct {
+    int32_t                                         codec_id;
+    int32_t                                         width;
+    int32_t                                         height;
+    int32_t                                         format;
+    int32_t                                         sample_aspect_num;
+    int32_t                                         sample_aspect_den;
+    int32_t                                         profile;
+    int32_t                                         level;
+    int32_t                                         field_order;
+    int32_t                                         color_range;
+    int32_t                                         color_primaries;
+    int32_t                                         color_trc;
+    int32_t                                         color_space;
+    int32_t                                         chroma_location;
+    int32_t                                         video_delay;
+} ngx_http_video_thumbextractor_index_params_t;
+
+typedef struct {
+    int64_t                                         pos;
+    int64_t                                         timestamp;  /* on the time base of the stream */
+} ngx_http_video_thumbextractor_index_keyframe_t;
+
+/* beginning of a sidecar index file, followed by the keyframes and the extradata, on the byte order of the machine which wrote it */
+typedef struct {
+    char                                            magic[8];
+    uint32_t                                        version;
+    uint32_t                                        header_size;
+    int64_t                                         size;       /* of the video */
+    int64_t                                         mtime;      /* of the video */
+    char                                            format[NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN];
+    int32_t                                         stream;
+    int32_t                                         rotate;
+    int64_t                                         duration;
+    int64_t                                         start_time;
+    ngx_http_video_thumbextractor_index_params_t    params;
+    uint32_t                                        extradata_size;
+    uint32_t                                        nkeyframes;
+} ngx_http_video_thumbextractor_index_file_header_t;
+
+#endif /* NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_INDEX_FILE_H_ */
@@ -27,6 +27,21 @@
 #define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_IPC_H_
 
 #include <ngx_http_video_thumbextractor_module.h>
+#include <ngx_channel.h>
+
+#if (NGX_LINUX) && defined(MFD_CLOEXEC)
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_HAVE_MEMFD 1
+#endif
+
+/* results of batch requests which went away before their turn, read from the channel and dropped */
+typedef struct {
+    ngx_uint_t                                      pending;
+    ngx_flag_t                                      stream;
+    ngx_http_video_thumbextractor_transfer_step     step;
+    ngx_buf_t                                       buffer;
+    ngx_int_t                                       rc;
+    size_t                                          size;
+} ngx_http_video_thumbextractor_discard_t;
 
 typedef struct {
     ngx_socket_t                                    pipefd[2];
@@ -35,13 +50,67 @@ typedef struct {
     ngx_flag_t                                      processing;
     ngx_http_request_t                             *request;
     ngx_int_t                                       slot;
+    ngx_int_t                                       shared_slot;
+    ngx_uint_t                                      requests;
+    ngx_http_video_thumbextractor_discard_t         discard;
+    ngx_shm_t                                       cancel;     /* shared with the persistent process */
+    ngx_atomic_t                                   *cancelled;
+    ngx_event_t                                     cancel_timer;
 } ngx_http_video_thumbextractor_ipc_t;
 
+/* one socket pair per worker, a byte written to it tells the worker a shared slot was handed over to it */
+typedef struct {
+    ngx_uint_t                                      n;
+    ngx_socket_t                                  (*fds)[2];
+} ngx_http_video_thumbextractor_channels_t;
+
+/* job header sent to a persistent process, followed by the filename */
+typedef struct {
+    ngx_http_video_thumbextractor_loc_conf_t       *vtlcf;
+    ngx_http_video_thumbextractor_thumb_ctx_t       thumb_ctx;
+    ngx_uint_t                                      remaining;  /* jobs of the same batch sent after this one */
+} ngx_http_video_thumbextractor_job_t;
+
+/* image written to the channel in chunks while it is encoded, the rc is only sent with the first one */
+typedef struct {
+    ngx_fd_t                                        fd;
+    ngx_flag_t                                      started;
+} ngx_http_video_thumbextractor_stream_t;
+
+/* extraction running on a thread pool, it has its own pool because the request may go away before it finishes */
+struct ngx_http_video_thumbextractor_thread_job_s {
+    ngx_http_video_thumbextractor_loc_conf_t       *vtlcf;
+    ngx_http_video_thumbextractor_thumb_ctx_t       thumb_ctx;
+    ngx_http_video_thumbextractor_ctx_t            *ctx;
+    ngx_pool_t                                     *pool;
+    ngx_chain_t                                    *out;
+    size_t                                          size;
+    ngx_int_t                                       rc;
+    ngx_atomic_t                                    cancelled;
+};
+
 
 ngx_queue_t    *ngx_http_video_thumbextractor_module_extract_queue;
+ngx_uint_t      ngx_http_video_thumbextractor_module_extract_queue_size;
 
 ngx_http_video_thumbextractor_ipc_t    ngx_http_video_thumbextractor_module_ipc_ctxs[NGX_MAX_PROCESSES];
 
+ngx_rbtree_t                           ngx_http_video_thumbextractor_module_jobs;
+ngx_rbtree_node_t                      ngx_http_video_thumbextractor_module_jobs_sentinel;
+
 void            ngx_http_video_thumbextractor_module_ensure_extractor_process(void);
+ngx_int_t       ngx_http_video_thumbextractor_module_enqueue(ngx_http_video_thumbextractor_ctx_t *ctx);
+void            ngx_http_video_thumbextractor_module_remove_request(ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_int_t       ngx_http_video_thumbextractor_module_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data);
+void            ngx_http_video_thumbextractor_module_recover_shared_slots(void);
+void            ngx_http_video_thumbextractor_module_release_shared_slot(ngx_http_video_thumbextractor_ipc_t *ipc_ctx);
+void            ngx_http_video_thumbextractor_module_stop_waiting(void);
+void            ngx_http_video_thumbextractor_module_cancel_retry(void);
+ngx_int_t       ngx_http_video_thumbextractor_module_create_channels(ngx_cycle_t *cycle);
+ngx_int_t       ngx_http_video_thumbextractor_module_open_channel(void);
+
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_SHARED_RETRY_INTERVAL 1000
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MAX_BATCH_SIZE        64
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_CANCEL_TIMEOUT        5000
 
 #endif /* NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_IPC_H_ */
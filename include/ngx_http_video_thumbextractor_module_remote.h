@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2011 Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ * This file is part of Nginx Video Thumb Extractor Module.
+ *
+ * Nginx Video Thumb Extractor Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Video Thumb Extractor Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Video Thumb Extractor Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * ngx_http_video_thumbextractor_module_remote.h
+ *
+ * Created:  Nov 22, 2011
+ * Author:   Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ */
+#ifndef NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_REMOTE_H_
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_REMOTE_H_
+
+#include <ngx_http_video_thumbextractor_module.h>
+
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_REMOTE_HEADER_SIZE 4096
+
+/* block of a remote video kept while it is extracted */
+typedef struct {
+    int64_t                                         index;
+    size_t                                          len;
+    ngx_uint_t                                      used;       /* when it was last read, the oldest one is replaced */
+    u_char                                         *data;
+} ngx_http_video_thumbextractor_remote_block_t;
+
+struct ngx_http_video_thumbextractor_remote_s {
+    ngx_pool_t                                     *pool;
+    ngx_log_t                                      *log;
+    ngx_str_t                                       name;
+    ngx_url_t                                       url;
+    ngx_socket_t                                    s;          /* kept alive between the range requests */
+    ngx_msec_t                                      timeout;
+    int64_t                                         size;
+    time_t                                          mtime;      /* from the last modified header, zero when unknown */
+    size_t                                          block_size;
+    ngx_uint_t                                      nblocks;
+    ngx_http_video_thumbextractor_remote_block_t   *blocks;
+    ngx_uint_t                                      clock;
+    ngx_flag_t                                      probing;    /* the blocks read while probing have the headers and index */
+    ngx_uint_t                                      requests;
+    off_t                                           received;
+    ngx_uint_t                                      shared_hits;
+};
+
+/* entry of the shared cache, the url of the video followed by the block */
+typedef struct {
+    ngx_rbtree_node_t                               node;
+    ngx_queue_t                                     queue;
+    time_t                                          expire;
+    int64_t                                         index;
+    int64_t                                         size;       /* of the whole video */
+    time_t                                          mtime;
+    size_t                                          block_size;
+    size_t                                          len;
+    size_t                                          name_len;
+    u_char                                          data[1];
+} ngx_http_video_thumbextractor_remote_cache_node_t;
+
+static ngx_int_t    ngx_http_video_thumbextractor_remote_open(ngx_http_video_thumbextractor_file_info_t *info, ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_str_t *url, ngx_log_t *log);
+static ssize_t      ngx_http_video_thumbextractor_remote_read(ngx_http_video_thumbextractor_remote_t *remote, u_char *buf, size_t len, int64_t offset);
+static void         ngx_http_video_thumbextractor_remote_close(ngx_http_video_thumbextractor_remote_t *remote);
+ngx_int_t           ngx_http_video_thumbextractor_remote_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+#endif /* NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_REMOTE_H_ */
@@ -27,10 +27,17 @@
 #define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_UTILS_H_
 
 
-static int                                     ngx_http_video_thumbextractor_get_thumb(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, caddr_t *out_buffer, size_t *out_len, ngx_pool_t *temp_pool, ngx_log_t *log);
+static int                                     ngx_http_video_thumbextractor_get_thumb(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_chain_t **out, size_t *out_len, ngx_pool_t *temp_pool, ngx_log_t *log);
 static void                                    ngx_http_video_thumbextractor_init_libraries(void);
 
 #define NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND   1
 #define NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND 2
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_CPU_TIME_EXCEEDED 3
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_BYTES_EXCEEDED   4
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_PACKETS_EXCEEDED 5
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_FRAMES_EXCEEDED  6
+
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_BUDGET_EXCEEDED(rc)                      \
+    (((rc) >= NGX_HTTP_VIDEO_THUMBEXTRACTOR_CPU_TIME_EXCEEDED) && ((rc) <= NGX_HTTP_VIDEO_THUMBEXTRACTOR_FRAMES_EXCEEDED))
 
 #endif /* NGX_HTTP_VIDEO_THUMBEXTRACTOR_MODULE_UTILS_H_ */
@@ -25,6 +25,8 @@
  */
 #include <ngx_http_video_thumbextractor_module.h>
 #include <ngx_http_video_thumbextractor_module_setup.c>
+#include <ngx_http_video_thumbextractor_module_remote.c>
+#include <ngx_http_video_thumbextractor_module_index.c>
 #include <ngx_http_video_thumbextractor_module_utils.c>
 #include <ngx_http_video_thumbextractor_module_ipc.c>
 
@@ -33,7 +35,11 @@ ngx_http_output_body_filter_pt ngx_http_video_thumbextractor_next_body_filter;
 
 ngx_int_t ngx_http_video_thumbextractor_extract_and_send_thumb(ngx_http_request_t *r);
 ngx_int_t ngx_http_video_thumbextractor_set_request_context(ngx_http_request_t *r);
+void      ngx_http_video_thumbextractor_open_cached_video(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_int_t ngx_http_video_thumbextractor_track_body(ngx_http_request_t *r, ngx_chain_t *in);
+void      ngx_http_video_thumbextractor_start_early(ngx_http_request_t *r);
 void      ngx_http_video_thumbextractor_cleanup_request_context(ngx_http_request_t *r);
+ngx_int_t ngx_http_video_thumbextractor_set_retry_after(ngx_http_request_t *r, ngx_http_video_thumbextractor_loc_conf_t *vtlcf);
 
 
 static ngx_int_t
@@ -51,6 +57,10 @@ ngx_http_video_thumbextractor_header_filter(ngx_http_request_t *r)
     ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
 
     if (ctx != NULL) {
+        if (ctx->retry_after && (r->headers_out.status == NGX_HTTP_SERVICE_UNAVAILABLE) && (ngx_http_video_thumbextractor_set_retry_after(r, vtlcf) != NGX_OK)) {
+            return NGX_ERROR;
+        }
+
         return ngx_http_video_thumbextractor_next_header_filter(r);
     }
 
@@ -83,6 +93,10 @@ ngx_http_video_thumbextractor_body_filter(ngx_http_request_t *r, ngx_chain_t *in
         return ngx_http_video_thumbextractor_next_body_filter(r, in);
     }
 
+    if ((vtlcf->early_start > 0) && (r->upstream != NULL) && ((rc = ngx_http_video_thumbextractor_track_body(r, in)) != NGX_OK)) {
+        return rc;
+    }
+
     // discard chains from original content
     for (cl = in; cl; cl = cl->next) {
         cl->buf->pos = cl->buf->last;
@@ -90,9 +104,18 @@ ngx_http_video_thumbextractor_body_filter(ngx_http_request_t *r, ngx_chain_t *in
     }
 
     if (!last_buf) {
+        if ((vtlcf->early_start > 0) && (r->upstream != NULL)) {
+            ngx_http_video_thumbextractor_start_early(r);
+        }
         return NGX_OK;
     }
 
+    if ((ctx != NULL) && ctx->early) {
+        // the extraction from the partial body is still running, it will answer the request
+        ctx->body_complete = 1;
+        return NGX_DONE;
+    }
+
     // clear values from original content
     ngx_http_clear_content_length(r);
     ngx_http_clear_accept_ranges(r);
@@ -106,15 +129,52 @@ ngx_http_video_thumbextractor_body_filter(ngx_http_request_t *r, ngx_chain_t *in
 }
 
 
+ngx_int_t
+ngx_http_video_thumbextractor_remote_handler(ngx_http_request_t *r)
+{
+    ngx_http_video_thumbextractor_loc_conf_t *vtlcf;
+    ngx_int_t                                 rc;
+
+    vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
+
+    // without a remote url the image is extracted from the response of the location, on the body filter
+    if (!vtlcf->enabled || (vtlcf->remote_url == NULL)) {
+        return NGX_DECLINED;
+    }
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if ((rc = ngx_http_discard_request_body(r)) != NGX_OK) {
+        return rc;
+    }
+
+    if ((rc = ngx_http_video_thumbextractor_set_request_context(r)) != NGX_OK) {
+        return (rc == NGX_ERROR) ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc;
+    }
+
+    return ngx_http_video_thumbextractor_extract_and_send_thumb(r);
+}
+
+
 ngx_int_t
 ngx_http_video_thumbextractor_extract_and_send_thumb(ngx_http_request_t *r)
 {
     ngx_http_video_thumbextractor_ctx_t       *ctx;
+    ngx_flag_t                                 cached_response = 0;
+    ngx_int_t                                  rc;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
 
+    ctx->thumb_ctx.file_info.offset = 0;
+    ctx->thumb_ctx.file_info.fd = NGX_INVALID_FILE;
+    ctx->thumb_ctx.file_info.mtime = 0;
+
 #if (NGX_HTTP_CACHE)
     if (r->cache) {
+        cached_response = 1;
+
         if (r->headers_out.status >= NGX_HTTP_BAD_REQUEST) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "video thumb extractor module: cached file isn't a success result to extract an image");
             return ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_NOT_FOUND);
@@ -132,16 +192,259 @@ ngx_http_video_thumbextractor_extract_and_send_thumb(ngx_http_request_t *r)
     }
 #endif
 
-    r->main->count++;
+    // a cache file may be replaced at any time, it is always opened by its name
+    if (!cached_response && !ctx->thumb_ctx.file_info.remote) {
+        ngx_http_video_thumbextractor_open_cached_video(r, ctx);
+    }
 
-    ngx_queue_insert_tail(ngx_http_video_thumbextractor_module_extract_queue, &ctx->queue);
+    rc = ngx_http_video_thumbextractor_module_enqueue(ctx);
 
-    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "video thumb extractor module: extraction queue is full, rejecting request");
+        ctx->retry_after = 1;
+        return ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_SERVICE_UNAVAILABLE);
+    }
+
+    if (rc != NGX_OK) {
+        return ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    if (r == r->main) {
+        // finalize the request when the client goes away, cancelling the extraction
+        r->read_event_handler = ngx_http_test_reading;
+    }
 
     return NGX_DONE;
 }
 
 
+ngx_int_t
+ngx_http_video_thumbextractor_set_retry_after(ngx_http_request_t *r, ngx_http_video_thumbextractor_loc_conf_t *vtlcf)
+{
+    ngx_table_elt_t                           *h;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if ((h->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+#if (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Retry-After");
+    h->value.len = ngx_sprintf(h->value.data, "%T", vtlcf->retry_after) - h->value.data;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_queue_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_video_thumbextractor_ctx_t       *ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+    ngx_msec_t                                 ms;
+    u_char                                    *p;
+
+    if ((ctx == NULL) || (ctx->queued_at == 0)) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ms = ctx->dequeued ? ctx->queue_time : ngx_current_msec - ctx->queued_at;
+
+    if ((p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t) (ms / 1000), ms % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_queue_size_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                                    *p;
+
+    if ((p = ngx_pnalloc(r->pool, NGX_INT_T_LEN)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", ngx_http_video_thumbextractor_module_extract_queue_size) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_track_body(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_http_video_thumbextractor_ctx_t       *ctx;
+    ngx_chain_t                               *cl;
+    ngx_buf_t                                 *b;
+    ngx_int_t                                  rc;
+
+    if ((rc = ngx_http_video_thumbextractor_set_request_context(r)) != NGX_OK) {
+        return ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, (rc == NGX_ERROR) ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+
+    if (ctx->early_tried) {
+        return NGX_OK;
+    }
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!b->in_file || (b->file == NULL) || ((ctx->body_file != NULL) && (b->file != ctx->body_file))) {
+            // the body is not entirely on one file, the extraction waits for all of it
+            ctx->early_tried = 1;
+            return NGX_OK;
+        }
+
+        if (ctx->body_file == NULL) {
+            ctx->body_file = b->file;
+            ctx->body_start = b->file_pos;
+        }
+
+        ctx->body_end = ngx_max(ctx->body_end, b->file_last);
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_video_thumbextractor_start_early(ngx_http_request_t *r)
+{
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_ctx_t       *ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_file_info_t *info;
+
+    if ((ctx == NULL) || ctx->early_tried || (ctx->body_file == NULL) || (ctx->body_end - ctx->body_start < (off_t) vtlcf->early_start)) {
+        return;
+    }
+
+    ctx->early_tried = 1;
+
+    // the part of the body already written is read as if it was the whole video
+    info = &ctx->thumb_ctx.file_info;
+    info->offset = ctx->body_start;
+    info->fd = ctx->body_file->fd;
+    info->file_size = ctx->body_end;
+    // a partial video is never kept on the index cache
+    info->mtime = 0;
+
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_clear_last_modified(r);
+
+    ctx->early = 1;
+
+    if (ngx_http_video_thumbextractor_module_enqueue(ctx) != NGX_OK) {
+        // no room to extract now, wait for the whole body
+        ctx->early = 0;
+        info->offset = 0;
+        info->fd = NGX_INVALID_FILE;
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "video thumb extractor module: extracting from the first %O bytes of \"%V\"", ctx->body_end - ctx->body_start, &ctx->body_file->name);
+}
+
+
+void
+ngx_http_video_thumbextractor_finalize_request(ngx_http_request_t *r)
+{
+    ngx_http_video_thumbextractor_ctx_t       *ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+
+    if ((ctx == NULL) || !ctx->early) {
+        ngx_http_finalize_request(r, NGX_OK);
+        return;
+    }
+
+    ctx->early = 0;
+
+    if (r->header_sent) {
+        // the request was answered before the whole body arrived, there is no need to keep downloading the video
+        if ((r->upstream != NULL) && (r->upstream->cleanup != NULL)) {
+            (*r->upstream->cleanup)(r);
+        }
+
+        ngx_http_finalize_request(r, NGX_OK);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "video thumb extractor module: unable to extract from the first %O bytes of the body, waiting for the whole video", ctx->body_end - ctx->body_start);
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    if (!ctx->body_complete) {
+        // the body filter starts the extraction again on the last buffer
+        r->main->count--;
+        return;
+    }
+
+    if (ngx_http_video_thumbextractor_extract_and_send_thumb(r) == NGX_DONE) {
+        r->main->count--;
+        return;
+    }
+
+    ngx_http_finalize_request(r, NGX_OK);
+}
+
+
+void
+ngx_http_video_thumbextractor_open_cached_video(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_file_info_t   *info = &ctx->thumb_ctx.file_info;
+    ngx_http_core_loc_conf_t                    *clcf;
+    ngx_open_file_info_t                         of;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    // on failure the extractor opens the file by its name and reports the error as before
+    if ((ngx_open_cached_file(clcf->open_file_cache, &ctx->thumb_ctx.filename, &of, r->pool) != NGX_OK) || !of.is_file) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, of.err, "video thumb extractor module: unable to open \"%V\" on the worker", &ctx->thumb_ctx.filename);
+        info->fd = NGX_INVALID_FILE;
+        return;
+    }
+
+    // the descriptor belongs to the cache or to the request pool, the extractor gets its own copy of it
+    info->fd = of.fd;
+    info->file_size = of.size;
+    info->mtime = of.mtime;
+}
+
+
 ngx_int_t
 ngx_http_video_thumbextractor_set_request_context(ngx_http_request_t *r)
 {
@@ -152,6 +455,7 @@ ngx_http_video_thumbextractor_set_request_context(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t                    *clcf;
     ngx_str_t                                    vv_filename = ngx_null_string, vv_second = ngx_null_string;
     ngx_str_t                                    vv_value = ngx_null_string;
+    ngx_str_t                                    root;
 
     vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
@@ -180,13 +484,27 @@ ngx_http_video_thumbextractor_set_request_context(ngx_http_request_t *r)
     ctx->slot = -1;
     ctx->request = r;
     ngx_queue_init(&ctx->queue);
+    ngx_queue_init(&ctx->waiters);
+    ngx_queue_init(&ctx->waiting);
+    ngx_queue_init(&ctx->batch);
 
     thumb_ctx = &ctx->thumb_ctx;
     thumb_ctx->file_info.offset = 0;
-
-    // check if received a filename
-    ngx_http_complex_value(r, vtlcf->video_filename, &vv_filename);
-    NGX_HTTP_VIDEO_THUMBEXTRACTOR_VARIABLE_REQUIRED(vv_filename, r->connection->log, "filename variable is empty");
+    thumb_ctx->file_info.fd = NGX_INVALID_FILE;
+    thumb_ctx->file_info.mtime = 0;
+
+    if (vtlcf->remote_url != NULL) {
+        // the url of the video on the origin takes the place of the filename
+        ngx_http_complex_value(r, vtlcf->remote_url, &vv_filename);
+        NGX_HTTP_VIDEO_THUMBEXTRACTOR_VARIABLE_REQUIRED(vv_filename, r->connection->log, "remote url variable is empty");
+        thumb_ctx->file_info.remote = 1;
+        ngx_str_null(&root);
+    } else {
+        // check if received a filename
+        ngx_http_complex_value(r, vtlcf->video_filename, &vv_filename);
+        NGX_HTTP_VIDEO_THUMBEXTRACTOR_VARIABLE_REQUIRED(vv_filename, r->connection->log, "filename variable is empty");
+        root = clcf->root;
+    }
 
     ngx_http_complex_value(r, vtlcf->video_second, &vv_second);
     NGX_HTTP_VIDEO_THUMBEXTRACTOR_VARIABLE_REQUIRED(vv_second, r->connection->log, "second variable is empty");
@@ -208,19 +526,45 @@ ngx_http_video_thumbextractor_set_request_context(ngx_http_request_t *r)
     NGX_HTTP_VIDEO_THUMBEXTRACTOR_PARSE_VARIABLE_VALUE_INT(vtlcf->tile_padding, vv_value, thumb_ctx->tile_padding, 0);
     thumb_ctx->tile_color = vtlcf->tile_color;
 
+    // tile sprites need many seeks and decodes, by default they do not delay the single frames
+    ctx->priority = ((thumb_ctx->tile_rows != NGX_CONF_UNSET) || (thumb_ctx->tile_cols != NGX_CONF_UNSET)) && !((thumb_ctx->tile_rows == 1) && (thumb_ctx->tile_cols == 1)) ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW : NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_HIGH;
+    if (vtlcf->priority != NULL) {
+        ngx_http_complex_value(r, vtlcf->priority, &vv_value);
+        if ((vv_value.len == 4) && (ngx_strncasecmp(vv_value.data, (u_char *) "high", 4) == 0)) {
+            ctx->priority = NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_HIGH;
+        } else if ((vv_value.len == 3) && (ngx_strncasecmp(vv_value.data, (u_char *) "low", 3) == 0)) {
+            ctx->priority = NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW;
+        }
+    }
+
     if (((thumb_ctx->width > 0) && (thumb_ctx->width < 16)) || ((thumb_ctx->height > 0) && (thumb_ctx->height < 16))) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "video thumb extractor module: Very small size requested, %d x %d", thumb_ctx->width, thumb_ctx->height);
         return NGX_HTTP_BAD_REQUEST;
     }
 
-    if ((thumb_ctx->filename.data = ngx_pcalloc(r->pool, clcf->root.len + vv_filename.len + 1)) == NULL) {
+    if ((thumb_ctx->filename.data = ngx_pcalloc(r->pool, root.len + vv_filename.len + 1)) == NULL) {
         ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate memory to store full filename");
         return NGX_ERROR;
     }
-    ngx_memcpy(ngx_copy(thumb_ctx->filename.data, clcf->root.data, clcf->root.len), vv_filename.data, vv_filename.len);
-    thumb_ctx->filename.len = clcf->root.len + vv_filename.len;
+    ngx_memcpy(ngx_copy(thumb_ctx->filename.data, root.data, root.len), vv_filename.data, vv_filename.len);
+    thumb_ctx->filename.len = root.len + vv_filename.len;
     thumb_ctx->filename.data[thumb_ctx->filename.len] = '\0';
 
+    ngx_str_null(&thumb_ctx->index_path);
+    if (vtlcf->index_path != NULL) {
+        ngx_http_complex_value(r, vtlcf->index_path, &vv_value);
+
+        // an empty path means the video has no index file
+        if (vv_value.len > 0) {
+            if ((thumb_ctx->index_path.data = ngx_pnalloc(r->pool, vv_value.len + 1)) == NULL) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate memory to store the index path");
+                return NGX_ERROR;
+            }
+            ngx_cpystrn(thumb_ctx->index_path.data, vv_value.data, vv_value.len + 1);
+            thumb_ctx->index_path.len = vv_value.len;
+        }
+    }
+
     return NGX_OK;
 }
 
@@ -246,14 +590,7 @@ ngx_http_video_thumbextractor_cleanup_request_context(ngx_http_request_t *r)
     r->read_event_handler = ngx_http_request_empty_handler;
 
     if (ctx != NULL) {
-        if (ctx->slot >= 0) {
-            ngx_http_video_thumbextractor_module_ipc_ctxs[ctx->slot].request = NULL;
-        }
-
-        if (!ngx_queue_empty(&ctx->queue)) {
-            ngx_queue_remove(&ctx->queue);
-            ngx_queue_init(&ctx->queue);
-        }
+        ngx_http_video_thumbextractor_module_remove_request(ctx);
 
         ngx_http_set_ctx(r, NULL, ngx_http_video_thumbextractor_module);
     }
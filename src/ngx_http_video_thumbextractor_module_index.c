@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2011 Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ * This file is part of Nginx Video Thumb Extractor Module.
+ *
+ * Nginx Video Thumb Extractor Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Video Thumb Extractor Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Video Thumb Extractor Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * ngx_http_video_thumbextractor_module_index.c
+ *
+ * Created:  Nov 22, 2011
+ * Author:   Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ */
+#include <ngx_http_video_thumbextractor_module_index.h>
+
+static uint32_t     ngx_http_video_thumbextractor_index_key(ngx_str_t *name);
+static ngx_http_video_thumbextractor_index_node_t *ngx_http_video_thumbextractor_index_find(ngx_http_video_thumbextractor_index_cache_t *cache, ngx_str_t *name, uint32_t key);
+static int          ngx_http_video_thumbextractor_index_entries(AVStream *stream);
+static const AVIndexEntry *ngx_http_video_thumbextractor_index_entry(AVStream *stream, int i);
+
+
+static ngx_http_video_thumbextractor_index_node_t *
+ngx_http_video_thumbextractor_index_lookup(ngx_str_t *name, off_t size, time_t mtime, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_main_conf_t     *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_index_cache_t   *cache = vtmcf->index_cache;
+    ngx_http_video_thumbextractor_index_node_t    *entry, *index = NULL;
+    ngx_slab_pool_t                               *shpool;
+
+    if ((cache == NULL) || (mtime == 0)) {
+        return NULL;
+    }
+
+    shpool = (ngx_slab_pool_t *) vtmcf->index_cache_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    entry = ngx_http_video_thumbextractor_index_find(cache, name, ngx_http_video_thumbextractor_index_key(name));
+
+    // a changed video is probed again and its entry replaced when the extraction finishes
+    if ((entry != NULL) && (entry->size == size) && (entry->mtime == mtime)) {
+        if ((index = ngx_alloc(entry->len, log)) != NULL) {
+            ngx_memcpy(index, entry, entry->len);
+        }
+
+        ngx_queue_remove(&entry->queue);
+        ngx_queue_insert_head(&cache->lru, &entry->queue);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return index;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_index_restore(ngx_http_video_thumbextractor_index_node_t *index, AVFormatContext *format_ctx)
+{
+    ngx_http_video_thumbextractor_index_params_t   *params = &index->params;
+    ngx_http_video_thumbextractor_index_keyframe_t  keyframe;
+    AVCodecParameters                              *par;
+    AVStream                                       *stream;
+    ngx_uint_t                                      i;
+
+    if (index->stream >= (int) format_ctx->nb_streams) {
+        return NGX_DECLINED;
+    }
+
+    stream = format_ctx->streams[index->stream];
+    par = stream->codecpar;
+
+    if ((par->codec_type != AVMEDIA_TYPE_VIDEO) || (par->codec_id != (enum AVCodecID) params->codec_id)) {
+        return NGX_DECLINED;
+    }
+
+    if ((par->extradata_size == 0) && (index->extradata_size > 0)) {
+        if ((par->extradata = av_mallocz(index->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE)) == NULL) {
+            return NGX_DECLINED;
+        }
+
+        ngx_memcpy(par->extradata, index->data + index->nkeyframes * sizeof(ngx_http_video_thumbextractor_index_keyframe_t) + index->name_len, index->extradata_size);
+        par->extradata_size = index->extradata_size;
+    }
+
+    par->width = params->width;
+    par->height = params->height;
+    par->format = params->format;
+    par->sample_aspect_ratio.num = params->sample_aspect_num;
+    par->sample_aspect_ratio.den = params->sample_aspect_den;
+    par->profile = params->profile;
+    par->level = params->level;
+    par->field_order = params->field_order;
+    par->color_range = params->color_range;
+    par->color_primaries = params->color_primaries;
+    par->color_trc = params->color_trc;
+    par->color_space = params->color_space;
+    par->chroma_location = params->chroma_location;
+    par->video_delay = params->video_delay;
+
+    if ((format_ctx->duration == AV_NOPTS_VALUE) || (format_ctx->duration <= 0)) {
+        format_ctx->duration = index->duration;
+    }
+
+    if (format_ctx->start_time == AV_NOPTS_VALUE) {
+        format_ctx->start_time = index->start_time;
+    }
+
+    // the other formats build their own index when the header is read
+    if (ngx_http_video_thumbextractor_index_restores(format_ctx) && (ngx_http_video_thumbextractor_index_keyframes(stream) == 0)) {
+        for (i = 0; i < index->nkeyframes; i++) {
+            ngx_memcpy(&keyframe, index->data + i * sizeof(ngx_http_video_thumbextractor_index_keyframe_t), sizeof(ngx_http_video_thumbextractor_index_keyframe_t));
+            av_add_index_entry(stream, keyframe.pos, keyframe.timestamp, 0, 0, AVINDEX_KEYFRAME);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_video_thumbextractor_index_node_t *
+ngx_http_video_thumbextractor_index_read_file(ngx_str_t *path, off_t size, time_t mtime, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_index_file_header_t  header;
+    ngx_http_video_thumbextractor_index_node_t        *index = NULL;
+    ngx_file_t                                         file;
+    ngx_file_info_t                                    fi;
+    size_t                                             len;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = *path;
+    file.log = log;
+
+    // a video without an index file is probed as usual
+    if ((file.fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0)) == NGX_INVALID_FILE) {
+        return NULL;
+    }
+
+    if ((ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) || (ngx_read_file(&file, (u_char *) &header, sizeof(header), 0) != (ssize_t) sizeof(header))) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "video thumb extractor module: unable to read the index file \"%V\"", path);
+        goto close;
+    }
+
+    len = (size_t) header.nkeyframes * sizeof(ngx_http_video_thumbextractor_index_keyframe_t) + header.extradata_size;
+
+    if ((ngx_memcmp(header.magic, NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FILE_MAGIC, sizeof(header.magic)) != 0) || (header.version != NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FILE_VERSION) ||
+        (header.header_size != sizeof(header)) || (ngx_file_size(&fi) != (off_t) (sizeof(header) + len)))
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: invalid index file \"%V\"", path);
+        goto close;
+    }
+
+    // the modification time is not known for partial videos and some remote ones
+    if ((header.size != size) || ((mtime != 0) && (header.mtime != mtime))) {
+        ngx_log_error(NGX_LOG_INFO, log, 0, "video thumb extractor module: index file \"%V\" does not match the video, it was probably changed", path);
+        goto close;
+    }
+
+    if ((index = ngx_alloc(offsetof(ngx_http_video_thumbextractor_index_node_t, data) + len, log)) == NULL) {
+        goto close;
+    }
+
+    if (ngx_read_file(&file, index->data, len, sizeof(header)) != (ssize_t) len) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "video thumb extractor module: unable to read the index file \"%V\"", path);
+        ngx_free(index);
+        index = NULL;
+        goto close;
+    }
+
+    index->len = offsetof(ngx_http_video_thumbextractor_index_node_t, data) + len;
+    index->size = header.size;
+    index->mtime = header.mtime;
+    ngx_memcpy(index->format, header.format, NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN);
+    index->format[NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN - 1] = '\0';
+    index->stream = header.stream;
+    index->rotate = header.rotate;
+    index->duration = header.duration;
+    index->start_time = header.start_time;
+    index->params = header.params;
+    index->name_len = 0;
+    index->extradata_size = header.extradata_size;
+    index->nkeyframes = header.nkeyframes;
+
+close:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "video thumb extractor module: unable to close the index file \"%V\"", path);
+    }
+
+    return index;
+}
+
+
+static void
+ngx_http_video_thumbextractor_index_store(ngx_str_t *name, off_t size, time_t mtime, AVFormatContext *format_ctx, int stream_index, int rotate)
+{
+    ngx_http_video_thumbextractor_main_conf_t      *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_index_cache_t    *cache = vtmcf->index_cache;
+    ngx_http_video_thumbextractor_index_node_t     *entry;
+    ngx_http_video_thumbextractor_index_keyframe_t  keyframe;
+    AVStream                                       *stream = format_ctx->streams[stream_index];
+    AVCodecParameters                              *par = stream->codecpar;
+    const AVIndexEntry                             *ie;
+    ngx_slab_pool_t                                *shpool;
+    ngx_queue_t                                    *q;
+    ngx_uint_t                                      total, step, nkeyframes, n;
+    size_t                                          len;
+    u_char                                         *p;
+    int                                             i, entries;
+    uint32_t                                        key;
+
+    if ((cache == NULL) || (mtime == 0)) {
+        return;
+    }
+
+    // very long videos keep an evenly spaced subset of the keyframes
+    total = ngx_http_video_thumbextractor_index_keyframes(stream);
+    step = (total + NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_MAX_KEYFRAMES - 1) / NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_MAX_KEYFRAMES;
+    nkeyframes = (step > 0) ? (total + step - 1) / step : 0;
+    len = offsetof(ngx_http_video_thumbextractor_index_node_t, data) + nkeyframes * sizeof(ngx_http_video_thumbextractor_index_keyframe_t) + name->len + par->extradata_size;
+
+    shpool = (ngx_slab_pool_t *) vtmcf->index_cache_zone->shm.addr;
+    key = ngx_http_video_thumbextractor_index_key(name);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if ((entry = ngx_http_video_thumbextractor_index_find(cache, name, key)) != NULL) {
+        // another extraction of the same video already stored as much as this one knows
+        if ((entry->size == size) && (entry->mtime == mtime) && (entry->nkeyframes >= nkeyframes)) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
+        }
+
+        ngx_queue_remove(&entry->queue);
+        ngx_rbtree_delete(&cache->rbtree, &entry->node);
+        ngx_slab_free_locked(shpool, entry);
+    }
+
+    // the least recently used videos make room for the new one
+    while ((entry = ngx_slab_alloc_locked(shpool, len)) == NULL) {
+        if (ngx_queue_empty(&cache->lru)) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
+        }
+
+        q = ngx_queue_last(&cache->lru);
+        ngx_queue_remove(q);
+        entry = ngx_queue_data(q, ngx_http_video_thumbextractor_index_node_t, queue);
+        ngx_rbtree_delete(&cache->rbtree, &entry->node);
+        ngx_slab_free_locked(shpool, entry);
+    }
+
+    entry->node.key = key;
+    entry->len = len;
+    entry->size = size;
+    entry->mtime = mtime;
+    ngx_memzero(entry->format, NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN);
+    // the first of the names of the demuxer is enough to find it again
+    for (i = 0; (i < NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN - 1) && (format_ctx->iformat->name[i] != '\0') && (format_ctx->iformat->name[i] != ','); i++) {
+        entry->format[i] = format_ctx->iformat->name[i];
+    }
+    entry->stream = stream_index;
+    entry->rotate = rotate;
+    entry->duration = format_ctx->duration;
+    entry->start_time = format_ctx->start_time;
+
+    entry->params.codec_id = par->codec_id;
+    entry->params.width = par->width;
+    entry->params.height = par->height;
+    entry->params.format = par->format;
+    entry->params.sample_aspect_num = par->sample_aspect_ratio.num;
+    entry->params.sample_aspect_den = par->sample_aspect_ratio.den;
+    entry->params.profile = par->profile;
+    entry->params.level = par->level;
+    entry->params.field_order = par->field_order;
+    entry->params.color_range = par->color_range;
+    entry->params.color_primaries = par->color_primaries;
+    entry->params.color_trc = par->color_trc;
+    entry->params.color_space = par->color_space;
+    entry->params.chroma_location = par->chroma_location;
+    entry->params.video_delay = par->video_delay;
+
+    entry->name_len = name->len;
+    entry->extradata_size = par->extradata_size;
+    entry->nkeyframes = 0;
+
+    p = entry->data;
+    entries = (total > 0) ? ngx_http_video_thumbextractor_index_entries(stream) : 0;
+    for (i = 0, n = 0; (i < entries) && (entry->nkeyframes < nkeyframes); i++) {
+        ie = ngx_http_video_thumbextractor_index_entry(stream, i);
+        if (!(ie->flags & AVINDEX_KEYFRAME) || ((n++ % step) != 0)) {
+            continue;
+        }
+
+        keyframe.pos = ie->pos;
+        keyframe.timestamp = ie->timestamp;
+        p = ngx_cpymem(p, &keyframe, sizeof(ngx_http_video_thumbextractor_index_keyframe_t));
+        entry->nkeyframes++;
+    }
+
+    p = ngx_cpymem(p, name->data, name->len);
+    if (par->extradata_size > 0) {
+        ngx_memcpy(p, par->extradata, par->extradata_size);
+    }
+
+    ngx_rbtree_insert(&cache->rbtree, &entry->node);
+    ngx_queue_insert_head(&cache->lru, &entry->queue);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static ngx_flag_t
+ngx_http_video_thumbextractor_index_learns(AVFormatContext *format_ctx)
+{
+    const char *name = format_ctx->iformat->name;
+
+    // these formats have no index and seek with a binary search bounded by the known keyframes,
+    // the others keep the position of each sample and would be confused by extra entries
+    return ((ngx_strcmp(name, "mpegts") == 0) || (ngx_strcmp(name, "mpeg") == 0));
+}
+
+
+static ngx_flag_t
+ngx_http_video_thumbextractor_index_restores(AVFormatContext *format_ctx)
+{
+    // matroska files without cues are read up to the requested time, its own entries are the position of the clusters as the ones kept
+    return ngx_http_video_thumbextractor_index_learns(format_ctx) || (ngx_strcmp(format_ctx->iformat->name, "matroska,webm") == 0);
+}
+
+
+static ngx_uint_t
+ngx_http_video_thumbextractor_index_keyframes(AVStream *stream)
+{
+    ngx_uint_t  keyframes = 0;
+    int         i, entries = ngx_http_video_thumbextractor_index_entries(stream);
+
+    for (i = 0; i < entries; i++) {
+        if (ngx_http_video_thumbextractor_index_entry(stream, i)->flags & AVINDEX_KEYFRAME) {
+            keyframes++;
+        }
+    }
+
+    return keyframes;
+}
+
+
+static int
+ngx_http_video_thumbextractor_index_entries(AVStream *stream)
+{
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 78, 100)
+    return stream->nb_index_entries;
+#else
+    return avformat_index_get_entries_count(stream);
+#endif
+}
+
+
+static const AVIndexEntry *
+ngx_http_video_thumbextractor_index_entry(AVStream *stream, int i)
+{
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 78, 100)
+    return &stream->index_entries[i];
+#else
+    return avformat_index_get_entry(stream, i);
+#endif
+}
+
+
+static uint32_t
+ngx_http_video_thumbextractor_index_key(ngx_str_t *name)
+{
+    return ngx_crc32_short(name->data, name->len);
+}
+
+
+static ngx_http_video_thumbextractor_index_node_t *
+ngx_http_video_thumbextractor_index_find(ngx_http_video_thumbextractor_index_cache_t *cache, ngx_str_t *name, uint32_t key)
+{
+    ngx_rbtree_node_t                             *node = cache->rbtree.root, *sentinel = cache->rbtree.sentinel;
+    ngx_http_video_thumbextractor_index_node_t    *entry;
+
+    while (node != sentinel) {
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        entry = (ngx_http_video_thumbextractor_index_node_t *) node;
+        if ((entry->name_len == name->len) && (ngx_memcmp(entry->data + entry->nkeyframes * sizeof(ngx_http_video_thumbextractor_index_keyframe_t), name->data, name->len) == 0)) {
+            return entry;
+        }
+
+        // nodes with the same key are inserted on the right
+        node = node->right;
+    }
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_index_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_video_thumbextractor_main_conf_t     *conf = shm_zone->data;
+    ngx_http_video_thumbextractor_main_conf_t     *oconf = data;
+    ngx_slab_pool_t                               *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ngx_http_video_thumbextractor_index_cache_t   *cache;
+
+    // keep what the old workers learned on reload
+    if ((oconf != NULL) && (oconf->index_cache != NULL)) {
+        conf->index_cache = oconf->index_cache;
+        return NGX_OK;
+    }
+
+    if ((cache = ngx_slab_alloc(shpool, sizeof(ngx_http_video_thumbextractor_index_cache_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "video thumb extractor module: unable to allocate memory for the index cache");
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&cache->lru);
+
+    // a full zone is expected, the least used videos are dropped to store new ones
+    shpool->log_nomem = 0;
+    shpool->data = cache;
+
+    conf->index_cache = cache;
+
+    return NGX_OK;
+}
@@ -28,401 +28,2557 @@ ngx_http_output_header_filter_pt ngx_http_video_thumbextractor_next_header_filte
 ngx_http_output_body_filter_pt ngx_http_video_thumbextractor_next_body_filter;
 
 void        ngx_http_video_thumbextractor_fork_extract_process(ngx_uint_t slot);
+ngx_int_t   ngx_http_video_thumbextractor_spawn_persistent_process(ngx_uint_t slot);
+void        ngx_http_video_thumbextractor_send_job(ngx_uint_t slot);
 void        ngx_http_video_thumbextractor_run_extract(ngx_http_video_thumbextractor_ipc_t *ipc_ctx);
+void        ngx_http_video_thumbextractor_run_persistent_extract(ngx_http_video_thumbextractor_ipc_t *ipc_ctx);
+ngx_http_video_thumbextractor_ctx_t *ngx_http_video_thumbextractor_dequeue(ngx_http_video_thumbextractor_ipc_t *ipc_ctx);
+ngx_int_t   ngx_http_video_thumbextractor_next_priority(void);
+void        ngx_http_video_thumbextractor_mark_dequeued(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_gather_batch(ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_flag_t  ngx_http_video_thumbextractor_same_video(ngx_http_video_thumbextractor_ctx_t *a, ngx_http_video_thumbextractor_ctx_t *b);
+u_char     *ngx_http_video_thumbextractor_write_job(u_char *p, ngx_http_video_thumbextractor_ctx_t *ctx, ngx_uint_t remaining);
+void        ngx_http_video_thumbextractor_requeue(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_requeue_batch(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_abort_batch(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_drop_from_batch(ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_int_t   ngx_http_video_thumbextractor_leave_process(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_cancel_timeout_handler(ngx_event_t *ev);
+ngx_int_t   ngx_http_video_thumbextractor_discard_results(ngx_connection_t *c, ngx_http_video_thumbextractor_ipc_t *ipc_ctx);
+void        ngx_http_video_thumbextractor_set_queue_time(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_queue_timeout_handler(ngx_event_t *ev);
+void        ngx_http_video_thumbextractor_start_extract_timer(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_extract_timeout_handler(ngx_event_t *ev);
 void        ngx_http_video_thumbextractor_extract_process_read_handler(ngx_event_t *ev);
 void        ngx_http_video_thumbextractor_extract_process_write_handler(ngx_event_t *ev);
+void        ngx_http_video_thumbextractor_extract_process_send_job_handler(ngx_event_t *ev);
 void        ngx_http_video_thumbextractor_cleanup_extract_process(ngx_http_video_thumbextractor_transfer_t *transfer);
-void        ngx_http_video_thumbextractor_release_slot(ngx_int_t slot);
+void        ngx_http_video_thumbextractor_release_slot(ngx_int_t slot, ngx_flag_t keep_process);
+void        ngx_http_video_thumbextractor_cancel_extraction(ngx_int_t slot);
+ngx_int_t   ngx_http_video_thumbextractor_acquire_shared_slot(ngx_http_video_thumbextractor_ipc_t *ipc_ctx);
+ngx_int_t   ngx_http_video_thumbextractor_find_shared_slot(ngx_http_video_thumbextractor_shm_t *shm);
+ngx_flag_t  ngx_http_video_thumbextractor_shared_slot_bound(ngx_uint_t slot);
+void        ngx_http_video_thumbextractor_hand_over_shared_slot(ngx_http_video_thumbextractor_shm_t *shm, ngx_uint_t slot);
+void        ngx_http_video_thumbextractor_notify_worker(ngx_uint_t worker);
+void        ngx_http_video_thumbextractor_channel_handler(ngx_event_t *ev);
+void        ngx_http_video_thumbextractor_close_channels(void *data);
+void        ngx_http_video_thumbextractor_retry_handler(ngx_event_t *ev);
+ngx_int_t   ngx_http_video_thumbextractor_send_image(ngx_http_request_t *r, ngx_buf_t *b);
+ngx_int_t   ngx_http_video_thumbextractor_send_image_chain(ngx_http_request_t *r, ngx_chain_t *out);
+ngx_int_t   ngx_http_video_thumbextractor_send_image_header(ngx_http_request_t *r, off_t content_length);
+ngx_int_t   ngx_http_video_thumbextractor_send_image_chunk(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx, ngx_chain_t *out, ngx_flag_t last);
+ngx_int_t   ngx_http_video_thumbextractor_next_stream_buffer(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_int_t   ngx_http_video_thumbextractor_pause_stream(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx, ngx_connection_t *c);
+void        ngx_http_video_thumbextractor_stream_write_handler(ngx_http_request_t *r);
+ngx_int_t   ngx_http_video_thumbextractor_stream_chunk(void *data, u_char *buf, size_t len);
+ngx_int_t   ngx_http_video_thumbextractor_finish_stream(ngx_http_video_thumbextractor_stream_t *stream, ngx_int_t rc);
+ngx_rbtree_key_t ngx_http_video_thumbextractor_job_hash(ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_flag_t  ngx_http_video_thumbextractor_same_job(ngx_http_video_thumbextractor_ctx_t *a, ngx_http_video_thumbextractor_ctx_t *b);
+ngx_http_video_thumbextractor_ctx_t *ngx_http_video_thumbextractor_find_job(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_unregister_job(ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_int_t   ngx_http_video_thumbextractor_promote_waiter(ngx_http_video_thumbextractor_ctx_t *ctx);
+ngx_int_t   ngx_http_video_thumbextractor_move_transfer(ngx_http_video_thumbextractor_ctx_t *from_ctx, ngx_http_video_thumbextractor_ctx_t *to_ctx);
+void        ngx_http_video_thumbextractor_finish_waiters(ngx_http_video_thumbextractor_ctx_t *ctx, ngx_int_t status, ngx_chain_t *out, size_t size);
 ngx_int_t   ngx_http_video_thumbextractor_recv(ngx_connection_t *c, ngx_event_t *rev, ngx_buf_t *buf, ssize_t len);
 ngx_int_t   ngx_http_video_thumbextractor_write(ngx_connection_t *c, ngx_event_t *wev, ngx_buf_t *buf, ssize_t len);
+ngx_int_t   ngx_http_video_thumbextractor_read_fully(ngx_fd_t fd, void *buf, size_t len);
+ngx_int_t   ngx_http_video_thumbextractor_write_fully(ngx_fd_t fd, void *buf, size_t len);
 void        ngx_http_video_thumbextractor_set_buffer(ngx_buf_t *buf, u_char *start, u_char *last, ssize_t len);
+ngx_int_t   ngx_http_video_thumbextractor_write_chain(ngx_fd_t fd, ngx_chain_t *out);
+ngx_fd_t    ngx_http_video_thumbextractor_create_image_fd(ngx_chain_t *out, ngx_log_t *log);
+ngx_int_t   ngx_http_video_thumbextractor_send_fd(ngx_socket_t s, ngx_fd_t fd, ngx_log_t *log);
+ngx_int_t   ngx_http_video_thumbextractor_recv_image_fd(ngx_connection_t *c, ngx_http_request_t *r, ngx_http_video_thumbextractor_transfer_t *transfer);
+void        ngx_http_video_thumbextractor_unmap_image(void *data);
 void        ngx_http_video_thumbextractor_sig_handler(int signo);
 
+#if (NGX_THREADS)
+ngx_int_t   ngx_http_video_thumbextractor_post_thread_job(ngx_http_video_thumbextractor_ctx_t *ctx);
+void        ngx_http_video_thumbextractor_thread_handler(void *data, ngx_log_t *log);
+void        ngx_http_video_thumbextractor_thread_event_handler(ngx_event_t *ev);
+#endif
+
 static ngx_http_video_thumbextractor_transfer_t *ngx_http_video_thumbextractor_transfer = NULL;
+static ngx_event_t                               ngx_http_video_thumbextractor_retry_event;
+static ngx_http_video_thumbextractor_channels_t *ngx_http_video_thumbextractor_channels = NULL;
+static ngx_uint_t                                ngx_http_video_thumbextractor_high_priority_served = 0;
+static u_char                                    ngx_http_video_thumbextractor_discard_buffer[4096];
 
 void
 ngx_http_video_thumbextractor_module_ensure_extractor_process(void)
 {
     ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
-    ngx_int_t                                    slot = -1;
+    ngx_http_video_thumbextractor_ipc_t         *ipc_ctx;
+    ngx_int_t                                    slot = -1, idle = -1;
     ngx_uint_t                                   i;
 
-    if (ngx_queue_empty(ngx_http_video_thumbextractor_module_extract_queue) || ngx_exiting) {
+    if ((ngx_http_video_thumbextractor_next_priority() < 0) || ngx_exiting) {
+        // nothing to use a shared slot on, give the ones handed over to this worker to the next waiting
+        ngx_http_video_thumbextractor_module_stop_waiting();
         return;
     }
 
     for (i = 0; i < vtmcf->processes_per_worker; ++i) {
-        if (ngx_http_video_thumbextractor_module_ipc_ctxs[i].pid == -1) {
-            slot = i;
+        ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[i];
+
+        if (ipc_ctx->pid == -1) {
+            slot = (slot == -1) ? (ngx_int_t) i : slot;
+            continue;
+        }
+
+        if (vtmcf->persistent_processes && !ipc_ctx->processing) {
+            // prefer an idle process already running
+            idle = i;
             break;
         }
     }
 
-    if (slot >= 0) {
+    if ((idle < 0) && (slot < 0)) {
+        ngx_http_video_thumbextractor_module_stop_waiting();
+        return;
+    }
+
+    ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[(idle >= 0) ? idle : slot];
+
+    if (ngx_http_video_thumbextractor_acquire_shared_slot(ipc_ctx) != NGX_OK) {
+        // all shared processes are busy, the worker releasing one of them hands it over and notifies this one,
+        // the timer only covers a notification lost while the workers are replaced on a reload
+        if (!ngx_http_video_thumbextractor_retry_event.timer_set) {
+            ngx_http_video_thumbextractor_retry_event.handler = ngx_http_video_thumbextractor_retry_handler;
+            ngx_http_video_thumbextractor_retry_event.log = ngx_cycle->log;
+            ngx_http_video_thumbextractor_retry_event.data = NULL;
+            ngx_http_video_thumbextractor_retry_event.cancelable = 1;
+            ngx_add_timer(&ngx_http_video_thumbextractor_retry_event, NGX_HTTP_VIDEO_THUMBEXTRACTOR_SHARED_RETRY_INTERVAL);
+        }
+        return;
+    }
+
+    if (idle >= 0) {
+        ngx_http_video_thumbextractor_send_job(idle);
+        return;
+    }
+
+    if (!vtmcf->persistent_processes) {
         ngx_http_video_thumbextractor_fork_extract_process(slot);
+        return;
+    }
+
+    if (ngx_http_video_thumbextractor_spawn_persistent_process(slot) == NGX_OK) {
+        ngx_http_video_thumbextractor_send_job(slot);
+    } else {
+        ngx_http_video_thumbextractor_module_release_shared_slot(ipc_ctx);
     }
 }
 
 
 void
-ngx_http_video_thumbextractor_fork_extract_process(ngx_uint_t slot)
+ngx_http_video_thumbextractor_retry_handler(ngx_event_t *ev)
 {
-    ngx_http_video_thumbextractor_ipc_t      *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[slot];
-    ngx_http_video_thumbextractor_transfer_t *transfer;
-    ngx_http_video_thumbextractor_ctx_t      *ctx;
-    ngx_queue_t                              *q;
-    int                                       ret;
-    ngx_pid_t                                 pid;
-    ngx_event_t                              *rev;
+    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+}
 
-    q = ngx_queue_head(ngx_http_video_thumbextractor_module_extract_queue);
-    ngx_queue_remove(q);
-    ngx_queue_init(q);
-    ctx = ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue);
 
-    ipc_ctx->pipefd[0] = -1;
-    ipc_ctx->pipefd[1] = -1;
-    ipc_ctx->request = ctx->request;
-    ctx->slot = slot;
-    transfer = &ctx->transfer;
+void
+ngx_http_video_thumbextractor_module_cancel_retry(void)
+{
+    if (ngx_http_video_thumbextractor_retry_event.timer_set) {
+        ngx_del_timer(&ngx_http_video_thumbextractor_retry_event);
+    }
+}
 
-    if (pipe(ipc_ctx->pipefd) == -1) {
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to initialize a pipe");
-        return;
+
+ngx_int_t
+ngx_http_video_thumbextractor_module_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_video_thumbextractor_main_conf_t   *conf = shm_zone->data;
+    ngx_http_video_thumbextractor_main_conf_t   *oconf = data;
+    ngx_slab_pool_t                             *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ngx_http_video_thumbextractor_shm_t         *shm;
+    ngx_uint_t                                   i;
+
+    // keep the slots in use by the old workers on reload
+    if ((oconf != NULL) && (oconf->shm != NULL) && (oconf->shm->size == conf->shared_processes)) {
+        conf->shm = oconf->shm;
+        return NGX_OK;
     }
 
-    /* make pipe write end survive through exec */
+    if ((shm = ngx_slab_alloc(shpool, sizeof(ngx_http_video_thumbextractor_shm_t) + (conf->shared_processes - 1) * sizeof(ngx_atomic_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "video thumb extractor module: unable to allocate memory for the shared processes");
+        return NGX_ERROR;
+    }
 
-    ret = fcntl(ipc_ctx->pipefd[1], F_GETFD);
+    shm->size = conf->shared_processes;
+    for (i = 0; i < shm->size; i++) {
+        shm->owners[i] = 0;
+    }
 
-    if (ret != -1) {
-        ret &= ~FD_CLOEXEC;
-        ret = fcntl(ipc_ctx->pipefd[1], F_SETFD, ret);
+    shm->waiting = 0;
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        shm->waiters[i] = 0;
     }
 
-    if (ret == -1) {
-        close(ipc_ctx->pipefd[0]);
-        close(ipc_ctx->pipefd[1]);
+    conf->shm = shm;
 
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to make pipe write end live longer");
-        return;
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_acquire_shared_slot(ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_shm_t         *shm = vtmcf->shm;
+    ngx_int_t                                    i;
+
+    if ((shm == NULL) || (ipc_ctx->shared_slot != -1)) {
+        return NGX_OK;
     }
 
-    /* ignore the signal when the child dies */
-    signal(SIGCHLD, SIG_IGN);
+    if ((i = ngx_http_video_thumbextractor_find_shared_slot(shm)) != -1) {
+        ipc_ctx->shared_slot = i;
+        return NGX_OK;
+    }
 
-    pid = fork();
+    // the next worker releasing a slot hands it over to this one
+    if (ngx_atomic_cmp_set(&shm->waiters[ngx_worker], 0, ngx_pid)) {
+        (void) ngx_atomic_fetch_add(&shm->waiting, 1);
+    }
 
-    switch (pid) {
+    // a slot may have been released before this worker was set as waiting
+    if ((i = ngx_http_video_thumbextractor_find_shared_slot(shm)) != -1) {
+        ipc_ctx->shared_slot = i;
+        if (ngx_atomic_cmp_set(&shm->waiters[ngx_worker], ngx_pid, 0)) {
+            (void) ngx_atomic_fetch_add(&shm->waiting, -1);
+        }
+        return NGX_OK;
+    }
 
-    case -1:
-        /* failure */
-        if (ipc_ctx->pipefd[0] != -1) {
-            close(ipc_ctx->pipefd[0]);
+    return NGX_BUSY;
+}
+
+
+/* a slot handed over to this worker and not used yet, or a free one */
+ngx_int_t
+ngx_http_video_thumbextractor_find_shared_slot(ngx_http_video_thumbextractor_shm_t *shm)
+{
+    ngx_uint_t                                   i;
+
+    for (i = 0; i < shm->size; i++) {
+        if ((shm->owners[i] == (ngx_atomic_uint_t) ngx_pid) && !ngx_http_video_thumbextractor_shared_slot_bound(i)) {
+            return i;
         }
+    }
 
-        if (ipc_ctx->pipefd[1] != -1) {
-            close(ipc_ctx->pipefd[1]);
+    for (i = 0; i < shm->size; i++) {
+        if ((shm->owners[i] == 0) && ngx_atomic_cmp_set(&shm->owners[i], 0, ngx_pid)) {
+            return i;
         }
+    }
 
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to fork the process");
+    return -1;
+}
 
-        break;
 
-    case 0:
-        /* child */
+ngx_flag_t
+ngx_http_video_thumbextractor_shared_slot_bound(ngx_uint_t slot)
+{
+    ngx_uint_t                                   i;
 
-#if (NGX_LINUX)
-        prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
-#endif
-        if (ipc_ctx->pipefd[0] != -1) {
-            close(ipc_ctx->pipefd[0]);
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        if (ngx_http_video_thumbextractor_module_ipc_ctxs[i].shared_slot == (ngx_int_t) slot) {
+            return 1;
         }
+    }
 
-        ngx_pid = ngx_getpid();
-        ngx_setproctitle("thumb extractor");
-        ngx_http_video_thumbextractor_run_extract(ipc_ctx);
-        break;
+    return 0;
+}
 
-    default:
-        /* parent */
-        if (ipc_ctx->pipefd[1] != -1) {
-            close(ipc_ctx->pipefd[1]);
+
+void
+ngx_http_video_thumbextractor_module_release_shared_slot(ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_int_t                                    slot = ipc_ctx->shared_slot;
+
+    ipc_ctx->shared_slot = -1;
+
+    if ((vtmcf != NULL) && (vtmcf->shm != NULL) && (slot != -1)) {
+        ngx_http_video_thumbextractor_hand_over_shared_slot(vtmcf->shm, slot);
+    }
+}
+
+
+/* give the slot straight to a waiting worker, so this one can not take it back before the others are notified */
+void
+ngx_http_video_thumbextractor_hand_over_shared_slot(ngx_http_video_thumbextractor_shm_t *shm, ngx_uint_t slot)
+{
+    ngx_atomic_uint_t                            pid;
+    ngx_uint_t                                   i, worker;
+
+    // start on the next worker number, so the waiting ones take turns
+    for (i = 1; (i <= NGX_MAX_PROCESSES) && (shm->waiting > 0); i++) {
+        worker = (ngx_worker + i) % NGX_MAX_PROCESSES;
+        pid = shm->waiters[worker];
+
+        if ((pid == 0) || (pid == (ngx_atomic_uint_t) ngx_pid) || !ngx_atomic_cmp_set(&shm->waiters[worker], pid, 0)) {
+            continue;
         }
 
-        if (ipc_ctx->pipefd[0] != -1) {
-            ipc_ctx->pid = pid;
-            ipc_ctx->conn = ngx_get_connection(ipc_ctx->pipefd[0], ngx_cycle->log);
-            ipc_ctx->conn->data = ipc_ctx;
+        (void) ngx_atomic_fetch_add(&shm->waiting, -1);
 
-            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
-            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->rc, NULL, sizeof(ngx_int_t));
+        // notified even if the slot was recovered meanwhile, to look for another one
+        ngx_atomic_cmp_set(&shm->owners[slot], ngx_pid, pid);
+        ngx_http_video_thumbextractor_notify_worker(worker);
 
-            rev = ipc_ctx->conn->read;
-            rev->log = ngx_cycle->log;
-            rev->handler = ngx_http_video_thumbextractor_extract_process_read_handler;
+        return;
+    }
 
-            if (ngx_add_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
-                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: failed to add child control event");
-            }
+    ngx_atomic_cmp_set(&shm->owners[slot], ngx_pid, 0);
+}
+
+
+void
+ngx_http_video_thumbextractor_module_stop_waiting(void)
+{
+    ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_shm_t         *shm;
+    ngx_uint_t                                   i;
+
+    if ((vtmcf == NULL) || ((shm = vtmcf->shm) == NULL)) {
+        return;
+    }
+
+    if (ngx_atomic_cmp_set(&shm->waiters[ngx_worker], ngx_pid, 0)) {
+        (void) ngx_atomic_fetch_add(&shm->waiting, -1);
+    }
+
+    for (i = 0; i < shm->size; i++) {
+        if ((shm->owners[i] == (ngx_atomic_uint_t) ngx_pid) && !ngx_http_video_thumbextractor_shared_slot_bound(i)) {
+            ngx_http_video_thumbextractor_hand_over_shared_slot(shm, i);
         }
-        break;
     }
 }
 
 
 void
-ngx_http_video_thumbextractor_run_extract(ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+ngx_http_video_thumbextractor_module_recover_shared_slots(void)
 {
-    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf;
-    ngx_http_video_thumbextractor_transfer_t  *transfer;
-    ngx_http_video_thumbextractor_ctx_t       *ctx;
-    ngx_http_request_t                        *r;
-    ngx_pool_t                                *temp_pool;
-    ngx_event_t                               *wev;
-    ngx_int_t                                  rc = NGX_ERROR;
-    ngx_log_t                                 *log;
-    ngx_cycle_t                               *cycle;
-    ngx_pool_t                                *pool;
-    ngx_int_t                                  i;
+    ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_shm_t         *shm;
+    ngx_atomic_uint_t                            owner;
+    ngx_uint_t                                   i;
 
-    ngx_done_events((ngx_cycle_t *) ngx_cycle);
+    if ((vtmcf == NULL) || ((shm = vtmcf->shm) == NULL)) {
+        return;
+    }
 
-    if (signal(SIGTERM, ngx_http_video_thumbextractor_sig_handler) == SIG_ERR) {
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: could not set the catch signal for SIGTERM");
+    // release slots left behind by workers which died in the middle of an extraction
+    for (i = 0; i < shm->size; i++) {
+        owner = shm->owners[i];
+        if ((owner != 0) && ((owner == (ngx_atomic_uint_t) ngx_pid) || ((kill(owner, 0) == -1) && (ngx_errno == NGX_ESRCH)))) {
+            ngx_atomic_cmp_set(&shm->owners[i], owner, 0);
+        }
     }
 
-    log = ngx_cycle->log;
+    // and the places they had on the waiting list
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        owner = shm->waiters[i];
+        if ((owner != 0) && ((owner == (ngx_atomic_uint_t) ngx_pid) || ((kill(owner, 0) == -1) && (ngx_errno == NGX_ESRCH)))) {
+            if (ngx_atomic_cmp_set(&shm->waiters[i], owner, 0)) {
+                (void) ngx_atomic_fetch_add(&shm->waiting, -1);
+            }
+        }
+    }
+}
 
-    pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, log);
-    if (pool == NULL) {
-        exit(1);
+
+ngx_int_t
+ngx_http_video_thumbextractor_module_create_channels(ngx_cycle_t *cycle)
+{
+    ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_video_thumbextractor_module);
+    ngx_core_conf_t                             *ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+    ngx_http_video_thumbextractor_channels_t    *channels;
+    ngx_pool_cleanup_t                          *cln;
+    ngx_uint_t                                   i;
+
+    ngx_http_video_thumbextractor_channels = NULL;
+
+    if ((vtmcf == NULL) || (vtmcf->shm_zone == NULL)) {
+        return NGX_OK;
     }
-    pool->log = log;
 
-    cycle = ngx_pcalloc(pool, sizeof(ngx_cycle_t));
-    if (cycle == NULL) {
-        ngx_destroy_pool(pool);
-        exit(1);
+    if (((channels = ngx_pcalloc(cycle->pool, sizeof(ngx_http_video_thumbextractor_channels_t))) == NULL) ||
+        ((channels->fds = ngx_pcalloc(cycle->pool, ccf->worker_processes * sizeof(ngx_socket_t) * 2)) == NULL) ||
+        ((cln = ngx_pool_cleanup_add(cycle->pool, 0)) == NULL)) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "video thumb extractor module: unable to allocate memory for the workers channels");
+        return NGX_ERROR;
     }
 
-    cycle->pool = pool;
-    cycle->log = log;
-    cycle->new_log.log_level = NGX_LOG_ERR;
-    cycle->old_cycle = (ngx_cycle_t *) ngx_cycle;
-    cycle->conf_ctx = ngx_cycle->conf_ctx;
-    cycle->conf_file = ngx_cycle->conf_file;
-    cycle->conf_param = ngx_cycle->conf_param;
-    cycle->conf_prefix = ngx_cycle->conf_prefix;
+    cln->handler = ngx_http_video_thumbextractor_close_channels;
+    cln->data = channels;
 
-    cycle->connection_n = 16;
-    cycle->modules = ngx_modules;
+    for (i = 0; i < (ngx_uint_t) ccf->worker_processes; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, channels->fds[i]) == -1) {
+            ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno, "video thumb extractor module: socketpair failed for the workers channels");
+            return NGX_ERROR;
+        }
 
-    ngx_process = NGX_PROCESS_HELPER;
+        channels->n = i + 1;
 
-    for (i = 0; ngx_modules[i]; i++) {
-        if ((ngx_modules[i]->type == NGX_EVENT_MODULE) && ngx_modules[i]->init_process) {
-            if (ngx_modules[i]->init_process(cycle) == NGX_ERROR) {
-                /* fatal */
-                exit(2);
-            }
+        if ((ngx_nonblocking(channels->fds[i][0]) == -1) || (ngx_nonblocking(channels->fds[i][1]) == -1)) {
+            ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_socket_errno, "video thumb extractor module: " ngx_nonblocking_n " failed for the workers channels");
+            return NGX_ERROR;
         }
     }
 
-    ngx_close_listening_sockets(cycle);
+    ngx_http_video_thumbextractor_channels = channels;
 
-    ngx_cycle = cycle;
+    return NGX_OK;
+}
 
-    if ((temp_pool = ngx_create_pool(4096, ngx_cycle->log)) == NULL) {
-        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate temporary pool to extract the thumb");
-        if (ngx_write_fd(ipc_ctx->pipefd[1], &rc, sizeof(ngx_int_t)) <= 0) {
-            exit(1);
-        }
+
+void
+ngx_http_video_thumbextractor_close_channels(void *data)
+{
+    ngx_http_video_thumbextractor_channels_t    *channels = data;
+    ngx_uint_t                                   i;
+
+    for (i = 0; i < channels->n; i++) {
+        ngx_close_socket(channels->fds[i][0]);
+        ngx_close_socket(channels->fds[i][1]);
     }
 
-    if ((transfer = ngx_pcalloc(temp_pool, sizeof(ngx_http_video_thumbextractor_transfer_t))) == NULL) {
-        ngx_destroy_pool(temp_pool);
-        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate transfer structure");
-        if (ngx_write_fd(ipc_ctx->pipefd[1], &rc, sizeof(ngx_int_t)) <= 0) {
-            exit(1);
-        }
+    if (ngx_http_video_thumbextractor_channels == channels) {
+        ngx_http_video_thumbextractor_channels = NULL;
     }
-    transfer->pool = temp_pool;
-    ngx_http_video_thumbextractor_transfer = transfer;
+}
 
-    r = ipc_ctx->request;
-    if (r == NULL) {
-        if (ngx_write_fd(ipc_ctx->pipefd[1], &rc, sizeof(ngx_int_t)) <= 0) {
-            exit(1);
-        }
+
+ngx_int_t
+ngx_http_video_thumbextractor_module_open_channel(void)
+{
+    ngx_http_video_thumbextractor_channels_t    *channels = ngx_http_video_thumbextractor_channels;
+    ngx_connection_t                            *c;
+
+    if ((channels == NULL) || (ngx_worker >= channels->n)) {
+        return NGX_OK;
     }
 
-    vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
-    ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+    if ((c = ngx_get_connection(channels->fds[ngx_worker][0], ngx_cycle->log)) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "video thumb extractor module: unable to get a connection for the worker channel");
+        return NGX_ERROR;
+    }
+
+    c->data = NULL;
+    c->read->log = ngx_cycle->log;
+    c->read->handler = ngx_http_video_thumbextractor_channel_handler;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_video_thumbextractor_notify_worker(ngx_uint_t worker)
+{
+    ngx_http_video_thumbextractor_channels_t    *channels = ngx_http_video_thumbextractor_channels;
+    u_char                                       byte = 1;
+
+    if ((channels == NULL) || (worker >= channels->n)) {
+        return;
+    }
+
+    // a full channel already has enough wake ups for the worker
+    if ((write(channels->fds[worker][1], &byte, 1) == -1) && (ngx_socket_errno != NGX_EAGAIN)) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_socket_errno, "video thumb extractor module: unable to notify the worker %ui", worker);
+    }
+}
+
+
+void
+ngx_http_video_thumbextractor_channel_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                            *c = ev->data;
+    u_char                                       buf[16];
+    ssize_t                                      n, i;
+
+    // one byte for each slot handed over to this worker
+    while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            ngx_http_video_thumbextractor_module_ensure_extractor_process();
+        }
+    }
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_module_enqueue(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_get_module_main_conf(ctx->request, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_ctx_t       *leader;
+    // a streamed image can not be shared, part of it may be already sent when another request arrives,
+    // neither the one extracted from a partial body, which may have to be extracted again
+    ngx_flag_t                                 coalesce = vtlcf->coalesce_requests && !vtlcf->stream_output && !ctx->early;
+#if (NGX_THREADS)
+    ngx_int_t                                  rc;
+#endif
+
+    if (coalesce) {
+        ctx->node.key = ngx_http_video_thumbextractor_job_hash(ctx);
+
+        if ((leader = ngx_http_video_thumbextractor_find_job(ctx)) != NULL) {
+            // an identical extraction is already pending, wait for its result
+            ctx->queued_at = ngx_current_msec;
+            ctx->leader = leader;
+            ngx_queue_insert_tail(&leader->waiters, &ctx->waiting);
+            if (leader->dequeued) {
+                ngx_http_video_thumbextractor_set_queue_time(ctx);
+            }
+            ctx->request->main->count++;
+            return NGX_OK;
+        }
+    }
+
+#if (NGX_THREADS)
+    if (vtlcf->thread_pool != NULL) {
+        // the thread pool has its own queue, limited by its max_queue parameter
+        if ((rc = ngx_http_video_thumbextractor_post_thread_job(ctx)) != NGX_OK) {
+            return rc;
+        }
+
+        if (coalesce) {
+            ngx_rbtree_insert(&ngx_http_video_thumbextractor_module_jobs, &ctx->node);
+            ctx->registered = 1;
+        }
+
+        ngx_http_video_thumbextractor_start_extract_timer(ctx);
+
+        ctx->request->main->count++;
+        return NGX_OK;
+    }
+#endif
+
+    if ((vtmcf->max_queue_size > 0) && (ngx_http_video_thumbextractor_module_extract_queue_size >= vtmcf->max_queue_size)) {
+        return NGX_BUSY;
+    }
+
+    if (coalesce) {
+        ngx_rbtree_insert(&ngx_http_video_thumbextractor_module_jobs, &ctx->node);
+        ctx->registered = 1;
+    }
+
+    ctx->queued_at = ngx_current_msec;
+    ctx->request->main->count++;
+
+    if (vtlcf->queue_timeout > 0) {
+        ctx->deadline.handler = ngx_http_video_thumbextractor_queue_timeout_handler;
+        ctx->deadline.data = ctx;
+        ctx->deadline.log = ctx->request->connection->log;
+        ngx_add_timer(&ctx->deadline, vtlcf->queue_timeout);
+    }
+
+    ngx_queue_insert_tail(&ngx_http_video_thumbextractor_module_extract_queue[ctx->priority], &ctx->queue);
+    ngx_http_video_thumbextractor_module_extract_queue_size++;
+
+    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_next_priority(void)
+{
+    ngx_http_video_thumbextractor_main_conf_t   *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_queue_t                                 *queue = ngx_http_video_thumbextractor_module_extract_queue;
+    ngx_flag_t                                   high, low;
+    ngx_uint_t                                   i, busy = 0;
+
+    high = !ngx_queue_empty(&queue[NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_HIGH]);
+    low = !ngx_queue_empty(&queue[NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW]);
+
+    if (low && (vtmcf->reserved_processes > 0)) {
+        for (i = 0; i < vtmcf->processes_per_worker; ++i) {
+            busy += ngx_http_video_thumbextractor_module_ipc_ctxs[i].processing ? 1 : 0;
+        }
+
+        // keep some processes free to the high priority requests
+        low = (busy + vtmcf->reserved_processes < vtmcf->processes_per_worker);
+    }
+
+    if (high && low) {
+        return (ngx_http_video_thumbextractor_high_priority_served >= vtmcf->high_priority_weight) ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW : NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_HIGH;
+    }
+
+    return high ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_HIGH : (low ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW : -1);
+}
+
+
+void
+ngx_http_video_thumbextractor_module_remove_request(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    if (ctx->leader != NULL) {
+        ngx_queue_remove(&ctx->waiting);
+        ngx_queue_init(&ctx->waiting);
+        ctx->leader = NULL;
+        return;
+    }
+
+    if (!ngx_queue_empty(&ctx->waiters)) {
+        if (ngx_http_video_thumbextractor_promote_waiter(ctx) == NGX_OK) {
+            return;
+        }
+
+        ngx_http_video_thumbextractor_finish_waiters(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR, NULL, 0);
+    }
+
+    ngx_http_video_thumbextractor_unregister_job(ctx);
+
+    if (ctx->slot >= 0) {
+        if (!ngx_queue_empty(&ctx->queue)) {
+            // a request waiting for its turn on the batch, the process goes on with the others
+            ngx_http_video_thumbextractor_drop_from_batch(ctx);
+        } else if (ngx_http_video_thumbextractor_leave_process(ctx) == NGX_OK) {
+            // the persistent process is kept, its result is read and dropped
+        } else if (!ngx_queue_empty(&ctx->batch)) {
+            ngx_http_video_thumbextractor_abort_batch(ctx);
+        } else {
+            ngx_http_video_thumbextractor_cancel_extraction(ctx->slot);
+        }
+        ctx->slot = -1;
+    }
+
+    if (ctx->thread_job != NULL) {
+        // the thread stops on the next read or frame, its result will be discarded
+        ngx_atomic_cmp_set(&ctx->thread_job->cancelled, 0, 1);
+        ctx->thread_job->ctx = NULL;
+        ctx->thread_job = NULL;
+    }
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    if (!ngx_queue_empty(&ctx->queue)) {
+        ngx_queue_remove(&ctx->queue);
+        ngx_queue_init(&ctx->queue);
+        ngx_http_video_thumbextractor_module_extract_queue_size--;
+    }
+}
+
+
+void
+ngx_http_video_thumbextractor_set_queue_time(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    if (!ctx->dequeued) {
+        ctx->queue_time = ngx_current_msec - ctx->queued_at;
+        ctx->dequeued = 1;
+    }
+}
+
+
+void
+ngx_http_video_thumbextractor_queue_timeout_handler(ngx_event_t *ev)
+{
+    ngx_http_video_thumbextractor_ctx_t       *ctx = ev->data;
+    ngx_http_request_t                        *r = ctx->request;
+
+    ngx_http_video_thumbextractor_set_queue_time(ctx);
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "video thumb extractor module: no extractor process available after waiting %M ms", ctx->queue_time);
+
+    ngx_queue_remove(&ctx->queue);
+    ngx_queue_init(&ctx->queue);
+    ngx_http_video_thumbextractor_module_extract_queue_size--;
+
+    ngx_http_video_thumbextractor_finish_waiters(ctx, NGX_HTTP_SERVICE_UNAVAILABLE, NULL, 0);
+
+    ctx->retry_after = 1;
+    ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_SERVICE_UNAVAILABLE);
+    ngx_http_video_thumbextractor_finalize_request(r);
+}
+
+
+void
+ngx_http_video_thumbextractor_start_extract_timer(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module);
+
+    if (vtlcf->extract_timeout == 0) {
+        return;
+    }
+
+    // the same event limits the time on the queue and then the time extracting
+    ctx->deadline.handler = ngx_http_video_thumbextractor_extract_timeout_handler;
+    ctx->deadline.data = ctx;
+    ctx->deadline.log = ctx->request->connection->log;
+    ngx_add_timer(&ctx->deadline, vtlcf->extract_timeout);
+}
+
+
+void
+ngx_http_video_thumbextractor_extract_timeout_handler(ngx_event_t *ev)
+{
+    ngx_http_video_thumbextractor_ctx_t       *ctx = ev->data;
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module);
+    ngx_http_request_t                        *r = ctx->request;
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "video thumb extractor module: extraction of \"%V\" took more than %M ms", &ctx->thumb_ctx.filename, vtlcf->extract_timeout);
+
+    ngx_http_video_thumbextractor_finish_waiters(ctx, NGX_HTTP_GATEWAY_TIME_OUT, NULL, 0);
+
+    // stop the extraction and give the slot to the next request
+    ngx_http_video_thumbextractor_module_remove_request(ctx);
+    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+
+    if (r->header_sent) {
+        // part of the image was already streamed, the response can only be interrupted
+        r->connection->error = 1;
+    } else {
+        ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_GATEWAY_TIME_OUT);
+    }
+    ngx_http_video_thumbextractor_finalize_request(r);
+}
+
+
+ngx_rbtree_key_t
+ngx_http_video_thumbextractor_job_hash(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_thumb_ctx_t *thumb_ctx = &ctx->thumb_ctx;
+    uint32_t                                   crc;
+    int64_t                                    values[] = {
+        (int64_t) (uintptr_t) ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module),
+        thumb_ctx->file_info.offset,
+        thumb_ctx->second,
+        thumb_ctx->width,
+        thumb_ctx->height,
+        thumb_ctx->tile_sample_interval,
+        thumb_ctx->tile_cols,
+        thumb_ctx->tile_max_cols,
+        thumb_ctx->tile_rows,
+        thumb_ctx->tile_max_rows,
+        thumb_ctx->tile_margin,
+        thumb_ctx->tile_padding
+    };
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, (u_char *) values, sizeof(values));
+    ngx_crc32_update(&crc, thumb_ctx->filename.data, thumb_ctx->filename.len);
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+ngx_flag_t
+ngx_http_video_thumbextractor_same_job(ngx_http_video_thumbextractor_ctx_t *a, ngx_http_video_thumbextractor_ctx_t *b)
+{
+    ngx_http_video_thumbextractor_thumb_ctx_t *ta = &a->thumb_ctx, *tb = &b->thumb_ctx;
+
+    return (ngx_http_get_module_loc_conf(a->request, ngx_http_video_thumbextractor_module) == ngx_http_get_module_loc_conf(b->request, ngx_http_video_thumbextractor_module)) &&
+           (ta->file_info.offset == tb->file_info.offset) &&
+           (ta->second == tb->second) &&
+           (ta->width == tb->width) &&
+           (ta->height == tb->height) &&
+           (ta->tile_sample_interval == tb->tile_sample_interval) &&
+           (ta->tile_cols == tb->tile_cols) &&
+           (ta->tile_max_cols == tb->tile_max_cols) &&
+           (ta->tile_rows == tb->tile_rows) &&
+           (ta->tile_max_rows == tb->tile_max_rows) &&
+           (ta->tile_margin == tb->tile_margin) &&
+           (ta->tile_padding == tb->tile_padding) &&
+           (ta->filename.len == tb->filename.len) &&
+           (ngx_memcmp(ta->filename.data, tb->filename.data, ta->filename.len) == 0);
+}
+
+
+ngx_http_video_thumbextractor_ctx_t *
+ngx_http_video_thumbextractor_find_job(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_ctx_t       *leader;
+    ngx_rbtree_node_t                         *node = ngx_http_video_thumbextractor_module_jobs.root;
+    ngx_rbtree_node_t                         *sentinel = ngx_http_video_thumbextractor_module_jobs.sentinel;
+
+    while (node != sentinel) {
+
+        if (ctx->node.key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (ctx->node.key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        leader = (ngx_http_video_thumbextractor_ctx_t *) ((u_char *) node - offsetof(ngx_http_video_thumbextractor_ctx_t, node));
+        if (ngx_http_video_thumbextractor_same_job(ctx, leader)) {
+            return leader;
+        }
+
+        // hash collision, the equal keys are inserted on the right
+        node = node->right;
+    }
+
+    return NULL;
+}
+
+
+void
+ngx_http_video_thumbextractor_unregister_job(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    if (ctx->registered) {
+        ngx_rbtree_delete(&ngx_http_video_thumbextractor_module_jobs, &ctx->node);
+        ctx->registered = 0;
+    }
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_promote_waiter(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_ctx_t       *next;
+    ngx_queue_t                               *q;
+
+    q = ngx_queue_head(&ctx->waiters);
+    next = ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, waiting);
+
+    // the first waiter takes over the extraction in progress
+    if ((ctx->slot >= 0) && (ngx_http_video_thumbextractor_move_transfer(ctx, next) != NGX_OK)) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_remove(q);
+    ngx_queue_init(q);
+    next->leader = NULL;
+
+    while (!ngx_queue_empty(&ctx->waiters)) {
+        q = ngx_queue_head(&ctx->waiters);
+        ngx_queue_remove(q);
+        ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, waiting)->leader = next;
+        ngx_queue_insert_tail(&next->waiters, q);
+    }
+
+    if (ctx->registered) {
+        ngx_http_video_thumbextractor_unregister_job(ctx);
+        ngx_rbtree_insert(&ngx_http_video_thumbextractor_module_jobs, &next->node);
+        next->registered = 1;
+    }
+
+    if (ctx->deadline.timer_set) {
+        // keep the deadline of the request which was queued first
+        next->deadline.handler = ctx->deadline.handler;
+        next->deadline.data = next;
+        next->deadline.log = next->request->connection->log;
+        ngx_add_timer(&next->deadline, (ngx_msec_int_t) (ctx->deadline.timer.key - ngx_current_msec) > 0 ? ctx->deadline.timer.key - ngx_current_msec : 1);
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    if (!ngx_queue_empty(&ctx->queue)) {
+        next->priority = ctx->priority;
+        ngx_queue_insert_after(&ctx->queue, &next->queue);
+        ngx_queue_remove(&ctx->queue);
+        ngx_queue_init(&ctx->queue);
+    }
+
+    if (ctx->thread_job != NULL) {
+        next->thread_job = ctx->thread_job;
+        next->thread_job->ctx = next;
+        ctx->thread_job = NULL;
+    }
+
+    if (!ngx_queue_empty(&ctx->batch)) {
+        ngx_queue_add(&next->batch, &ctx->batch);
+        ngx_queue_init(&ctx->batch);
+    }
+    next->skip = ctx->skip;
+
+    if (ctx->slot >= 0) {
+        next->slot = ctx->slot;
+        if (ngx_http_video_thumbextractor_module_ipc_ctxs[ctx->slot].request == ctx->request) {
+            ngx_http_video_thumbextractor_module_ipc_ctxs[ctx->slot].request = next->request;
+        }
+        ctx->slot = -1;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_move_transfer(ngx_http_video_thumbextractor_ctx_t *from_ctx, ngx_http_video_thumbextractor_ctx_t *to_ctx)
+{
+    ngx_http_video_thumbextractor_transfer_t  *from = &from_ctx->transfer, *to = &to_ctx->transfer;
+    size_t                                     received = from->buffer.last - from->buffer.start;
+    size_t                                     len = from->buffer.end - from->buffer.start;
+    u_char                                    *start;
+
+    *to = *from;
+
+    switch (from->step) {
+    case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_JOB:
+        // the descriptor of the video may be closed with the request which is going away
+        if ((from->fd != NGX_INVALID_FILE) && ((to->fd = to_ctx->thumb_ctx.file_info.fd) == NGX_INVALID_FILE)) {
+            ngx_log_error(NGX_LOG_ERR, to_ctx->request->connection->log, 0, "video thumb extractor module: unable to take over the descriptor of the video");
+            return NGX_ERROR;
+        }
+        /* fall through */
+
+    case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA:
+        // buffers allocated on the pool of the request which is going away
+        if ((start = ngx_palloc(to_ctx->request->pool, len)) == NULL) {
+            ngx_log_error(NGX_LOG_CRIT, to_ctx->request->connection->log, 0, "video thumb extractor module: unable to allocate buffer to take over the extraction");
+            return NGX_ERROR;
+        }
+        ngx_memcpy(start, from->buffer.start, received);
+        break;
+
+    case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC:
+        start = (u_char *) &to->rc;
+        break;
+
+    case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN:
+        start = (u_char *) &to->size;
+        break;
+
+    default:
+        return NGX_OK;
+    }
+
+    ngx_http_video_thumbextractor_set_buffer(&to->buffer, start, start + received, len);
+    to->buffer.temporary = from->buffer.temporary;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_video_thumbextractor_finish_waiters(ngx_http_video_thumbextractor_ctx_t *ctx, ngx_int_t status, ngx_chain_t *out, size_t size)
+{
+    ngx_http_video_thumbextractor_ctx_t       *waiter;
+    ngx_http_request_t                        *r;
+    ngx_queue_t                               *q;
+    ngx_chain_t                               *cl;
+    ngx_buf_t                                 *b;
+
+    // new requests should not wait for an extraction already finished
+    ngx_http_video_thumbextractor_unregister_job(ctx);
+
+    while (!ngx_queue_empty(&ctx->waiters)) {
+        q = ngx_queue_head(&ctx->waiters);
+        ngx_queue_remove(q);
+        ngx_queue_init(q);
+
+        waiter = ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, waiting);
+        waiter->leader = NULL;
+        waiter->retry_after = (status == NGX_HTTP_SERVICE_UNAVAILABLE);
+        ngx_http_video_thumbextractor_set_queue_time(waiter);
+        r = waiter->request;
+
+        if (status != NGX_HTTP_OK) {
+            ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, status);
+        } else if ((b = ngx_create_temp_buf(r->pool, size)) == NULL) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate buffer to copy the image");
+            ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        } else {
+            // the image lives on the pool of the leader, which may finish before the waiter,
+            // and the buffers may be already consumed by its output, so copy from their start
+            for (cl = out; cl; cl = cl->next) {
+                b->last = ngx_cpymem(b->last, cl->buf->start, cl->buf->last - cl->buf->start);
+            }
+            ngx_http_video_thumbextractor_send_image(r, b);
+        }
+
+        ngx_http_finalize_request(r, NGX_OK);
+    }
+}
+
+
+ngx_http_video_thumbextractor_ctx_t *
+ngx_http_video_thumbextractor_dequeue(ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+{
+    ngx_http_video_thumbextractor_ctx_t      *ctx;
+    ngx_queue_t                              *queue = ngx_http_video_thumbextractor_module_extract_queue;
+    ngx_queue_t                              *q;
+    ngx_int_t                                 priority;
+
+    priority = ngx_http_video_thumbextractor_next_priority();
+
+    if (priority == NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW) {
+        ngx_http_video_thumbextractor_high_priority_served = 0;
+    } else if (!ngx_queue_empty(&queue[NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITY_LOW])) {
+        // count only the turns the low priority requests were passed over
+        ngx_http_video_thumbextractor_high_priority_served++;
+    }
+
+    q = ngx_queue_head(&queue[priority]);
+    ngx_queue_remove(q);
+    ngx_queue_init(q);
+    ctx = ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue);
+    ngx_http_video_thumbextractor_mark_dequeued(ctx);
+    ngx_http_video_thumbextractor_start_extract_timer(ctx);
+
+    ipc_ctx->request = ctx->request;
+    ipc_ctx->processing = 1;
+    ctx->slot = ipc_ctx->slot;
+
+    return ctx;
+}
+
+
+void
+ngx_http_video_thumbextractor_mark_dequeued(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_queue_t                              *q;
+
+    ngx_http_video_thumbextractor_module_extract_queue_size--;
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    ngx_http_video_thumbextractor_set_queue_time(ctx);
+    for (q = ngx_queue_head(&ctx->waiters); q != ngx_queue_sentinel(&ctx->waiters); q = ngx_queue_next(q)) {
+        ngx_http_video_thumbextractor_set_queue_time(ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, waiting));
+    }
+}
+
+
+void
+ngx_http_video_thumbextractor_gather_batch(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_ctx_t       *other;
+    ngx_queue_t                               *queue = ngx_http_video_thumbextractor_module_extract_queue;
+    ngx_queue_t                               *q, *next, *p;
+    ngx_uint_t                                 i, n = 1;
+
+    for (i = 0; (i < NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITIES) && (n < vtmcf->batch_size); ++i) {
+        for (q = ngx_queue_head(&queue[i]); (q != ngx_queue_sentinel(&queue[i])) && (n < vtmcf->batch_size); q = next) {
+            next = ngx_queue_next(q);
+            other = ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue);
+
+            if (!ngx_http_video_thumbextractor_same_video(ctx, other)) {
+                continue;
+            }
+
+            // its extraction timer only starts when its turn comes, the process does one request at a time
+            ngx_queue_remove(q);
+            ngx_http_video_thumbextractor_mark_dequeued(other);
+            other->slot = ctx->slot;
+
+            // keep the batch ordered by the requested second, to move forward on the video
+            for (p = ngx_queue_head(&ctx->batch); p != ngx_queue_sentinel(&ctx->batch); p = ngx_queue_next(p)) {
+                if (ngx_queue_data(p, ngx_http_video_thumbextractor_ctx_t, queue)->thumb_ctx.second > other->thumb_ctx.second) {
+                    break;
+                }
+            }
+            ngx_queue_insert_after(ngx_queue_prev(p), q);
+
+            n++;
+        }
+    }
+}
+
+
+ngx_flag_t
+ngx_http_video_thumbextractor_same_video(ngx_http_video_thumbextractor_ctx_t *a, ngx_http_video_thumbextractor_ctx_t *b)
+{
+    ngx_http_video_thumbextractor_thumb_ctx_t *ta = &a->thumb_ctx, *tb = &b->thumb_ctx;
+
+    return (ngx_http_get_module_loc_conf(a->request, ngx_http_video_thumbextractor_module) == ngx_http_get_module_loc_conf(b->request, ngx_http_video_thumbextractor_module)) &&
+           !a->early && !b->early &&
+           (ta->file_info.offset == tb->file_info.offset) &&
+           (ta->filename.len == tb->filename.len) &&
+           (ngx_memcmp(ta->filename.data, tb->filename.data, ta->filename.len) == 0);
+}
+
+
+void
+ngx_http_video_thumbextractor_requeue(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ctx->slot = -1;
+    ctx->skip = 0;
+    ctx->transfer.step = 0;
+
+    // the extraction will start again, and so its timeout
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    ngx_queue_insert_head(&ngx_http_video_thumbextractor_module_extract_queue[ctx->priority], &ctx->queue);
+    ngx_http_video_thumbextractor_module_extract_queue_size++;
+}
+
+
+void
+ngx_http_video_thumbextractor_requeue_batch(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_queue_t                               *q;
+
+    // from the last to the first to keep their order on the head of the queues
+    while (!ngx_queue_empty(&ctx->batch)) {
+        q = ngx_queue_last(&ctx->batch);
+        ngx_queue_remove(q);
+        ngx_http_video_thumbextractor_requeue(ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue));
+    }
+}
+
+
+/* the results of a batch come in sequence on the same channel, the one in progress is stopped with the process */
+void
+ngx_http_video_thumbextractor_abort_batch(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_int_t                                  slot = ctx->slot;
+
+    ngx_http_video_thumbextractor_requeue_batch(ctx);
+    ctx->slot = -1;
+
+    ngx_http_video_thumbextractor_cancel_extraction(slot);
+}
+
+
+/*
+ * the request in progress on a persistent process went away before any of its result was received,
+ * the process is asked to stop through the shared flag and kept, instead of killed and forked again
+ */
+ngx_int_t
+ngx_http_video_thumbextractor_leave_process(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[ctx->slot];
+    ngx_http_video_thumbextractor_ctx_t       *next;
+
+    // a job not completely sent or a result partially received can only be stopped with the process
+    if (!vtmcf->persistent_processes || (ipc_ctx->conn == NULL) || (ipc_ctx->cancelled == NULL) || (ipc_ctx->request != ctx->request) ||
+        (ctx->transfer.step != NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC) || (ctx->transfer.buffer.last != ctx->transfer.buffer.start))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ipc_ctx->discard.pending == 0) {
+        ipc_ctx->discard.stream = vtlcf->stream_output;
+        ipc_ctx->discard.step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+        ngx_http_video_thumbextractor_set_buffer(&ipc_ctx->discard.buffer, (u_char *) &ipc_ctx->discard.rc, NULL, sizeof(ngx_int_t));
+    }
+
+    // its result and the ones of the requests dropped after it
+    ipc_ctx->discard.pending += 1 + ctx->skip;
+
+    if (ngx_queue_empty(&ctx->batch)) {
+        // nobody waits for the other results, the process stops on the next read or frame
+        ngx_atomic_cmp_set(ipc_ctx->cancelled, 0, 1);
+        ipc_ctx->request = NULL;
+    } else {
+        // the same process sends the result of the next request of the batch after the dropped ones
+        next = ngx_queue_data(ngx_queue_head(&ctx->batch), ngx_http_video_thumbextractor_ctx_t, queue);
+        ngx_queue_remove(&next->queue);
+        ngx_queue_init(&next->queue);
+        ngx_queue_add(&next->batch, &ctx->batch);
+        ngx_queue_init(&ctx->batch);
+
+        next->transfer.step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+        ngx_http_video_thumbextractor_set_buffer(&next->transfer.buffer, (u_char *) &next->transfer.rc, NULL, sizeof(ngx_int_t));
+        ipc_ctx->request = next->request;
+    }
+
+    // a process which does not answer is killed as before
+    if (!ipc_ctx->cancel_timer.timer_set) {
+        ipc_ctx->cancel_timer.handler = ngx_http_video_thumbextractor_cancel_timeout_handler;
+        ipc_ctx->cancel_timer.data = ipc_ctx;
+        ipc_ctx->cancel_timer.log = ngx_cycle->log;
+        ipc_ctx->cancel_timer.cancelable = 1;
+        ngx_add_timer(&ipc_ctx->cancel_timer, NGX_HTTP_VIDEO_THUMBEXTRACTOR_CANCEL_TIMEOUT);
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_video_thumbextractor_cancel_timeout_handler(ngx_event_t *ev)
+{
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx = ev->data;
+    ngx_http_video_thumbextractor_ctx_t       *ctx;
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "video thumb extractor module: extractor process %P did not answer %M ms after its extraction was cancelled", ipc_ctx->pid, (ngx_msec_t) NGX_HTTP_VIDEO_THUMBEXTRACTOR_CANCEL_TIMEOUT);
+
+    // the requests of the batch still waiting go to another process
+    if ((ipc_ctx->request != NULL) && ((ctx = ngx_http_get_module_ctx(ipc_ctx->request, ngx_http_video_thumbextractor_module)) != NULL)) {
+        ngx_http_video_thumbextractor_requeue_batch(ctx);
+        ngx_http_video_thumbextractor_requeue(ctx);
+    }
+
+    ngx_http_video_thumbextractor_cancel_extraction(ipc_ctx->slot);
+    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+}
+
+
+/* a request of the batch which did not start yet, its result is read and dropped when its turn comes */
+void
+ngx_http_video_thumbextractor_drop_from_batch(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[ctx->slot];
+    ngx_http_video_thumbextractor_ctx_t       *current, *prev;
+    ngx_queue_t                               *q = ngx_queue_prev(&ctx->queue);
+
+    current = ngx_http_get_module_ctx(ipc_ctx->request, ngx_http_video_thumbextractor_module);
+    prev = (q == &current->batch) ? current : ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue);
+    prev->skip += ctx->skip + 1;
+
+    ngx_queue_remove(&ctx->queue);
+    ngx_queue_init(&ctx->queue);
+}
+
+
+void
+ngx_http_video_thumbextractor_fork_extract_process(ngx_uint_t slot)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_ipc_t      *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[slot];
+    ngx_http_video_thumbextractor_transfer_t *transfer;
+    ngx_http_video_thumbextractor_ctx_t      *ctx;
+    int                                       ret;
+    ngx_pid_t                                 pid;
+    ngx_event_t                              *rev;
+
+    ctx = ngx_http_video_thumbextractor_dequeue(ipc_ctx);
+
+    ipc_ctx->pipefd[0] = -1;
+    ipc_ctx->pipefd[1] = -1;
+    transfer = &ctx->transfer;
+
+    if (vtmcf->result_transport == NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD) {
+        // the image descriptor can only be passed through a unix socket
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, ipc_ctx->pipefd) == -1) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to initialize a socketpair");
+            goto failed;
+        }
+
+        if (ngx_nonblocking(ipc_ctx->pipefd[0]) == -1) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_socket_errno, "video thumb extractor module: unable to set the socketpair as nonblocking");
+            close(ipc_ctx->pipefd[0]);
+            close(ipc_ctx->pipefd[1]);
+            goto failed;
+        }
+
+    } else if (pipe(ipc_ctx->pipefd) == -1) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to initialize a pipe");
+        goto failed;
+    }
+
+    /* make pipe write end survive through exec */
+
+    ret = fcntl(ipc_ctx->pipefd[1], F_GETFD);
+
+    if (ret != -1) {
+        ret &= ~FD_CLOEXEC;
+        ret = fcntl(ipc_ctx->pipefd[1], F_SETFD, ret);
+    }
+
+    if (ret == -1) {
+        close(ipc_ctx->pipefd[0]);
+        close(ipc_ctx->pipefd[1]);
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to make pipe write end live longer");
+        goto failed;
+    }
+
+    /* ignore the signal when the child dies */
+    signal(SIGCHLD, SIG_IGN);
+
+    pid = fork();
+
+    switch (pid) {
+
+    case -1:
+        /* failure */
+        if (ipc_ctx->pipefd[0] != -1) {
+            close(ipc_ctx->pipefd[0]);
+        }
+
+        if (ipc_ctx->pipefd[1] != -1) {
+            close(ipc_ctx->pipefd[1]);
+        }
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to fork the process");
+        goto failed;
+
+    case 0:
+        /* child */
+
+#if (NGX_LINUX)
+        prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+#endif
+        if (ipc_ctx->pipefd[0] != -1) {
+            close(ipc_ctx->pipefd[0]);
+        }
+
+        ngx_pid = ngx_getpid();
+        ngx_setproctitle("thumb extractor");
+        ngx_http_video_thumbextractor_run_extract(ipc_ctx);
+        break;
+
+    default:
+        /* parent */
+        if (ipc_ctx->pipefd[1] != -1) {
+            close(ipc_ctx->pipefd[1]);
+            ipc_ctx->pipefd[1] = -1;
+        }
+
+        if (ipc_ctx->pipefd[0] != -1) {
+            ipc_ctx->pid = pid;
+            ipc_ctx->conn = ngx_get_connection(ipc_ctx->pipefd[0], ngx_cycle->log);
+            ipc_ctx->conn->data = ipc_ctx;
+
+            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->rc, NULL, sizeof(ngx_int_t));
+
+            rev = ipc_ctx->conn->read;
+            rev->log = ngx_cycle->log;
+            rev->handler = ngx_http_video_thumbextractor_extract_process_read_handler;
+
+            if (ngx_add_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: failed to add child control event");
+            }
+        }
+        break;
+    }
+
+    return;
+
+failed:
+
+    // the request was already taken from the queue, answer it and give the slot to the next one
+    ctx->slot = -1;
+    ngx_http_video_thumbextractor_release_slot(slot, 0);
+
+    ngx_http_video_thumbextractor_finish_waiters(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR, NULL, 0);
+    if (!ctx->early) {
+        ngx_http_filter_finalize_request(ctx->request, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+    ngx_http_video_thumbextractor_finalize_request(ctx->request);
+
+    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_spawn_persistent_process(ngx_uint_t slot)
+{
+    ngx_http_video_thumbextractor_ipc_t      *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[slot];
+    ngx_pid_t                                 pid;
+    ngx_event_t                              *rev, *wev;
+
+    // the flag to stop an extraction is mapped once for the slot and inherited by each process spawned on it
+    if (ipc_ctx->cancelled == NULL) {
+        ipc_ctx->cancel.size = sizeof(ngx_atomic_t);
+        ngx_str_set(&ipc_ctx->cancel.name, "video_thumbextractor_cancel");
+        ipc_ctx->cancel.log = ngx_cycle->log;
+
+        if (ngx_shm_alloc(&ipc_ctx->cancel) == NGX_OK) {
+            ipc_ctx->cancelled = (ngx_atomic_t *) ipc_ctx->cancel.addr;
+        } else {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "video thumb extractor module: unable to map the cancel flag, the extractions will be stopped by killing the process");
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ipc_ctx->pipefd) == -1) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to initialize a socketpair");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(ipc_ctx->pipefd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_socket_errno, "video thumb extractor module: unable to set the socketpair as nonblocking");
+        close(ipc_ctx->pipefd[0]);
+        close(ipc_ctx->pipefd[1]);
+        return NGX_ERROR;
+    }
+
+    /* ignore the signal when the child dies */
+    signal(SIGCHLD, SIG_IGN);
+
+    pid = fork();
+
+    switch (pid) {
+
+    case -1:
+        /* failure */
+        close(ipc_ctx->pipefd[0]);
+        close(ipc_ctx->pipefd[1]);
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: unable to fork the process");
+        return NGX_ERROR;
+
+    case 0:
+        /* child */
+
+#if (NGX_LINUX)
+        prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+#endif
+        ngx_pid = ngx_getpid();
+        ngx_setproctitle("thumb extractor");
+        ngx_http_video_thumbextractor_run_persistent_extract(ipc_ctx);
+        exit(0);
+
+    default:
+        /* parent */
+        close(ipc_ctx->pipefd[1]);
+        ipc_ctx->pipefd[1] = -1;
+
+        if ((ipc_ctx->conn = ngx_get_connection(ipc_ctx->pipefd[0], ngx_cycle->log)) == NULL) {
+            close(ipc_ctx->pipefd[0]);
+            kill(pid, SIGKILL);
+            return NGX_ERROR;
+        }
+
+        ipc_ctx->pid = pid;
+        ipc_ctx->requests = 0;
+        ipc_ctx->processing = 0;
+        ipc_ctx->conn->data = ipc_ctx;
+
+        rev = ipc_ctx->conn->read;
+        rev->log = ngx_cycle->log;
+        rev->handler = ngx_http_video_thumbextractor_extract_process_read_handler;
+
+        wev = ipc_ctx->conn->write;
+        wev->log = ngx_cycle->log;
+        wev->handler = ngx_http_video_thumbextractor_extract_process_send_job_handler;
+
+        if (ngx_add_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: failed to add child control event");
+            ngx_http_video_thumbextractor_release_slot(slot, 0);
+            kill(pid, SIGKILL);
+            return NGX_ERROR;
+        }
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_video_thumbextractor_send_job(ngx_uint_t slot)
+{
+    ngx_http_video_thumbextractor_ipc_t      *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[slot];
+    ngx_http_video_thumbextractor_transfer_t *transfer;
+    ngx_http_video_thumbextractor_ctx_t      *ctx, *job_ctx;
+    ngx_http_request_t                       *r;
+    ngx_queue_t                              *q;
+    ngx_uint_t                                n = 1;
+    u_char                                   *data, *p;
+    size_t                                    len;
+
+    // the results of a cancelled batch were all received before a new one is sent
+    if (ipc_ctx->cancelled != NULL) {
+        *ipc_ctx->cancelled = 0;
+    }
+
+    ctx = ngx_http_video_thumbextractor_dequeue(ipc_ctx);
+    r = ctx->request;
+    transfer = &ctx->transfer;
+
+    ngx_http_video_thumbextractor_gather_batch(ctx);
+    len = sizeof(ngx_http_video_thumbextractor_job_t) + ctx->thumb_ctx.filename.len + ctx->thumb_ctx.index_path.len;
+    for (q = ngx_queue_head(&ctx->batch); q != ngx_queue_sentinel(&ctx->batch); q = ngx_queue_next(q)) {
+        job_ctx = ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue);
+        len += sizeof(ngx_http_video_thumbextractor_job_t) + job_ctx->thumb_ctx.filename.len + job_ctx->thumb_ctx.index_path.len;
+        n++;
+    }
+
+    if ((data = ngx_pcalloc(r->pool, len)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate memory to send the job");
+        ngx_http_video_thumbextractor_requeue_batch(ctx);
+        ctx->slot = -1;
+        ngx_http_video_thumbextractor_release_slot(slot, 1);
+        ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_video_thumbextractor_finalize_request(r);
+        return;
+    }
+
+    p = ngx_http_video_thumbextractor_write_job(data, ctx, --n);
+    for (q = ngx_queue_head(&ctx->batch); q != ngx_queue_sentinel(&ctx->batch); q = ngx_queue_next(q)) {
+        p = ngx_http_video_thumbextractor_write_job(p, ngx_queue_data(q, ngx_http_video_thumbextractor_ctx_t, queue), --n);
+    }
+
+    transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_JOB;
+    transfer->fd = ctx->thumb_ctx.file_info.fd;
+    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, data, NULL, len);
+
+    ngx_http_video_thumbextractor_extract_process_send_job_handler(ipc_ctx->conn->write);
+}
+
+
+u_char *
+ngx_http_video_thumbextractor_write_job(u_char *p, ngx_http_video_thumbextractor_ctx_t *ctx, ngx_uint_t remaining)
+{
+    ngx_http_video_thumbextractor_job_t       job;
+
+    job.vtlcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module);
+    job.thumb_ctx = ctx->thumb_ctx;
+    job.remaining = remaining;
+
+    p = ngx_cpymem(p, &job, sizeof(ngx_http_video_thumbextractor_job_t));
+    p = ngx_cpymem(p, ctx->thumb_ctx.filename.data, ctx->thumb_ctx.filename.len);
+    return ngx_cpymem(p, ctx->thumb_ctx.index_path.data, ctx->thumb_ctx.index_path.len);
+}
+
+
+void
+ngx_http_video_thumbextractor_extract_process_send_job_handler(ngx_event_t *ev)
+{
+    ngx_http_video_thumbextractor_ctx_t       *ctx;
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx;
+    ngx_http_video_thumbextractor_transfer_t  *transfer;
+    ngx_connection_t                          *c;
+    ngx_http_request_t                        *r;
+    ngx_int_t                                  rc;
+
+    c = ev->data;
+    ipc_ctx = c->data;
+    r = ipc_ctx->request;
+
+    if ((r == NULL) || ((ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module)) == NULL)) {
+        // the process may be in the middle of a job, can not be reused
+        ngx_http_video_thumbextractor_release_slot(ipc_ctx->slot, 0);
+        ngx_http_video_thumbextractor_module_ensure_extractor_process();
+        return;
+    }
+
+    transfer = &ctx->transfer;
+
+    if (transfer->step != NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_JOB) {
+        return;
+    }
+
+    rc = ngx_http_video_thumbextractor_write(c, ev, &transfer->buffer, transfer->buffer.end - transfer->buffer.start);
+
+    if (rc == NGX_AGAIN) {
+        if (!ev->active && (ngx_add_event(ev, NGX_WRITE_EVENT, 0) != NGX_OK)) {
+            rc = NGX_ERROR;
+        } else {
+            return;
+        }
+    }
+
+    // the descriptor of the video follows the batch, the process does not need to look up the file
+    if ((rc == NGX_OK) && (transfer->fd != NGX_INVALID_FILE)) {
+        rc = (ngx_http_video_thumbextractor_send_fd(c->fd, transfer->fd, r->connection->log) == NGX_OK) ? NGX_OK : NGX_ERROR;
+    }
+
+    if (ev->active) {
+        ngx_del_event(ev, NGX_WRITE_EVENT, 0);
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "video thumb extractor module: error sending the job to extract thumbor process");
+        ngx_http_video_thumbextractor_requeue_batch(ctx);
+        ctx->slot = -1;
+        ngx_http_video_thumbextractor_release_slot(ipc_ctx->slot, 0);
+        ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_video_thumbextractor_finalize_request(r);
+        ngx_http_video_thumbextractor_module_ensure_extractor_process();
+        return;
+    }
+
+    transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->rc, NULL, sizeof(ngx_int_t));
+}
+
+
+void
+ngx_http_video_thumbextractor_run_persistent_extract(ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_job_t        jobs[NGX_HTTP_VIDEO_THUMBEXTRACTOR_MAX_BATCH_SIZE], *job;
+    ngx_http_video_thumbextractor_video_t      video;
+    ngx_http_video_thumbextractor_stream_t     stream;
+    ngx_fd_t                                   image_fd;
+    ngx_channel_t                              ch;
+    ngx_connection_t                          *c;
+    ngx_pool_t                                *temp_pool;
+    ngx_fd_t                                   fd = ipc_ctx->pipefd[1];
+    ngx_uint_t                                 i, n;
+    ngx_chain_t                               *out;
+    size_t                                     size;
+    ngx_int_t                                  rc, open_rc;
+
+    close(ipc_ctx->pipefd[0]);
+
+    ngx_done_events((ngx_cycle_t *) ngx_cycle);
+
+    /* release every descriptor inherited from the worker, like client connections and other extractors channels */
+    c = ngx_cycle->connections;
+    for (i = 0; i < ngx_cycle->connection_n; i++) {
+        if ((c[i].fd != (ngx_socket_t) -1) && (c[i].fd != fd)) {
+            close(c[i].fd);
+        }
+    }
+
+    if (signal(SIGTERM, SIG_DFL) == SIG_ERR) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: could not restore the signal handler for SIGTERM");
+    }
+
+    ngx_process = NGX_PROCESS_HELPER;
+
+    for ( ;; ) {
+        if ((temp_pool = ngx_create_pool(4096, ngx_cycle->log)) == NULL) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate temporary pool to extract the thumb");
+            exit(1);
+        }
+
+        // the worker sends the jobs of a batch together, all for the same file
+        n = 0;
+        do {
+            if (n >= NGX_HTTP_VIDEO_THUMBEXTRACTOR_MAX_BATCH_SIZE) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: too many jobs on the same batch");
+                exit(1);
+            }
+
+            job = &jobs[n++];
+
+            if (ngx_http_video_thumbextractor_read_fully(fd, job, sizeof(ngx_http_video_thumbextractor_job_t)) != NGX_OK) {
+                // worker closed the channel, asking to finish the process
+                ngx_destroy_pool(temp_pool);
+                return;
+            }
+
+            if ((job->thumb_ctx.filename.data = ngx_pcalloc(temp_pool, job->thumb_ctx.filename.len + 1)) == NULL) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate memory to receive the filename");
+                exit(1);
+            }
+
+            if (ngx_http_video_thumbextractor_read_fully(fd, job->thumb_ctx.filename.data, job->thumb_ctx.filename.len) != NGX_OK) {
+                exit(1);
+            }
+
+            if ((job->thumb_ctx.index_path.data = ngx_pcalloc(temp_pool, job->thumb_ctx.index_path.len + 1)) == NULL) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate memory to receive the index path");
+                exit(1);
+            }
+
+            if (ngx_http_video_thumbextractor_read_fully(fd, job->thumb_ctx.index_path.data, job->thumb_ctx.index_path.len) != NGX_OK) {
+                exit(1);
+            }
+
+            // set by the worker when nobody waits for the results of the batch anymore
+            job->thumb_ctx.file_info.cancelled = ipc_ctx->cancelled;
+        } while (job->remaining > 0);
+
+        // a descriptor opened by the worker follows the batch, the one on the job is only valid there
+        for (i = 1; i < n; i++) {
+            jobs[i].thumb_ctx.file_info.fd = NGX_INVALID_FILE;
+        }
+
+        if (jobs[0].thumb_ctx.file_info.fd != NGX_INVALID_FILE) {
+            if (ngx_read_channel(fd, &ch, sizeof(ngx_channel_t), ngx_cycle->log) != NGX_OK) {
+                exit(1);
+            }
+            jobs[0].thumb_ctx.file_info.fd = ch.fd;
+        }
+
+        // open the video once and extract the frames of all jobs from it
+        open_rc = ngx_http_video_thumbextractor_open_video(jobs[0].vtlcf, &jobs[0].thumb_ctx, &video, ngx_cycle->log);
+
+        for (i = 0; i < n; i++) {
+            out = NULL;
+            size = 0;
+
+            stream.fd = fd;
+            stream.started = 0;
+            jobs[i].thumb_ctx.output = jobs[i].vtlcf->stream_output ? ngx_http_video_thumbextractor_stream_chunk : NULL;
+            jobs[i].thumb_ctx.output_data = &stream;
+
+            rc = (open_rc == NGX_OK) ? ngx_http_video_thumbextractor_extract_frame(jobs[i].vtlcf, &video, &jobs[i].thumb_ctx, &out, &size, temp_pool, ngx_cycle->log) : open_rc;
+
+            if (stream.started) {
+                if (ngx_http_video_thumbextractor_finish_stream(&stream, rc) != NGX_OK) {
+                    exit(1);
+                }
+                continue;
+            }
+
+            image_fd = NGX_INVALID_FILE;
+            if ((rc == NGX_OK) && (vtmcf->result_transport == NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD)) {
+                if ((image_fd = ngx_http_video_thumbextractor_create_image_fd(out, ngx_cycle->log)) == NGX_INVALID_FILE) {
+                    rc = NGX_ERROR;
+                }
+            }
+
+            if (ngx_http_video_thumbextractor_write_fully(fd, &rc, sizeof(ngx_int_t)) != NGX_OK) {
+                exit(1);
+            }
+
+            if (rc == NGX_OK) {
+                if (ngx_http_video_thumbextractor_write_fully(fd, &size, sizeof(size_t)) != NGX_OK) {
+                    exit(1);
+                }
+
+                if (image_fd != NGX_INVALID_FILE) {
+                    if (ngx_http_video_thumbextractor_send_fd(fd, image_fd, ngx_cycle->log) != NGX_OK) {
+                        exit(1);
+                    }
+                    close(image_fd);
+
+                } else if (ngx_http_video_thumbextractor_write_chain(fd, out) != NGX_OK) {
+                    exit(1);
+                }
+            }
+        }
+
+        ngx_http_video_thumbextractor_close_video(&video, ngx_cycle->log);
+
+        ngx_destroy_pool(temp_pool);
+    }
+}
+
+
+void
+ngx_http_video_thumbextractor_run_extract(ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf;
+    ngx_http_video_thumbextractor_transfer_t  *transfer;
+    ngx_http_video_thumbextractor_ctx_t       *ctx;
+    ngx_http_video_thumbextractor_stream_t     stream;
+    ngx_http_request_t                        *r;
+    ngx_pool_t                                *temp_pool;
+    ngx_event_t                               *wev;
+    ngx_int_t                                  rc = NGX_ERROR;
+    ngx_log_t                                 *log;
+    ngx_cycle_t                               *cycle;
+    ngx_pool_t                                *pool;
+    ngx_int_t                                  i;
+
+    ngx_done_events((ngx_cycle_t *) ngx_cycle);
+
+    if (signal(SIGTERM, ngx_http_video_thumbextractor_sig_handler) == SIG_ERR) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: could not set the catch signal for SIGTERM");
+    }
+
+    log = ngx_cycle->log;
+
+    pool = ngx_create_pool(NGX_CYCLE_POOL_SIZE, log);
+    if (pool == NULL) {
+        exit(1);
+    }
+    pool->log = log;
+
+    cycle = ngx_pcalloc(pool, sizeof(ngx_cycle_t));
+    if (cycle == NULL) {
+        ngx_destroy_pool(pool);
+        exit(1);
+    }
+
+    cycle->pool = pool;
+    cycle->log = log;
+    cycle->new_log.log_level = NGX_LOG_ERR;
+    cycle->old_cycle = (ngx_cycle_t *) ngx_cycle;
+    cycle->conf_ctx = ngx_cycle->conf_ctx;
+    cycle->conf_file = ngx_cycle->conf_file;
+    cycle->conf_param = ngx_cycle->conf_param;
+    cycle->conf_prefix = ngx_cycle->conf_prefix;
+
+    cycle->connection_n = 16;
+    cycle->modules = ngx_modules;
+
+    ngx_process = NGX_PROCESS_HELPER;
+
+    for (i = 0; ngx_modules[i]; i++) {
+        if ((ngx_modules[i]->type == NGX_EVENT_MODULE) && ngx_modules[i]->init_process) {
+            if (ngx_modules[i]->init_process(cycle) == NGX_ERROR) {
+                /* fatal */
+                exit(2);
+            }
+        }
+    }
+
+    ngx_close_listening_sockets(cycle);
+
+    ngx_cycle = cycle;
+
+    if ((temp_pool = ngx_create_pool(4096, ngx_cycle->log)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate temporary pool to extract the thumb");
+        if (ngx_write_fd(ipc_ctx->pipefd[1], &rc, sizeof(ngx_int_t)) <= 0) {
+            exit(1);
+        }
+    }
+
+    if ((transfer = ngx_pcalloc(temp_pool, sizeof(ngx_http_video_thumbextractor_transfer_t))) == NULL) {
+        ngx_destroy_pool(temp_pool);
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate transfer structure");
+        if (ngx_write_fd(ipc_ctx->pipefd[1], &rc, sizeof(ngx_int_t)) <= 0) {
+            exit(1);
+        }
+    }
+    transfer->pool = temp_pool;
+    ngx_http_video_thumbextractor_transfer = transfer;
+
+    r = ipc_ctx->request;
+    if (r == NULL) {
+        if (ngx_write_fd(ipc_ctx->pipefd[1], &rc, sizeof(ngx_int_t)) <= 0) {
+            exit(1);
+        }
+    }
+
+    vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+
+    transfer->out = NULL;
+    transfer->size = 0;
+
+    if (vtlcf->stream_output) {
+        // the pipe is still blocking here, the chunks are written while the image is encoded
+        stream.fd = ipc_ctx->pipefd[1];
+        stream.started = 0;
+        ctx->thumb_ctx.output = ngx_http_video_thumbextractor_stream_chunk;
+        ctx->thumb_ctx.output_data = &stream;
+    }
+
+    transfer->rc = ngx_http_video_thumbextractor_get_thumb(vtlcf, &ctx->thumb_ctx, &transfer->out, &transfer->size, temp_pool, r->connection->log);
+
+    if (vtlcf->stream_output && stream.started) {
+        rc = ngx_http_video_thumbextractor_finish_stream(&stream, transfer->rc);
+        ngx_destroy_pool(temp_pool);
+        exit((rc == NGX_OK) ? 0 : 1);
+    }
+
+    transfer->fd = NGX_INVALID_FILE;
+    if ((transfer->rc == NGX_OK) && (vtmcf->result_transport == NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD)) {
+        if ((transfer->fd = ngx_http_video_thumbextractor_create_image_fd(transfer->out, ngx_cycle->log)) == NGX_INVALID_FILE) {
+            transfer->rc = NGX_ERROR;
+        }
+    }
+
+    transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->rc, NULL, sizeof(ngx_int_t));
+
+    transfer->conn = ngx_get_connection(ipc_ctx->pipefd[1], ngx_cycle->log);
+    transfer->conn->data = transfer;
+
+    wev = transfer->conn->write;
+    wev->log = ngx_cycle->log;
+    wev->handler = ngx_http_video_thumbextractor_extract_process_write_handler;
+
+    if (ngx_add_event(wev, NGX_WRITE_EVENT, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: failed to add child write event");
+    }
+
+    ngx_http_video_thumbextractor_extract_process_write_handler(wev);
+
+    for ( ;; ) {
+        ngx_process_events_and_timers(cycle);
+    }
+}
+
+
+void
+ngx_http_video_thumbextractor_extract_process_read_handler(ngx_event_t *ev)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf;
+    ngx_http_video_thumbextractor_ctx_t       *ctx = NULL, *next = NULL;
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx;
+    ngx_http_video_thumbextractor_transfer_t  *transfer = NULL;
+    ngx_connection_t                          *c;
+    ngx_http_request_t                        *r;
+    ngx_chain_t                                image, *out;
+    ngx_flag_t                                 keep_process = 0;
+    ngx_int_t                                  status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_int_t                                  rc;
+
+    c = ev->data;
+    ipc_ctx = c->data;
+
+    if (ipc_ctx->discard.pending > 0) {
+        rc = ngx_http_video_thumbextractor_discard_results(c, ipc_ctx);
+        if (rc == NGX_AGAIN) {
+            return;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0, "video thumb extractor module: error receiving data from extract thumbor process");
+            if ((ipc_ctx->request != NULL) && ((ctx = ngx_http_get_module_ctx(ipc_ctx->request, ngx_http_video_thumbextractor_module)) != NULL)) {
+                ngx_http_video_thumbextractor_requeue_batch(ctx);
+                ngx_http_video_thumbextractor_requeue(ctx);
+            }
+            ngx_http_video_thumbextractor_cancel_extraction(ipc_ctx->slot);
+            ngx_http_video_thumbextractor_module_ensure_extractor_process();
+            return;
+        }
+
+        if (ipc_ctx->cancel_timer.timer_set) {
+            ngx_del_timer(&ipc_ctx->cancel_timer);
+        }
+
+        if (ipc_ctx->request == NULL) {
+            // the dropped requests were the last ones of the batch
+            ngx_http_video_thumbextractor_release_slot(ipc_ctx->slot, 1);
+            ngx_http_video_thumbextractor_module_ensure_extractor_process();
+            return;
+        }
+
+        ngx_http_video_thumbextractor_start_extract_timer(ngx_http_get_module_ctx(ipc_ctx->request, ngx_http_video_thumbextractor_module));
+    }
+
+    r = ipc_ctx->request;
+
+    if (r == NULL) {
+        ngx_log_debug(NGX_LOG_DEBUG, ngx_cycle->log, 0, "video thumb extractor module: request already gone");
+        goto exit;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+    if (ctx == NULL) {
+        ngx_log_debug(NGX_LOG_DEBUG, ngx_cycle->log, 0, "video thumb extractor module: null request ctx");
+        goto exit;
+    }
+
+    transfer = &ctx->transfer;
+    vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
+
+    if (transfer->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_JOB) {
+        // the process should not answer before receive the whole job
+        rc = NGX_ERROR;
+        goto transfer_failed;
+    }
+
+    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, transfer->buffer.start, transfer->buffer.last, 0);
+
+    for ( ;; ) {
+
+        if (transfer->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD) {
+            rc = ngx_http_video_thumbextractor_recv_image_fd(c, r, transfer);
+        } else {
+            rc = ngx_http_video_thumbextractor_recv(c, ev, &transfer->buffer, transfer->buffer.end - transfer->buffer.start);
+        }
+
+        if (rc != NGX_OK) {
+            goto transfer_failed;
+        }
+
+        switch (transfer->step) {
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC:
+            // the process only sends the rc when the extraction fails
+            keep_process = vtmcf->persistent_processes && (transfer->rc != NGX_OK);
+
+            if (transfer->rc == NGX_ERROR) {
+                goto finalize;
+            }
+
+            if ((transfer->rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND) || (transfer->rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND)) {
+                status = NGX_HTTP_NOT_FOUND;
+                goto finalize;
+            }
+
+            if (NGX_HTTP_VIDEO_THUMBEXTRACTOR_BUDGET_EXCEEDED(transfer->rc)) {
+                status = NGX_HTTP_GATEWAY_TIME_OUT;
+                goto finalize;
+            }
+
+            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->size, NULL, sizeof(size_t));
+            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN;
+
+            if (vtlcf->stream_output) {
+                // the length of the image is unknown, it goes chunked while the process encodes it
+                if (ngx_http_video_thumbextractor_send_image_header(r, -1) == NGX_ERROR) {
+                    r->connection->error = 1;
+                }
+                transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN;
+            }
+            break;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN:
+            if (transfer->size == 0) {
+                transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+                keep_process = vtmcf->persistent_processes;
+                status = NGX_HTTP_OK;
+
+                ngx_http_video_thumbextractor_send_image_chunk(r, ctx, NULL, 1);
+                goto exit;
+            }
+
+            if (ngx_http_video_thumbextractor_next_stream_buffer(r, ctx) != NGX_OK) {
+                goto finalize;
+            }
+
+            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_DATA;
+            break;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_DATA:
+            // the chunk is read in pieces of up to the stream buffer size, the remaining is kept on the size
+            out = ctx->stream_chunk;
+            out->buf->pos = out->buf->start;
+            out->buf->last = transfer->buffer.last;
+            out->buf->temporary = 1;
+            out->buf->flush = 1;
+            out->buf->last_in_chain = 1;
+            ctx->stream_chunk = NULL;
+
+            transfer->size -= out->buf->last - out->buf->pos;
+
+            if (transfer->size > 0) {
+                if (ngx_http_video_thumbextractor_next_stream_buffer(r, ctx) != NGX_OK) {
+                    goto finalize;
+                }
+            } else {
+                ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->size, NULL, sizeof(size_t));
+                transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN;
+            }
+
+            // while the client does not take the image the channel is not read, and the process waits
+            if ((ngx_http_video_thumbextractor_send_image_chunk(r, ctx, out, 0) == NGX_AGAIN) && (ngx_http_video_thumbextractor_pause_stream(r, ctx, c) == NGX_OK)) {
+                return;
+            }
+            break;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN:
+            if (vtmcf->result_transport == NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD) {
+                transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD;
+                break;
+            }
+
+            if ((transfer->buffer.start = ngx_pcalloc(r->pool, transfer->size)) == NULL) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate buffer to receive the image");
+                goto finalize;
+            }
+
+            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, transfer->buffer.start, NULL, transfer->size);
+            transfer->buffer.temporary = 1;
+
+            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA;
+            break;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD:
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA:
+            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+            keep_process = vtmcf->persistent_processes;
+            status = NGX_HTTP_OK;
+
+            ngx_http_video_thumbextractor_send_image(r, &transfer->buffer);
+            goto exit;
+
+            break;
+
+        default:
+            goto exit;
+            break;
+        }
+
+    }
+
+transfer_failed:
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: error receiving data from extract thumbor process");
+
+finalize:
+    if (r->header_sent) {
+        // part of the image was already streamed, the response can only be interrupted
+        r->connection->error = 1;
+    } else if (!ctx->early) {
+        // a failed extraction from a partial body is done again with the whole body
+        ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, status);
+    }
+
+exit:
+    if (ctx != NULL) {
+        ctx->slot = -1;
+    }
+
+    if (keep_process) {
+        ipc_ctx->requests++;
+    }
+
+    if (keep_process && (ctx != NULL) && (ctx->skip > 0)) {
+        // the results of the requests dropped from the batch come before the next one
+        ipc_ctx->discard.pending = ctx->skip;
+        ipc_ctx->discard.stream = ((ngx_http_video_thumbextractor_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module))->stream_output;
+        ipc_ctx->discard.step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+        ngx_http_video_thumbextractor_set_buffer(&ipc_ctx->discard.buffer, (u_char *) &ipc_ctx->discard.rc, NULL, sizeof(ngx_int_t));
+    }
+
+    if ((ctx != NULL) && !ngx_queue_empty(&ctx->batch)) {
+        if (keep_process) {
+            // the same process sends the result of the next request of the batch
+            next = ngx_queue_data(ngx_queue_head(&ctx->batch), ngx_http_video_thumbextractor_ctx_t, queue);
+            ngx_queue_remove(&next->queue);
+            ngx_queue_init(&next->queue);
+            ngx_queue_add(&next->batch, &ctx->batch);
+            ngx_queue_init(&ctx->batch);
+
+            next->transfer.step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+            ngx_http_video_thumbextractor_set_buffer(&next->transfer.buffer, (u_char *) &next->transfer.rc, NULL, sizeof(ngx_int_t));
+            ipc_ctx->request = next->request;
+
+            // its extraction starts now, not when the batch was sent
+            if (ipc_ctx->discard.pending == 0) {
+                ngx_http_video_thumbextractor_start_extract_timer(next);
+            }
+        } else {
+            ngx_http_video_thumbextractor_requeue_batch(ctx);
+        }
+    }
+
+    if ((next == NULL) && (ipc_ctx->discard.pending == 0)) {
+        ngx_http_video_thumbextractor_release_slot(ipc_ctx->slot, keep_process);
+    } else if (next == NULL) {
+        ipc_ctx->request = NULL;
+    }
+
+    if (ctx != NULL) {
+        image.buf = &transfer->buffer;
+        image.next = NULL;
+        ngx_http_video_thumbextractor_finish_waiters(ctx, status, &image, transfer->size);
+    }
+
+    if (r != NULL) {
+        ngx_http_video_thumbextractor_finalize_request(r);
+    }
+
+    if ((next != NULL) || (ipc_ctx->discard.pending > 0)) {
+        ngx_http_video_thumbextractor_extract_process_read_handler(ev);
+        return;
+    }
+
+    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_discard_results(ngx_connection_t *c, ngx_http_video_thumbextractor_ipc_t *ipc_ctx)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_discard_t   *discard = &ipc_ctx->discard;
+    ngx_channel_t                              ch;
+    ngx_int_t                                  rc;
+    size_t                                     len;
+
+    while (discard->pending > 0) {
+
+        if (discard->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD) {
+            if ((rc = ngx_read_channel(c->fd, &ch, sizeof(ngx_channel_t), ngx_cycle->log)) != NGX_OK) {
+                return rc;
+            }
+            close(ch.fd);
+            discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+        }
+
+        if (discard->step != NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED) {
+            if ((rc = ngx_http_video_thumbextractor_recv(c, c->read, &discard->buffer, discard->buffer.end - discard->buffer.start)) != NGX_OK) {
+                return rc;
+            }
+        }
+
+        switch (discard->step) {
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC:
+            if (discard->rc != NGX_OK) {
+                discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+                break;
+            }
+
+            ngx_http_video_thumbextractor_set_buffer(&discard->buffer, (u_char *) &discard->size, NULL, sizeof(size_t));
+            discard->step = discard->stream ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN : NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN;
+            break;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN:
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN:
+            if ((discard->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN) && (vtmcf->result_transport == NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD)) {
+                discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD;
+                break;
+            }
+
+            if (discard->size == 0) {
+                discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+                break;
+            }
+
+            discard->step = (discard->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN) ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_DATA : NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA;
+            len = ngx_min(discard->size, sizeof(ngx_http_video_thumbextractor_discard_buffer));
+            ngx_http_video_thumbextractor_set_buffer(&discard->buffer, ngx_http_video_thumbextractor_discard_buffer, NULL, len);
+            break;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA:
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_DATA:
+            // the data is read in pieces on the same buffer, there is nobody to send it to
+            discard->size -= discard->buffer.last - discard->buffer.start;
+
+            if (discard->size > 0) {
+                len = ngx_min(discard->size, sizeof(ngx_http_video_thumbextractor_discard_buffer));
+                ngx_http_video_thumbextractor_set_buffer(&discard->buffer, ngx_http_video_thumbextractor_discard_buffer, NULL, len);
+            } else if (discard->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_DATA) {
+                ngx_http_video_thumbextractor_set_buffer(&discard->buffer, (u_char *) &discard->size, NULL, sizeof(size_t));
+                discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_CHUNK_LEN;
+            } else {
+                discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+            }
+            break;
+
+        default:
+            // the next result starts with its rc
+            discard->pending--;
+            discard->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
+            ngx_http_video_thumbextractor_set_buffer(&discard->buffer, (u_char *) &discard->rc, NULL, sizeof(ngx_int_t));
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_send_image(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_chain_t                               *out;
+
+    if ((out = ngx_alloc_chain_link(r->pool)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate output to send the image");
+        return ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    out->buf = b;
+    out->next = NULL;
+
+    return ngx_http_video_thumbextractor_send_image_chain(r, out);
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_send_image_chain(ngx_http_request_t *r, ngx_chain_t *out)
+{
+    ngx_chain_t                               *cl;
+    off_t                                      len = 0;
+    ngx_int_t                                  rc;
+
+    for (cl = out; cl; cl = cl->next) {
+        len += cl->buf->last - cl->buf->pos;
+        cl->buf->memory = 1;
+
+        if (cl->next == NULL) {
+            cl->buf->last_buf = 1;
+            cl->buf->last_in_chain = 1;
+            cl->buf->flush = 1;
+        }
+    }
+
+    rc = ngx_http_video_thumbextractor_send_image_header(r, len);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_video_thumbextractor_next_body_filter(r, out);
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_send_image_header(ngx_http_request_t *r, off_t content_length)
+{
+    r->headers_out.content_type = NGX_HTTP_VIDEO_THUMBEXTRACTOR_CONTENT_TYPE;
+    r->headers_out.content_type_len = NGX_HTTP_VIDEO_THUMBEXTRACTOR_CONTENT_TYPE.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = content_length;
+
+    return ngx_http_video_thumbextractor_next_header_filter(r);
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_send_image_chunk(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx, ngx_chain_t *out, ngx_flag_t last)
+{
+    ngx_chain_t                               *cl;
+    ngx_buf_t                                 *b;
+    ngx_int_t                                  rc;
+
+    // the rest of the image still has to be drained from the process, on the same buffers
+    if (r->header_only || r->connection->error) {
+        while (out != NULL) {
+            cl = out;
+            out = out->next;
+            cl->next = ctx->stream_free;
+            ctx->stream_free = cl;
+        }
+        return NGX_OK;
+    }
+
+    if (last) {
+        if (((b = ngx_calloc_buf(r->pool)) == NULL) || ((cl = ngx_alloc_chain_link(r->pool)) == NULL)) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate buffer to send the image");
+            r->connection->error = 1;
+            return NGX_ERROR;
+        }
+
+        b->last_buf = 1;
+        b->last_in_chain = 1;
+        b->flush = 1;
+
+        cl->buf = b;
+        cl->next = NULL;
+        out = cl;
+    }
+
+    rc = ngx_http_video_thumbextractor_next_body_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->stream_free, &ctx->stream_busy, &out, (ngx_buf_tag_t) &ngx_http_video_thumbextractor_module);
+
+    if (rc == NGX_ERROR) {
+        r->connection->error = 1;
+        return NGX_ERROR;
+    }
+
+    return (ctx->stream_busy != NULL) ? NGX_AGAIN : NGX_OK;
+}
+
+
+/* a buffer of the stream buffer size to receive the next piece of a chunk, reused from the ones the client already took */
+ngx_int_t
+ngx_http_video_thumbextractor_next_stream_buffer(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_loc_conf_t  *vtlcf = ngx_http_get_module_loc_conf(r, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_transfer_t  *transfer = &ctx->transfer;
+    ngx_chain_t                               *cl;
+    ngx_buf_t                                 *b;
+
+    if ((cl = ngx_chain_get_free_buf(r->pool, &ctx->stream_free)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate buffer to receive the image");
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    if (b->start == NULL) {
+        if ((b->start = ngx_palloc(r->pool, vtlcf->stream_buffer_size)) == NULL) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate buffer to receive the image");
+            return NGX_ERROR;
+        }
+
+        b->end = b->start + vtlcf->stream_buffer_size;
+        b->tag = (ngx_buf_tag_t) &ngx_http_video_thumbextractor_module;
+    }
 
-    transfer->data = 0;
-    transfer->size = 0;
+    ctx->stream_chunk = cl;
+    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, b->start, NULL, ngx_min(transfer->size, vtlcf->stream_buffer_size));
 
-    transfer->rc = ngx_http_video_thumbextractor_get_thumb(vtlcf, &ctx->thumb_ctx, &transfer->data, &transfer->size, temp_pool, r->connection->log);
+    return NGX_OK;
+}
 
-    transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC;
-    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->rc, NULL, sizeof(ngx_int_t));
 
-    transfer->conn = ngx_get_connection(ipc_ctx->pipefd[1], ngx_cycle->log);
-    transfer->conn->data = transfer;
+ngx_int_t
+ngx_http_video_thumbextractor_pause_stream(ngx_http_request_t *r, ngx_http_video_thumbextractor_ctx_t *ctx, ngx_connection_t *c)
+{
+    ngx_http_core_loc_conf_t                  *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_event_t                               *wev = r->connection->write;
 
-    wev = transfer->conn->write;
-    wev->log = ngx_cycle->log;
-    wev->handler = ngx_http_video_thumbextractor_extract_process_write_handler;
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
 
-    if (ngx_add_event(wev, NGX_WRITE_EVENT, 0) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "video thumb extractor module: failed to add child write event");
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    ngx_http_video_thumbextractor_extract_process_write_handler(wev);
+    if (c->read->active && (ngx_del_event(c->read, NGX_READ_EVENT, 0) != NGX_OK)) {
+        return NGX_ERROR;
+    }
 
-    for ( ;; ) {
-        ngx_process_events_and_timers(cycle);
+    if (r->write_event_handler != ngx_http_video_thumbextractor_stream_write_handler) {
+        ctx->write_event_handler = r->write_event_handler;
+        r->write_event_handler = ngx_http_video_thumbextractor_stream_write_handler;
     }
+
+    return NGX_OK;
 }
 
 
+/* sends what the client did not take yet, and goes back to read the channel when it is done */
 void
-ngx_http_video_thumbextractor_extract_process_read_handler(ngx_event_t *ev)
+ngx_http_video_thumbextractor_stream_write_handler(ngx_http_request_t *r)
 {
-    ngx_http_video_thumbextractor_ctx_t       *ctx = NULL;
-    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx;
-    ngx_http_video_thumbextractor_transfer_t  *transfer;
-    ngx_connection_t                          *c;
-    ngx_http_request_t                        *r;
-    ngx_chain_t                               *out;
-    ngx_int_t                                  rc;
-
-    c = ev->data;
-    ipc_ctx = c->data;
-    r = ipc_ctx->request;
+    ngx_http_video_thumbextractor_ctx_t       *ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
+    ngx_http_core_loc_conf_t                  *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_event_t                               *wev = r->connection->write, *rev;
 
-    if (r == NULL) {
-        ngx_log_debug(NGX_LOG_DEBUG, ngx_cycle->log, 0, "video thumb extractor module: request already gone");
-        goto exit;
+    if ((ctx == NULL) || (ctx->slot < 0)) {
+        return;
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_video_thumbextractor_module);
-    if (ctx == NULL) {
-        ngx_log_debug(NGX_LOG_DEBUG, ngx_cycle->log, 0, "video thumb extractor module: null request ctx");
-        goto exit;
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT, "video thumb extractor module: client timed out");
+        r->connection->timedout = 1;
+        r->connection->error = 1;
+
+    } else if (wev->delayed) {
+        if (ngx_handle_write_event(wev, clcf->send_lowat) == NGX_OK) {
+            return;
+        }
+        r->connection->error = 1;
+
+    } else if (ngx_http_video_thumbextractor_send_image_chunk(r, ctx, NULL, 0) == NGX_AGAIN) {
+        ngx_add_timer(wev, clcf->send_timeout);
+        if (ngx_handle_write_event(wev, clcf->send_lowat) == NGX_OK) {
+            return;
+        }
+        r->connection->error = 1;
     }
 
-    transfer = &ctx->transfer;
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
 
-    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, transfer->buffer.start, transfer->buffer.last, 0);
+    r->write_event_handler = ctx->write_event_handler;
 
-    for ( ;; ) {
+    rev = ngx_http_video_thumbextractor_module_ipc_ctxs[ctx->slot].conn->read;
+    if (!rev->active && (ngx_add_event(rev, NGX_READ_EVENT, 0) != NGX_OK)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "video thumb extractor module: unable to read the channel of the extract process again");
+    }
 
-        if ((rc = ngx_http_video_thumbextractor_recv(c, ev, &transfer->buffer, transfer->buffer.end - transfer->buffer.start)) != NGX_OK) {
-            goto transfer_failed;
-        }
+    ngx_http_video_thumbextractor_extract_process_read_handler(rev);
+}
 
-        switch (transfer->step) {
-        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_RC:
-            if (transfer->rc == NGX_ERROR) {
-                ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
-                goto exit;
-            }
 
-            if ((transfer->rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND) || (transfer->rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND)) {
-                ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_NOT_FOUND);
-                goto exit;
-            }
+#if (NGX_THREADS)
 
-            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) &transfer->size, NULL, sizeof(size_t));
-            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN;
-            break;
+ngx_int_t
+ngx_http_video_thumbextractor_post_thread_job(ngx_http_video_thumbextractor_ctx_t *ctx)
+{
+    ngx_http_video_thumbextractor_loc_conf_t   *vtlcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_thread_job_t *job;
+    ngx_thread_task_t                          *task;
+    ngx_pool_t                                 *pool;
 
-        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN:
-            if ((transfer->buffer.start = ngx_pcalloc(r->pool, transfer->size)) == NULL) {
-                ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate buffer to receive the image");
-                ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
-                goto exit;
-            }
+    if ((pool = ngx_create_pool(4096, ngx_cycle->log)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->request->connection->log, 0, "video thumb extractor module: unable to allocate pool to extract the thumb on a thread");
+        return NGX_ERROR;
+    }
 
-            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, transfer->buffer.start, NULL, transfer->size);
-            transfer->buffer.temporary = 1;
+    if ((task = ngx_thread_task_alloc(pool, sizeof(ngx_http_video_thumbextractor_thread_job_t))) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->request->connection->log, 0, "video thumb extractor module: unable to allocate thread task");
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
 
-            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA;
-            break;
+    job = task->ctx;
+    job->vtlcf = vtlcf;
+    job->thumb_ctx = ctx->thumb_ctx;
+    job->ctx = ctx;
+    job->pool = pool;
+    job->out = NULL;
+    job->size = 0;
+    job->rc = NGX_ERROR;
+    job->cancelled = 0;
+    job->thumb_ctx.file_info.cancelled = &job->cancelled;
+    job->thumb_ctx.file_info.budget.per_thread = 1;
+    job->thumb_ctx.file_info.in_worker = 1;
+
+    // the filename is on the request pool, which may be destroyed before the thread finishes
+    if ((job->thumb_ctx.filename.data = ngx_pnalloc(pool, ctx->thumb_ctx.filename.len + 1)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->request->connection->log, 0, "video thumb extractor module: unable to allocate memory to copy the filename");
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+    ngx_cpystrn(job->thumb_ctx.filename.data, ctx->thumb_ctx.filename.data, ctx->thumb_ctx.filename.len + 1);
 
-        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA:
-            transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_FINISHED;
+    if ((job->thumb_ctx.index_path.data = ngx_pnalloc(pool, ctx->thumb_ctx.index_path.len + 1)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->request->connection->log, 0, "video thumb extractor module: unable to allocate memory to copy the index path");
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+    ngx_cpystrn(job->thumb_ctx.index_path.data, ctx->thumb_ctx.index_path.data, ctx->thumb_ctx.index_path.len + 1);
 
-            ngx_http_video_thumbextractor_release_slot(ipc_ctx->slot);
-            ngx_http_video_thumbextractor_module_ensure_extractor_process();
+    // the descriptor of the request may be closed before the thread finishes, it uses a copy
+    if ((job->thumb_ctx.file_info.fd != NGX_INVALID_FILE) && ((job->thumb_ctx.file_info.fd = dup(ctx->thumb_ctx.file_info.fd)) == NGX_INVALID_FILE)) {
+        ngx_log_error(NGX_LOG_WARN, ctx->request->connection->log, ngx_errno, "video thumb extractor module: unable to duplicate the descriptor of \"%V\"", &ctx->thumb_ctx.filename);
+    }
 
-            /* write response */
-            r->headers_out.content_type = NGX_HTTP_VIDEO_THUMBEXTRACTOR_CONTENT_TYPE;
-            r->headers_out.content_type_len = NGX_HTTP_VIDEO_THUMBEXTRACTOR_CONTENT_TYPE.len;
-            r->headers_out.status = NGX_HTTP_OK;
-            r->headers_out.content_length_n = transfer->size;
+    task->handler = ngx_http_video_thumbextractor_thread_handler;
+    task->event.handler = ngx_http_video_thumbextractor_thread_event_handler;
+    task->event.data = job;
+    task->event.log = ngx_cycle->log;
 
-            out = (ngx_chain_t *) ngx_pcalloc(r->pool, sizeof(ngx_chain_t));
-            if (out == NULL) {
-                ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate output to send the image");
-                ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
-                goto exit;
-            }
+    if (ngx_thread_task_post(vtlcf->thread_pool, task) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, ctx->request->connection->log, 0, "video thumb extractor module: unable to post the extraction to the thread pool");
+        if (job->thumb_ctx.file_info.fd != NGX_INVALID_FILE) {
+            close(job->thumb_ctx.file_info.fd);
+        }
+        ngx_destroy_pool(pool);
+        return NGX_BUSY;
+    }
 
-            transfer->buffer.last_buf = 1;
-            transfer->buffer.last_in_chain = 1;
-            transfer->buffer.flush = 1;
-            transfer->buffer.memory = 1;
+    ctx->thread_job = job;
 
-            out->buf = &transfer->buffer;
-            out->next = NULL;
+    return NGX_OK;
+}
 
-            rc = ngx_http_video_thumbextractor_next_header_filter(r);
-            if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-                goto exit;
-            }
-            ngx_http_video_thumbextractor_next_body_filter(r, out);
-            goto exit;
 
-            break;
+void
+ngx_http_video_thumbextractor_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_thread_job_t *job = data;
 
-        default:
-            goto exit;
-            break;
-        }
+    job->rc = ngx_http_video_thumbextractor_get_thumb(job->vtlcf, &job->thumb_ctx, &job->out, &job->size, job->pool, log);
+}
 
-    }
 
-transfer_failed:
+void
+ngx_http_video_thumbextractor_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_video_thumbextractor_thread_job_t *job = ev->data;
+    ngx_http_video_thumbextractor_ctx_t        *ctx = job->ctx;
+    ngx_http_request_t                         *r;
+    ngx_pool_cleanup_t                         *cln;
+    ngx_int_t                                   status = NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-    if (rc == NGX_AGAIN) {
+    if (ctx == NULL) {
+        ngx_log_debug(NGX_LOG_DEBUG, ngx_cycle->log, 0, "video thumb extractor module: request already gone");
+        ngx_destroy_pool(job->pool);
         return;
     }
 
-    if (rc == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: error receiving data from extract thumbor process");
-        ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    ctx->thread_job = NULL;
+    r = ctx->request;
+
+    // the image is sent from the job pool, which lives until the request finishes
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate memory for cleanup");
+        ngx_destroy_pool(job->pool);
+        job = NULL;
+        goto finalize;
     }
 
-exit:
-    ngx_close_connection(c);
+    cln->handler = (ngx_pool_cleanup_pt) ngx_destroy_pool;
+    cln->data = job->pool;
 
-    if (r != NULL) {
-        if (ctx != NULL) {
-            ctx->slot = -1;
-        }
-        ngx_http_finalize_request(r, NGX_OK);
+    if (job->rc == NGX_OK) {
+        status = NGX_HTTP_OK;
+    } else if ((job->rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND) || (job->rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND)) {
+        status = NGX_HTTP_NOT_FOUND;
+    } else if (NGX_HTTP_VIDEO_THUMBEXTRACTOR_BUDGET_EXCEEDED(job->rc)) {
+        status = NGX_HTTP_GATEWAY_TIME_OUT;
     }
 
-    if (ngx_http_video_thumbextractor_module_ipc_ctxs[ipc_ctx->slot].request == r) {
-        ngx_http_video_thumbextractor_release_slot(ipc_ctx->slot);
+finalize:
+    if (status == NGX_HTTP_OK) {
+        // the blocks written by the encoder go to the client as they are
+        ngx_http_video_thumbextractor_send_image_chain(r, job->out);
+    } else if (!ctx->early) {
+        ngx_http_filter_finalize_request(r, &ngx_http_video_thumbextractor_module, status);
     }
 
-    ngx_http_video_thumbextractor_module_ensure_extractor_process();
+    ngx_http_video_thumbextractor_finish_waiters(ctx, status, (job != NULL) ? job->out : NULL, (job != NULL) ? job->size : 0);
+    ngx_http_video_thumbextractor_finalize_request(r);
 }
 
+#endif
+
 
 void
 ngx_http_video_thumbextractor_extract_process_write_handler(ngx_event_t *ev)
@@ -438,7 +2594,13 @@ ngx_http_video_thumbextractor_extract_process_write_handler(ngx_event_t *ev)
 
     for ( ;; ) {
 
-        if ((rc = ngx_http_video_thumbextractor_write(c, ev, &transfer->buffer, transfer->buffer.end - transfer->buffer.start)) != NGX_OK) {
+        if (transfer->step == NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD) {
+            rc = ngx_http_video_thumbextractor_send_fd(c->fd, transfer->fd, ngx_cycle->log);
+        } else {
+            rc = ngx_http_video_thumbextractor_write(c, ev, &transfer->buffer, transfer->buffer.end - transfer->buffer.start);
+        }
+
+        if (rc != NGX_OK) {
             goto transfer_failed;
         }
 
@@ -453,11 +2615,25 @@ ngx_http_video_thumbextractor_extract_process_write_handler(ngx_event_t *ev)
             break;
 
         case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_LEN:
-            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, (u_char *) transfer->data, NULL, transfer->size);
+            if (transfer->fd != NGX_INVALID_FILE) {
+                // only the descriptor of the image goes through the socket
+                transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD;
+                break;
+            }
+
+            ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, transfer->out->buf->pos, NULL, transfer->out->buf->last - transfer->out->buf->pos);
             transfer->step = NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA;
             break;
 
         case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_DATA:
+            // the blocks of the image are written one after the other, without joining them
+            if ((transfer->out = transfer->out->next) != NULL) {
+                ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, transfer->out->buf->pos, NULL, transfer->out->buf->last - transfer->out->buf->pos);
+                break;
+            }
+            goto exit;
+
+        case NGX_HTTP_VIDEO_THUMBEXTRACTOR_TRANSFER_IMAGE_FD:
         default:
             goto exit;
             break;
@@ -504,10 +2680,48 @@ ngx_http_video_thumbextractor_cleanup_extract_process(ngx_http_video_thumbextrac
 
 
 void
-ngx_http_video_thumbextractor_release_slot(ngx_int_t slot)
+ngx_http_video_thumbextractor_release_slot(ngx_int_t slot, ngx_flag_t keep_process)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[slot];
+
+    ipc_ctx->request = NULL;
+    ipc_ctx->processing = 0;
+
+    if (ipc_ctx->cancel_timer.timer_set) {
+        ngx_del_timer(&ipc_ctx->cancel_timer);
+    }
+
+    ngx_http_video_thumbextractor_module_release_shared_slot(ipc_ctx);
+
+    if (keep_process && ((vtmcf->process_max_requests == 0) || (ipc_ctx->requests < vtmcf->process_max_requests))) {
+        return;
+    }
+
+    ipc_ctx->discard.pending = 0;
+
+    // closing the channel makes a persistent process finish
+    if (ipc_ctx->conn != NULL) {
+        ngx_close_connection(ipc_ctx->conn);
+        ipc_ctx->conn = NULL;
+    }
+
+    ipc_ctx->pid = -1;
+}
+
+
+void
+ngx_http_video_thumbextractor_cancel_extraction(ngx_int_t slot)
 {
-    ngx_http_video_thumbextractor_module_ipc_ctxs[slot].pid = -1;
-    ngx_http_video_thumbextractor_module_ipc_ctxs[slot].request = NULL;
+    ngx_http_video_thumbextractor_ipc_t       *ipc_ctx = &ngx_http_video_thumbextractor_module_ipc_ctxs[slot];
+
+    // nobody is waiting for the result, give the slot to the next request in the queue
+    if (ipc_ctx->pid != -1) {
+        ngx_log_debug(NGX_LOG_DEBUG, ngx_cycle->log, 0, "video thumb extractor module: killing extractor process %P", ipc_ctx->pid);
+        kill(ipc_ctx->pid, SIGKILL);
+    }
+
+    ngx_http_video_thumbextractor_release_slot(slot, 0);
 }
 
 
@@ -521,7 +2735,7 @@ ngx_http_video_thumbextractor_recv(ngx_connection_t *c, ngx_event_t *rev, ngx_bu
 
     ssize_t n = ngx_read_fd(c->fd, buf->last, size);
 
-    if (n == NGX_AGAIN) {
+    if ((n == NGX_AGAIN) || ((n == -1) && ((ngx_errno == NGX_EAGAIN) || (ngx_errno == NGX_EINTR)))) {
         return NGX_AGAIN;
     }
 
@@ -549,7 +2763,7 @@ ngx_http_video_thumbextractor_write(ngx_connection_t *c, ngx_event_t *wev, ngx_b
 
     ssize_t n = ngx_write_fd(c->fd, buf->last, size);
 
-    if (n == NGX_AGAIN) {
+    if ((n == NGX_AGAIN) || ((n == -1) && ((ngx_errno == NGX_EAGAIN) || (ngx_errno == NGX_EINTR)))) {
         return NGX_AGAIN;
     }
 
@@ -567,6 +2781,197 @@ ngx_http_video_thumbextractor_write(ngx_connection_t *c, ngx_event_t *wev, ngx_b
 }
 
 
+ngx_int_t
+ngx_http_video_thumbextractor_read_fully(ngx_fd_t fd, void *buf, size_t len)
+{
+    u_char  *p = buf;
+    ssize_t  n;
+
+    while (len > 0) {
+        n = ngx_read_fd(fd, p, len);
+
+        if ((n == -1) && (ngx_errno == NGX_EINTR)) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return NGX_ERROR;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_write_fully(ngx_fd_t fd, void *buf, size_t len)
+{
+    u_char  *p = buf;
+    ssize_t  n;
+
+    while (len > 0) {
+        n = ngx_write_fd(fd, p, len);
+
+        if ((n == -1) && (ngx_errno == NGX_EINTR)) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return NGX_ERROR;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_stream_chunk(void *data, u_char *buf, size_t len)
+{
+    ngx_http_video_thumbextractor_stream_t    *stream = data;
+    ngx_int_t                                  rc = NGX_OK;
+
+    if (!stream->started) {
+        // from now on the extraction can only succeed
+        if (ngx_http_video_thumbextractor_write_fully(stream->fd, &rc, sizeof(ngx_int_t)) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        stream->started = 1;
+    }
+
+    if ((ngx_http_video_thumbextractor_write_fully(stream->fd, &len, sizeof(size_t)) != NGX_OK) ||
+        (ngx_http_video_thumbextractor_write_fully(stream->fd, buf, len) != NGX_OK))
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_finish_stream(ngx_http_video_thumbextractor_stream_t *stream, ngx_int_t rc)
+{
+    size_t                                     len = 0;
+
+    if (rc != NGX_OK) {
+        // without the last chunk the worker interrupts the response
+        return NGX_ERROR;
+    }
+
+    return ngx_http_video_thumbextractor_write_fully(stream->fd, &len, sizeof(size_t));
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_write_chain(ngx_fd_t fd, ngx_chain_t *out)
+{
+    ngx_chain_t                               *cl;
+
+    for (cl = out; cl; cl = cl->next) {
+        if (ngx_http_video_thumbextractor_write_fully(fd, cl->buf->pos, cl->buf->last - cl->buf->pos) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_fd_t
+ngx_http_video_thumbextractor_create_image_fd(ngx_chain_t *out, ngx_log_t *log)
+{
+#if (NGX_HTTP_VIDEO_THUMBEXTRACTOR_HAVE_MEMFD)
+    ngx_fd_t                                   fd;
+
+    if ((fd = memfd_create("video_thumbextractor", MFD_CLOEXEC)) == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "video thumb extractor module: unable to create a memfd for the image");
+        return NGX_INVALID_FILE;
+    }
+
+    if (ngx_http_video_thumbextractor_write_chain(fd, out) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "video thumb extractor module: unable to write the image to the memfd");
+        close(fd);
+        return NGX_INVALID_FILE;
+    }
+
+    return fd;
+#else
+    return NGX_INVALID_FILE;
+#endif
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_send_fd(ngx_socket_t s, ngx_fd_t fd, ngx_log_t *log)
+{
+    ngx_channel_t                              ch;
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+    ch.command = NGX_CMD_OPEN_CHANNEL;
+    ch.pid = ngx_pid;
+    ch.fd = fd;
+
+    return ngx_write_channel(s, &ch, sizeof(ngx_channel_t), log);
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_recv_image_fd(ngx_connection_t *c, ngx_http_request_t *r, ngx_http_video_thumbextractor_transfer_t *transfer)
+{
+    ngx_pool_cleanup_t                        *cln;
+    ngx_channel_t                              ch;
+    ngx_str_t                                 *map;
+    ngx_int_t                                  rc;
+    u_char                                    *data;
+
+    if ((rc = ngx_read_channel(c->fd, &ch, sizeof(ngx_channel_t), r->connection->log)) != NGX_OK) {
+        return rc;
+    }
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_str_t))) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "video thumb extractor module: unable to allocate memory for cleanup");
+        close(ch.fd);
+        return NGX_ERROR;
+    }
+
+    data = mmap(NULL, transfer->size, PROT_READ, MAP_SHARED, ch.fd, 0);
+    close(ch.fd);
+
+    if (data == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "video thumb extractor module: unable to map the image received from the extract process");
+        return NGX_ERROR;
+    }
+
+    // the mapping lives until the response is sent
+    map = cln->data;
+    map->data = data;
+    map->len = transfer->size;
+    cln->handler = ngx_http_video_thumbextractor_unmap_image;
+
+    ngx_http_video_thumbextractor_set_buffer(&transfer->buffer, data, data + transfer->size, transfer->size);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_video_thumbextractor_unmap_image(void *data)
+{
+    ngx_str_t                                 *map = data;
+
+    if (map->data != NULL) {
+        munmap(map->data, map->len);
+    }
+}
+
+
 void
 ngx_http_video_thumbextractor_set_buffer(ngx_buf_t *buf, u_char *start, u_char *last, ssize_t len)
 {
@@ -0,0 +1,611 @@
+/*
+ * Copyright (C) 2011 Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ * This file is part of Nginx Video Thumb Extractor Module.
+ *
+ * Nginx Video Thumb Extractor Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Video Thumb Extractor Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Video Thumb Extractor Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * ngx_http_video_thumbextractor_module_remote.c
+ *
+ * Created:  Nov 22, 2011
+ * Author:   Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ */
+#include <ngx_http_video_thumbextractor_module_remote.h>
+
+static ngx_int_t    ngx_http_video_thumbextractor_remote_get_block(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t **out);
+static ngx_int_t    ngx_http_video_thumbextractor_remote_fetch(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block);
+static ngx_int_t    ngx_http_video_thumbextractor_remote_request(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block);
+static ngx_int_t    ngx_http_video_thumbextractor_remote_connect(ngx_http_video_thumbextractor_remote_t *remote);
+static void         ngx_http_video_thumbextractor_remote_disconnect(ngx_http_video_thumbextractor_remote_t *remote);
+static ngx_int_t    ngx_http_video_thumbextractor_remote_send(ngx_socket_t s, u_char *buf, size_t len);
+static ngx_int_t    ngx_http_video_thumbextractor_remote_recv(ngx_socket_t s, u_char *buf, size_t len);
+static uint32_t     ngx_http_video_thumbextractor_remote_cache_key(ngx_http_video_thumbextractor_remote_t *remote, int64_t index);
+static ngx_http_video_thumbextractor_remote_cache_node_t *ngx_http_video_thumbextractor_remote_cache_find(ngx_http_video_thumbextractor_remote_cache_t *cache, ngx_http_video_thumbextractor_remote_t *remote, int64_t index, uint32_t key);
+static ngx_int_t    ngx_http_video_thumbextractor_remote_cache_lookup(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block);
+static void         ngx_http_video_thumbextractor_remote_cache_store(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block);
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_open(ngx_http_video_thumbextractor_file_info_t *info, ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_str_t *url, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_remote_t       *remote;
+    ngx_http_video_thumbextractor_remote_block_t *block;
+    ngx_pool_t                                   *pool;
+    ngx_uint_t                                    i;
+    ngx_int_t                                     rc;
+
+    if ((url->len <= 7) || (ngx_strncasecmp(url->data, (u_char *) "http://", 7) != 0)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: only http urls can be read, \"%V\"", url);
+        return NGX_ERROR;
+    }
+
+    if ((pool = ngx_create_pool(4096, log)) == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0, "video thumb extractor module: unable to allocate memory to read \"%V\"", url);
+        return NGX_ERROR;
+    }
+
+    remote = ngx_pcalloc(pool, sizeof(ngx_http_video_thumbextractor_remote_t));
+    if ((remote == NULL) || ((remote->blocks = ngx_pcalloc(pool, cf->remote_blocks * sizeof(ngx_http_video_thumbextractor_remote_block_t))) == NULL)) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0, "video thumb extractor module: unable to allocate memory to read \"%V\"", url);
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    remote->pool = pool;
+    remote->log = log;
+    remote->name = *url;
+    remote->s = (ngx_socket_t) -1;
+    remote->timeout = cf->remote_timeout;
+    remote->block_size = cf->remote_block_size;
+    remote->nblocks = cf->remote_blocks;
+    remote->probing = 1;
+
+    for (i = 0; i < remote->nblocks; i++) {
+        remote->blocks[i].index = -1;
+    }
+
+    info->remote_source = remote;
+
+    // the extractor runs outside of the event loop, the origin is resolved here with a blocking call
+    remote->url.url.data = url->data + 7;
+    remote->url.url.len = url->len - 7;
+    remote->url.default_port = 80;
+    remote->url.uri_part = 1;
+
+    if (ngx_parse_url(pool, &remote->url) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: %s in url \"%V\"", (remote->url.err != NULL) ? remote->url.err : "invalid host", url);
+        return NGX_ERROR;
+    }
+
+    if (remote->url.uri.len == 0) {
+        ngx_str_set(&remote->url.uri, "/");
+    }
+
+    // the first block also tells the size of the video
+    if ((rc = ngx_http_video_thumbextractor_remote_get_block(remote, 0, &block)) != NGX_OK) {
+        return rc;
+    }
+
+    info->size = remote->size;
+    info->mtime = remote->mtime;
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_video_thumbextractor_remote_read(ngx_http_video_thumbextractor_remote_t *remote, u_char *buf, size_t len, int64_t offset)
+{
+    ngx_http_video_thumbextractor_remote_block_t *block;
+    size_t                                        start = offset % remote->block_size;
+
+    if (ngx_http_video_thumbextractor_remote_get_block(remote, offset / remote->block_size, &block) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (start >= block->len) {
+        return 0;
+    }
+
+    // the demuxer reads again for the rest, a read never crosses a block
+    len = ngx_min(len, block->len - start);
+    ngx_memcpy(buf, block->data + start, len);
+
+    return len;
+}
+
+
+static void
+ngx_http_video_thumbextractor_remote_close(ngx_http_video_thumbextractor_remote_t *remote)
+{
+    if ((remote->requests > 0) || (remote->shared_hits > 0)) {
+        ngx_log_error(NGX_LOG_INFO, remote->log, 0, "video thumb extractor module: fetched %O bytes of \"%V\" in %ui range requests, %ui blocks from the shared cache", remote->received, &remote->name, remote->requests, remote->shared_hits);
+    }
+
+    ngx_http_video_thumbextractor_remote_disconnect(remote);
+    ngx_destroy_pool(remote->pool);
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_get_block(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t **out)
+{
+    ngx_http_video_thumbextractor_remote_block_t *block, *oldest = NULL;
+    ngx_uint_t                                    i;
+    ngx_int_t                                     rc;
+
+    for (i = 0; i < remote->nblocks; i++) {
+        block = &remote->blocks[i];
+
+        if (block->index == index) {
+            block->used = ++remote->clock;
+            *out = block;
+            return NGX_OK;
+        }
+
+        if ((oldest == NULL) || (block->used < oldest->used)) {
+            oldest = block;
+        }
+    }
+
+    block = oldest;
+    block->index = -1;
+
+    if ((block->data == NULL) && ((block->data = ngx_palloc(remote->pool, remote->block_size)) == NULL)) {
+        ngx_log_error(NGX_LOG_CRIT, remote->log, 0, "video thumb extractor module: unable to allocate memory to a block of \"%V\"", &remote->name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_video_thumbextractor_remote_cache_lookup(remote, index, block) != NGX_OK) {
+        if ((rc = ngx_http_video_thumbextractor_remote_fetch(remote, index, block)) != NGX_OK) {
+            return rc;
+        }
+
+        if (remote->probing) {
+            ngx_http_video_thumbextractor_remote_cache_store(remote, index, block);
+        }
+    }
+
+    block->index = index;
+    block->used = ++remote->clock;
+    *out = block;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_fetch(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block)
+{
+    ngx_flag_t                                    reused;
+    ngx_int_t                                     rc;
+
+    for ( ;; ) {
+        reused = (remote->s != (ngx_socket_t) -1);
+
+        if (!reused && (ngx_http_video_thumbextractor_remote_connect(remote) != NGX_OK)) {
+            return NGX_ERROR;
+        }
+
+        if ((rc = ngx_http_video_thumbextractor_remote_request(remote, index, block)) != NGX_AGAIN) {
+            return rc;
+        }
+
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+
+        // the origin may close a kept alive connection at any time, the request is sent again on a new one
+        if (!reused) {
+            ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: origin of \"%V\" closed the connection without answering", &remote->name);
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_request(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block)
+{
+    u_char                                        header[NGX_HTTP_VIDEO_THUMBEXTRACTOR_REMOTE_HEADER_SIZE];
+    u_char                                       *p, *last, *end, *value;
+    int64_t                                       start = index * (int64_t) remote->block_size;
+    off_t                                         content_length = -1, total = -1;
+    time_t                                        mtime = NGX_ERROR;
+    ngx_int_t                                     status;
+    ngx_flag_t                                    keepalive = 1;
+    size_t                                        len = 0, received;
+    ssize_t                                       n;
+
+    if (remote->url.no_port) {
+        p = ngx_snprintf(header, sizeof(header), "GET %V HTTP/1.1" CRLF "Host: %V" CRLF, &remote->url.uri, &remote->url.host);
+    } else {
+        p = ngx_snprintf(header, sizeof(header), "GET %V HTTP/1.1" CRLF "Host: %V:%d" CRLF, &remote->url.uri, &remote->url.host, remote->url.port);
+    }
+    p = ngx_snprintf(p, header + sizeof(header) - p, "Range: bytes=%L-%L" CRLF "User-Agent: nginx video thumbextractor module" CRLF CRLF, start, start + (int64_t) remote->block_size - 1);
+
+    if (p == header + sizeof(header)) {
+        ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: url \"%V\" is too long", &remote->name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_video_thumbextractor_remote_send(remote->s, header, p - header) != NGX_OK) {
+        return NGX_AGAIN;
+    }
+
+    // the status line and the headers, followed by the beginning of the body
+    for ( ;; ) {
+        if ((n = recv(remote->s, header + len, sizeof(header) - len, 0)) <= 0) {
+            if (len == 0) {
+                return NGX_AGAIN;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, remote->log, (n == 0) ? 0 : ngx_socket_errno, "video thumb extractor module: unable to read the response of the origin of \"%V\"", &remote->name);
+            ngx_http_video_thumbextractor_remote_disconnect(remote);
+            return NGX_ERROR;
+        }
+
+        len += n;
+
+        if ((end = ngx_strnstr(header, CRLF CRLF, len)) != NULL) {
+            break;
+        }
+
+        if (len == sizeof(header)) {
+            ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: origin of \"%V\" sent too big header", &remote->name);
+            ngx_http_video_thumbextractor_remote_disconnect(remote);
+            return NGX_ERROR;
+        }
+    }
+
+    if ((end - header < 12) || (ngx_strncmp(header, "HTTP/1.", 7) != 0) || ((status = ngx_atoi(header + 9, 3)) == NGX_ERROR)) {
+        ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: origin of \"%V\" sent an invalid response", &remote->name);
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+        return NGX_ERROR;
+    }
+
+    for (p = (u_char *) ngx_strnstr(header, CRLF, end - header + 2) + 2; p < end; p = last + 2) {
+        last = (u_char *) ngx_strnstr(p, CRLF, end - p + 2);
+
+        if ((value = ngx_strlchr(p, last, ':')) == NULL) {
+            continue;
+        }
+
+        for (value++; (value < last) && (*value == ' '); value++) { /* void */ }
+
+        if (ngx_strncasecmp(p, (u_char *) "Content-Length:", sizeof("Content-Length:") - 1) == 0) {
+            content_length = ngx_atoof(value, last - value);
+
+        } else if (ngx_strncasecmp(p, (u_char *) "Content-Range:", sizeof("Content-Range:") - 1) == 0) {
+            // bytes first-last/total
+            if ((value = ngx_strlchr(value, last, '/')) != NULL) {
+                total = ngx_atoof(value + 1, last - value - 1);
+            }
+
+        } else if (ngx_strncasecmp(p, (u_char *) "Last-Modified:", sizeof("Last-Modified:") - 1) == 0) {
+            mtime = ngx_parse_http_time(value, last - value);
+
+        } else if ((ngx_strncasecmp(p, (u_char *) "Connection:", sizeof("Connection:") - 1) == 0) && (last - value == 5) && (ngx_strncasecmp(value, (u_char *) "close", 5) == 0)) {
+            keepalive = 0;
+        }
+    }
+
+    if (status == NGX_HTTP_NOT_FOUND) {
+        ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: origin of \"%V\" answered 404", &remote->name);
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+        return NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND;
+    }
+
+    if (status != NGX_HTTP_PARTIAL_CONTENT) {
+        ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: origin of \"%V\" answered %i to a range request", &remote->name, status);
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+        return NGX_ERROR;
+    }
+
+    if ((content_length < 0) || (content_length > (off_t) remote->block_size) || (total < 0)) {
+        ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: origin of \"%V\" sent an invalid partial response", &remote->name);
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+        return NGX_ERROR;
+    }
+
+    end += 4;
+    received = ngx_min((size_t) (header + len - end), (size_t) content_length);
+    ngx_memcpy(block->data, end, received);
+
+    if ((received < (size_t) content_length) && (ngx_http_video_thumbextractor_remote_recv(remote->s, block->data + received, content_length - received) != NGX_OK)) {
+        ngx_log_error(NGX_LOG_ERR, remote->log, ngx_socket_errno, "video thumb extractor module: unable to read a block of \"%V\"", &remote->name);
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+        return NGX_ERROR;
+    }
+
+    // nothing else is expected on the connection before the next request
+    if (!keepalive || (end + received < header + len)) {
+        ngx_http_video_thumbextractor_remote_disconnect(remote);
+    }
+
+    block->len = content_length;
+    remote->size = total;
+    // without it the video is not kept on the index cache
+    if (mtime != NGX_ERROR) {
+        remote->mtime = mtime;
+    }
+    remote->requests++;
+    remote->received += content_length;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_connect(ngx_http_video_thumbextractor_remote_t *remote)
+{
+    ngx_addr_t                                   *addr;
+    ngx_socket_t                                  s;
+    ngx_uint_t                                    i;
+    struct timeval                                tv;
+
+    tv.tv_sec = remote->timeout / 1000;
+    tv.tv_usec = (remote->timeout % 1000) * 1000;
+
+    for (i = 0; i < remote->url.naddrs; i++) {
+        addr = &remote->url.addrs[i];
+
+        if ((s = ngx_socket(addr->sockaddr->sa_family, SOCK_STREAM, 0)) == (ngx_socket_t) -1) {
+            ngx_log_error(NGX_LOG_ERR, remote->log, ngx_socket_errno, "video thumb extractor module: unable to create a socket to %V", &addr->name);
+            continue;
+        }
+
+        // a blocking socket with timeouts, the connect is also limited by the send one
+        if ((setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) ||
+            (setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) ||
+            (connect(s, addr->sockaddr, addr->socklen) == -1)) {
+            ngx_log_error(NGX_LOG_WARN, remote->log, ngx_socket_errno, "video thumb extractor module: unable to connect to %V", &addr->name);
+            ngx_close_socket(s);
+            continue;
+        }
+
+        remote->s = s;
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, remote->log, 0, "video thumb extractor module: unable to connect to the origin of \"%V\"", &remote->name);
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_video_thumbextractor_remote_disconnect(ngx_http_video_thumbextractor_remote_t *remote)
+{
+    if (remote->s != (ngx_socket_t) -1) {
+        ngx_close_socket(remote->s);
+        remote->s = (ngx_socket_t) -1;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_send(ngx_socket_t s, u_char *buf, size_t len)
+{
+    ssize_t                                       n;
+
+    while (len > 0) {
+        if ((n = send(s, buf, len, 0)) == -1) {
+            if (ngx_socket_errno == NGX_EINTR) {
+                continue;
+            }
+            return NGX_ERROR;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_recv(ngx_socket_t s, u_char *buf, size_t len)
+{
+    ssize_t                                       n;
+
+    while (len > 0) {
+        if ((n = recv(s, buf, len, 0)) <= 0) {
+            if ((n == -1) && (ngx_socket_errno == NGX_EINTR)) {
+                continue;
+            }
+            return NGX_ERROR;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static uint32_t
+ngx_http_video_thumbextractor_remote_cache_key(ngx_http_video_thumbextractor_remote_t *remote, int64_t index)
+{
+    uint32_t                                      crc;
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, remote->name.data, remote->name.len);
+    ngx_crc32_update(&crc, (u_char *) &index, sizeof(int64_t));
+    ngx_crc32_update(&crc, (u_char *) &remote->block_size, sizeof(size_t));
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+static ngx_http_video_thumbextractor_remote_cache_node_t *
+ngx_http_video_thumbextractor_remote_cache_find(ngx_http_video_thumbextractor_remote_cache_t *cache, ngx_http_video_thumbextractor_remote_t *remote, int64_t index, uint32_t key)
+{
+    ngx_rbtree_node_t                                   *node = cache->rbtree.root, *sentinel = cache->rbtree.sentinel;
+    ngx_http_video_thumbextractor_remote_cache_node_t   *entry;
+
+    while (node != sentinel) {
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        entry = (ngx_http_video_thumbextractor_remote_cache_node_t *) node;
+        if ((entry->index == index) && (entry->block_size == remote->block_size) && (entry->name_len == remote->name.len) && (ngx_memcmp(entry->data, remote->name.data, remote->name.len) == 0)) {
+            return entry;
+        }
+
+        // nodes with the same key are inserted on the right
+        node = node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_remote_cache_lookup(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block)
+{
+    ngx_http_video_thumbextractor_main_conf_t           *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_remote_cache_t        *cache = vtmcf->remote_cache;
+    ngx_http_video_thumbextractor_remote_cache_node_t   *entry;
+    ngx_slab_pool_t                                     *shpool;
+    ngx_int_t                                            rc = NGX_DECLINED;
+
+    if (cache == NULL) {
+        return NGX_DECLINED;
+    }
+
+    shpool = (ngx_slab_pool_t *) vtmcf->remote_cache_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    entry = ngx_http_video_thumbextractor_remote_cache_find(cache, remote, index, ngx_http_video_thumbextractor_remote_cache_key(remote, index));
+
+    // the extractor processes do not update the cached time of nginx
+    if ((entry != NULL) && (entry->expire >= time(NULL))) {
+        ngx_memcpy(block->data, entry->data + entry->name_len, entry->len);
+        block->len = entry->len;
+        remote->size = entry->size;
+        remote->mtime = entry->mtime;
+
+        ngx_queue_remove(&entry->queue);
+        ngx_queue_insert_head(&cache->lru, &entry->queue);
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rc == NGX_OK) {
+        remote->shared_hits++;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_video_thumbextractor_remote_cache_store(ngx_http_video_thumbextractor_remote_t *remote, int64_t index, ngx_http_video_thumbextractor_remote_block_t *block)
+{
+    ngx_http_video_thumbextractor_main_conf_t           *vtmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_video_thumbextractor_module);
+    ngx_http_video_thumbextractor_remote_cache_t        *cache = vtmcf->remote_cache;
+    ngx_http_video_thumbextractor_remote_cache_node_t   *entry;
+    ngx_slab_pool_t                                     *shpool;
+    ngx_queue_t                                         *q;
+    uint32_t                                             key;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) vtmcf->remote_cache_zone->shm.addr;
+    key = ngx_http_video_thumbextractor_remote_cache_key(remote, index);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    // an expired block is replaced, a valid one was stored by another extraction meanwhile
+    if ((entry = ngx_http_video_thumbextractor_remote_cache_find(cache, remote, index, key)) != NULL) {
+        ngx_queue_remove(&entry->queue);
+        ngx_rbtree_delete(&cache->rbtree, &entry->node);
+        ngx_slab_free_locked(shpool, entry);
+    }
+
+    // the least recently used blocks make room for the new one
+    while ((entry = ngx_slab_alloc_locked(shpool, offsetof(ngx_http_video_thumbextractor_remote_cache_node_t, data) + remote->name.len + block->len)) == NULL) {
+        if (ngx_queue_empty(&cache->lru)) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
+        }
+
+        q = ngx_queue_last(&cache->lru);
+        ngx_queue_remove(q);
+        entry = ngx_queue_data(q, ngx_http_video_thumbextractor_remote_cache_node_t, queue);
+        ngx_rbtree_delete(&cache->rbtree, &entry->node);
+        ngx_slab_free_locked(shpool, entry);
+    }
+
+    entry->node.key = key;
+    entry->expire = time(NULL) + vtmcf->remote_cache_valid;
+    entry->index = index;
+    entry->size = remote->size;
+    entry->mtime = remote->mtime;
+    entry->block_size = remote->block_size;
+    entry->len = block->len;
+    entry->name_len = remote->name.len;
+    ngx_memcpy(ngx_cpymem(entry->data, remote->name.data, remote->name.len), block->data, block->len);
+
+    ngx_rbtree_insert(&cache->rbtree, &entry->node);
+    ngx_queue_insert_head(&cache->lru, &entry->queue);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+ngx_int_t
+ngx_http_video_thumbextractor_remote_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_video_thumbextractor_main_conf_t     *conf = shm_zone->data;
+    ngx_http_video_thumbextractor_main_conf_t     *oconf = data;
+    ngx_slab_pool_t                               *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ngx_http_video_thumbextractor_remote_cache_t  *cache;
+
+    // keep the blocks cached by the old workers on reload
+    if ((oconf != NULL) && (oconf->remote_cache != NULL)) {
+        conf->remote_cache = oconf->remote_cache;
+        return NGX_OK;
+    }
+
+    if ((cache = ngx_slab_alloc(shpool, sizeof(ngx_http_video_thumbextractor_remote_cache_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0, "video thumb extractor module: unable to allocate memory for the remote cache");
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&cache->lru);
+
+    // a full zone is expected, the old blocks are dropped to store new ones
+    shpool->log_nomem = 0;
+    shpool->data = cache;
+
+    conf->remote_cache = cache;
+
+    return NGX_OK;
+}
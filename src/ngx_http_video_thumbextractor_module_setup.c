@@ -25,6 +25,8 @@
  */
 #include <ngx_http_video_thumbextractor_module_utils.h>
 #include <ngx_http_video_thumbextractor_module_ipc.h>
+#include <ngx_http_video_thumbextractor_module_remote.h>
+#include <ngx_http_video_thumbextractor_module_index.h>
 #include <ngx_http_video_thumbextractor_module.h>
 
 static void *ngx_http_video_thumbextractor_create_main_conf(ngx_conf_t *cf);
@@ -33,11 +35,17 @@ static char *ngx_http_video_thumbextractor_init_main_conf(ngx_conf_t *cf, void *
 static void *ngx_http_video_thumbextractor_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_video_thumbextractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 
+static ngx_int_t ngx_http_video_thumbextractor_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_video_thumbextractor_post_config(ngx_conf_t *cf);
+static ngx_int_t ngx_http_video_thumbextractor_init_module(ngx_cycle_t *cycle);
 static ngx_int_t ngx_http_video_thumbextractor_init_worker(ngx_cycle_t *cycle);
 static void      ngx_http_video_thumbextractor_exit_worker(ngx_cycle_t *cycle);
 
 static char *ngx_http_video_thumbextractor(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_video_thumbextractor_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_video_thumbextractor_remote_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_video_thumbextractor_index_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_shm_zone_t *ngx_http_video_thumbextractor_keys_zone(ngx_conf_t *cf, ngx_command_t *cmd, ngx_str_t *value);
 
 ngx_flag_t ngx_http_video_thumbextractor_used = 0;
 
@@ -46,6 +54,32 @@ ngx_flag_t ngx_http_video_thumbextractor_used = 0;
         conf = (prev == NULL) ? default : prev;                    \
     }
 
+static ngx_conf_enum_t  ngx_http_video_thumbextractor_io_modes[] = {
+    { ngx_string("pread"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_IO_PREAD },
+    { ngx_string("mmap"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_IO_MMAP },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_video_thumbextractor_decode_qualities[] = {
+    { ngx_string("normal"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_NORMAL },
+    { ngx_string("fast"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_FAST },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_video_thumbextractor_scalers[] = {
+    { ngx_string("bicubic"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_BICUBIC },
+    { ngx_string("bilinear"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_BILINEAR },
+    { ngx_string("fast_bilinear"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_FAST_BILINEAR },
+    { ngx_string("area"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_AREA },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_video_thumbextractor_result_transports[] = {
+    { ngx_string("pipe"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_PIPE },
+    { ngx_string("memfd"), NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD },
+    { ngx_null_string, 0 }
+};
+
 static ngx_command_t  ngx_http_video_thumbextractor_commands[] = {
     { ngx_string("video_thumbextractor"),
       NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
@@ -77,6 +111,156 @@ static ngx_command_t  ngx_http_video_thumbextractor_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_video_thumbextractor_loc_conf_t, next_time),
       NULL },
+    { ngx_string("video_thumbextractor_coalesce_requests"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, coalesce_requests),
+      NULL },
+    { ngx_string("video_thumbextractor_queue_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, queue_timeout),
+      NULL },
+    { ngx_string("video_thumbextractor_retry_after"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, retry_after),
+      NULL },
+    { ngx_string("video_thumbextractor_extract_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, extract_timeout),
+      NULL },
+    { ngx_string("video_thumbextractor_extract_cpu_time"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, extract_cpu_time),
+      NULL },
+    { ngx_string("video_thumbextractor_extract_max_bytes"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, extract_max_bytes),
+      NULL },
+    { ngx_string("video_thumbextractor_extract_max_packets"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, extract_max_packets),
+      NULL },
+    { ngx_string("video_thumbextractor_extract_max_frames"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, extract_max_frames),
+      NULL },
+    { ngx_string("video_thumbextractor_stream_output"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, stream_output),
+      NULL },
+    { ngx_string("video_thumbextractor_stream_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, stream_buffer_size),
+      NULL },
+    { ngx_string("video_thumbextractor_io_mode"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, io_mode),
+      &ngx_http_video_thumbextractor_io_modes },
+    { ngx_string("video_thumbextractor_io_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, io_buffer_size),
+      NULL },
+    { ngx_string("video_thumbextractor_readahead"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, readahead),
+      NULL },
+    { ngx_string("video_thumbextractor_probesize"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, probesize),
+      NULL },
+    { ngx_string("video_thumbextractor_analyzeduration"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, analyzeduration),
+      NULL },
+    { ngx_string("video_thumbextractor_fpsprobesize"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, fpsprobesize),
+      NULL },
+    { ngx_string("video_thumbextractor_adaptive_probe"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, adaptive_probe),
+      NULL },
+    { ngx_string("video_thumbextractor_decode_quality"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, decode_quality),
+      &ngx_http_video_thumbextractor_decode_qualities },
+    { ngx_string("video_thumbextractor_scaler"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, scaler),
+      &ngx_http_video_thumbextractor_scalers },
+    { ngx_string("video_thumbextractor_early_start"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, early_start),
+      NULL },
+    { ngx_string("video_thumbextractor_remote_url"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, remote_url),
+      NULL },
+    { ngx_string("video_thumbextractor_remote_block_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, remote_block_size),
+      NULL },
+    { ngx_string("video_thumbextractor_remote_blocks"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, remote_blocks),
+      NULL },
+    { ngx_string("video_thumbextractor_remote_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, remote_timeout),
+      NULL },
+    { ngx_string("video_thumbextractor_index_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, index_path),
+      NULL },
     { ngx_string("video_thumbextractor_image_width"),
       NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_http_set_complex_value_slot,
@@ -137,6 +321,12 @@ static ngx_command_t  ngx_http_video_thumbextractor_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_video_thumbextractor_loc_conf_t, tile_color),
       NULL },
+    { ngx_string("video_thumbextractor_priority"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, priority),
+      NULL },
     { ngx_string("video_thumbextractor_jpeg_baseline"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -173,6 +363,18 @@ static ngx_command_t  ngx_http_video_thumbextractor_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_video_thumbextractor_loc_conf_t, jpeg_dpi),
       NULL },
+    { ngx_string("video_thumbextractor_tile_decoders"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_loc_conf_t, tile_decoders),
+      NULL },
+    { ngx_string("video_thumbextractor_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_video_thumbextractor_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
     { ngx_string("video_thumbextractor_threads"),
       NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -185,11 +387,81 @@ static ngx_command_t  ngx_http_video_thumbextractor_commands[] = {
       NGX_HTTP_MAIN_CONF_OFFSET,
       offsetof(ngx_http_video_thumbextractor_main_conf_t, processes_per_worker),
       NULL },
+    { ngx_string("video_thumbextractor_persistent_processes"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, persistent_processes),
+      NULL },
+    { ngx_string("video_thumbextractor_process_max_requests"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, process_max_requests),
+      NULL },
+    { ngx_string("video_thumbextractor_shared_processes"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, shared_processes),
+      NULL },
+    { ngx_string("video_thumbextractor_max_queue_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, max_queue_size),
+      NULL },
+    { ngx_string("video_thumbextractor_high_priority_weight"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, high_priority_weight),
+      NULL },
+    { ngx_string("video_thumbextractor_reserved_processes"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, reserved_processes),
+      NULL },
+    { ngx_string("video_thumbextractor_batch_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, batch_size),
+      NULL },
+    { ngx_string("video_thumbextractor_result_transport"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_video_thumbextractor_main_conf_t, result_transport),
+      &ngx_http_video_thumbextractor_result_transports },
+    { ngx_string("video_thumbextractor_remote_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_video_thumbextractor_remote_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("video_thumbextractor_index_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_video_thumbextractor_index_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
       ngx_null_command
 };
 
+static ngx_http_variable_t  ngx_http_video_thumbextractor_vars[] = {
+    { ngx_string("video_thumbextractor_queue_time"), NULL,
+      ngx_http_video_thumbextractor_queue_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("video_thumbextractor_queue_size"), NULL,
+      ngx_http_video_thumbextractor_queue_size_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
 static ngx_http_module_t  ngx_http_video_thumbextractor_module_ctx = {
-    NULL,                                           /* preconfiguration */
+    ngx_http_video_thumbextractor_add_variables,    /* preconfiguration */
     ngx_http_video_thumbextractor_post_config,      /* postconfiguration */
 
     ngx_http_video_thumbextractor_create_main_conf, /* create main configuration */
@@ -209,7 +481,7 @@ ngx_module_t  ngx_http_video_thumbextractor_module = {
     ngx_http_video_thumbextractor_commands,      /* module directives */
     NGX_HTTP_MODULE,                             /* module type */
     NULL,                                        /* init master */
-    NULL,                                        /* init module */
+    ngx_http_video_thumbextractor_init_module,   /* init module */
     ngx_http_video_thumbextractor_init_worker,   /* init process */
     NULL,                                        /* init thread */
     NULL,                                        /* exit thread */
@@ -229,6 +501,21 @@ ngx_http_video_thumbextractor_create_main_conf(ngx_conf_t *cf)
     }
 
     mcf->processes_per_worker = NGX_CONF_UNSET_UINT;
+    mcf->persistent_processes = NGX_CONF_UNSET;
+    mcf->process_max_requests = NGX_CONF_UNSET_UINT;
+    mcf->shared_processes = NGX_CONF_UNSET_UINT;
+    mcf->max_queue_size = NGX_CONF_UNSET_UINT;
+    mcf->high_priority_weight = NGX_CONF_UNSET_UINT;
+    mcf->reserved_processes = NGX_CONF_UNSET_UINT;
+    mcf->batch_size = NGX_CONF_UNSET_UINT;
+    mcf->result_transport = NGX_CONF_UNSET_UINT;
+    mcf->shm_zone = NULL;
+    mcf->shm = NULL;
+    mcf->remote_cache_zone = NULL;
+    mcf->remote_cache_valid = NGX_CONF_UNSET;
+    mcf->remote_cache = NULL;
+    mcf->index_cache_zone = NULL;
+    mcf->index_cache = NULL;
 
     return mcf;
 }
@@ -239,14 +526,56 @@ ngx_http_video_thumbextractor_init_main_conf(ngx_conf_t *cf, void *parent)
 {
 
     ngx_http_video_thumbextractor_main_conf_t     *conf = parent;
+    ngx_str_t                                      name = ngx_string("video_thumbextractor");
 
-    ngx_conf_merge_uint_value(conf->processes_per_worker, NGX_CONF_UNSET_UINT, 1);
+    ngx_conf_merge_uint_value(conf->shared_processes, NGX_CONF_UNSET_UINT, 0);
+    // when sharing the processes each worker may use all of them
+    ngx_conf_merge_uint_value(conf->processes_per_worker, NGX_CONF_UNSET_UINT, conf->shared_processes ? ngx_min(conf->shared_processes, NGX_MAX_PROCESSES) : 1);
+    ngx_conf_merge_value(conf->persistent_processes, NGX_CONF_UNSET, 0);
+    ngx_conf_merge_uint_value(conf->process_max_requests, NGX_CONF_UNSET_UINT, 1000);
+    ngx_conf_merge_uint_value(conf->max_queue_size, NGX_CONF_UNSET_UINT, 0);
+    ngx_conf_merge_uint_value(conf->high_priority_weight, NGX_CONF_UNSET_UINT, 4);
+    ngx_conf_merge_uint_value(conf->reserved_processes, NGX_CONF_UNSET_UINT, 0);
+    ngx_conf_merge_uint_value(conf->batch_size, NGX_CONF_UNSET_UINT, 8);
+    ngx_conf_merge_uint_value(conf->result_transport, NGX_CONF_UNSET_UINT, NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_PIPE);
+    ngx_conf_merge_sec_value(conf->remote_cache_valid, NGX_CONF_UNSET, 60);
+
+#if !(NGX_HTTP_VIDEO_THUMBEXTRACTOR_HAVE_MEMFD)
+    if (conf->result_transport == NGX_HTTP_VIDEO_THUMBEXTRACTOR_RESULT_MEMFD) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_result_transport memfd is not supported on this platform");
+        return NGX_CONF_ERROR;
+    }
+#endif
 
     if (conf->processes_per_worker > NGX_MAX_PROCESSES) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_processes_per_worker must be less than %d", NGX_MAX_PROCESSES);
         return NGX_CONF_ERROR;
     }
 
+    if ((conf->reserved_processes > 0) && (conf->reserved_processes >= conf->processes_per_worker)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_reserved_processes must be less than video_thumbextractor_processes_per_worker");
+        return NGX_CONF_ERROR;
+    }
+
+    if ((conf->batch_size == 0) || (conf->batch_size > NGX_HTTP_VIDEO_THUMBEXTRACTOR_MAX_BATCH_SIZE)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_batch_size must be between 1 and %d", NGX_HTTP_VIDEO_THUMBEXTRACTOR_MAX_BATCH_SIZE);
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->high_priority_weight == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_high_priority_weight must be greater than 0");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->shared_processes > 0) {
+        if ((conf->shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_http_video_thumbextractor_module)) == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->shm_zone->init = ngx_http_video_thumbextractor_module_init_shm_zone;
+        conf->shm_zone->data = conf;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -274,6 +603,12 @@ ngx_http_video_thumbextractor_create_loc_conf(ngx_conf_t *cf)
     conf->tile_margin = NULL;
     conf->tile_padding = NULL;
     ngx_str_null(&conf->tile_color);
+    conf->priority = NULL;
+    conf->remote_url = NULL;
+    conf->remote_block_size = NGX_CONF_UNSET_SIZE;
+    conf->remote_blocks = NGX_CONF_UNSET_UINT;
+    conf->remote_timeout = NGX_CONF_UNSET_MSEC;
+    conf->index_path = NULL;
     conf->jpeg_baseline = NGX_CONF_UNSET_UINT;
     conf->jpeg_progressive_mode = NGX_CONF_UNSET_UINT;
     conf->jpeg_optimize = NGX_CONF_UNSET_UINT;
@@ -282,7 +617,31 @@ ngx_http_video_thumbextractor_create_loc_conf(ngx_conf_t *cf)
     conf->jpeg_dpi = NGX_CONF_UNSET_UINT;
     conf->only_keyframe = NGX_CONF_UNSET_UINT;
     conf->next_time = NGX_CONF_UNSET_UINT;
+    conf->coalesce_requests = NGX_CONF_UNSET;
+    conf->queue_timeout = NGX_CONF_UNSET_MSEC;
+    conf->retry_after = NGX_CONF_UNSET;
+    conf->extract_timeout = NGX_CONF_UNSET_MSEC;
+    conf->extract_cpu_time = NGX_CONF_UNSET_MSEC;
+    conf->extract_max_bytes = NGX_CONF_UNSET;
+    conf->extract_max_packets = NGX_CONF_UNSET_UINT;
+    conf->extract_max_frames = NGX_CONF_UNSET_UINT;
+    conf->stream_output = NGX_CONF_UNSET;
+    conf->stream_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->io_mode = NGX_CONF_UNSET_UINT;
+    conf->io_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->readahead = NGX_CONF_UNSET_SIZE;
+    conf->probesize = NGX_CONF_UNSET_SIZE;
+    conf->analyzeduration = NGX_CONF_UNSET_MSEC;
+    conf->fpsprobesize = NGX_CONF_UNSET;
+    conf->adaptive_probe = NGX_CONF_UNSET;
+    conf->decode_quality = NGX_CONF_UNSET_UINT;
+    conf->scaler = NGX_CONF_UNSET_UINT;
+    conf->tile_decoders = NGX_CONF_UNSET_UINT;
+    conf->early_start = NGX_CONF_UNSET_SIZE;
     ngx_str_null(&conf->threads);
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     return conf;
 }
@@ -308,6 +667,12 @@ ngx_http_video_thumbextractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void
     ngx_conf_merge_null_value(conf->tile_margin, prev->tile_margin, NULL);
     ngx_conf_merge_null_value(conf->tile_padding, prev->tile_padding, NULL);
     ngx_conf_merge_str_value(conf->tile_color, prev->tile_color, "black");
+    ngx_conf_merge_null_value(conf->priority, prev->priority, NULL);
+    ngx_conf_merge_null_value(conf->remote_url, prev->remote_url, NULL);
+    ngx_conf_merge_size_value(conf->remote_block_size, prev->remote_block_size, 262144);
+    ngx_conf_merge_uint_value(conf->remote_blocks, prev->remote_blocks, 16);
+    ngx_conf_merge_msec_value(conf->remote_timeout, prev->remote_timeout, 10000);
+    ngx_conf_merge_null_value(conf->index_path, prev->index_path, NULL);
 
     ngx_conf_merge_uint_value(conf->jpeg_baseline, prev->jpeg_baseline, 1);
     ngx_conf_merge_uint_value(conf->jpeg_progressive_mode, prev->jpeg_progressive_mode, 0);
@@ -318,8 +683,33 @@ ngx_http_video_thumbextractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void
 
     ngx_conf_merge_value(conf->only_keyframe, prev->only_keyframe, 1);
     ngx_conf_merge_value(conf->next_time, prev->next_time, 1);
+    ngx_conf_merge_value(conf->coalesce_requests, prev->coalesce_requests, 1);
+    ngx_conf_merge_msec_value(conf->queue_timeout, prev->queue_timeout, 0);
+    ngx_conf_merge_sec_value(conf->retry_after, prev->retry_after, 1);
+    ngx_conf_merge_msec_value(conf->extract_timeout, prev->extract_timeout, 0);
+    ngx_conf_merge_msec_value(conf->extract_cpu_time, prev->extract_cpu_time, 0);
+    ngx_conf_merge_off_value(conf->extract_max_bytes, prev->extract_max_bytes, 0);
+    ngx_conf_merge_uint_value(conf->extract_max_packets, prev->extract_max_packets, 0);
+    ngx_conf_merge_uint_value(conf->extract_max_frames, prev->extract_max_frames, 0);
+    ngx_conf_merge_value(conf->stream_output, prev->stream_output, 0);
+    ngx_conf_merge_size_value(conf->stream_buffer_size, prev->stream_buffer_size, 16384);
+    ngx_conf_merge_uint_value(conf->io_mode, prev->io_mode, NGX_HTTP_VIDEO_THUMBEXTRACTOR_IO_PREAD);
+    ngx_conf_merge_size_value(conf->io_buffer_size, prev->io_buffer_size, 8192);
+    ngx_conf_merge_size_value(conf->readahead, prev->readahead, 0);
+    // zero, or -1 for fpsprobesize, keeps the default of the library
+    ngx_conf_merge_size_value(conf->probesize, prev->probesize, 0);
+    ngx_conf_merge_msec_value(conf->analyzeduration, prev->analyzeduration, 0);
+    ngx_conf_merge_value(conf->fpsprobesize, prev->fpsprobesize, -1);
+    ngx_conf_merge_value(conf->adaptive_probe, prev->adaptive_probe, 0);
+    ngx_conf_merge_uint_value(conf->decode_quality, prev->decode_quality, NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_NORMAL);
+    ngx_conf_merge_uint_value(conf->scaler, prev->scaler, NGX_HTTP_VIDEO_THUMBEXTRACTOR_SCALER_BICUBIC);
+    ngx_conf_merge_uint_value(conf->tile_decoders, prev->tile_decoders, 1);
+    ngx_conf_merge_size_value(conf->early_start, prev->early_start, 0);
 
     ngx_conf_merge_str_value(conf->threads, prev->threads, "auto");
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
 
     // if video thumb extractor is disable the other configurations don't have to be checked
     if (!conf->enabled) {
@@ -330,7 +720,7 @@ ngx_http_video_thumbextractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void
 
     // sanity checks
 
-    if (conf->video_filename == NULL) {
+    if ((conf->video_filename == NULL) && (conf->remote_url == NULL)) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_video_filename must be defined");
         return NGX_CONF_ERROR;
     }
@@ -340,13 +730,76 @@ ngx_http_video_thumbextractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void
         return NGX_CONF_ERROR;
     }
 
+    if (conf->stream_buffer_size == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_stream_buffer_size must be greater than 0");
+        return NGX_CONF_ERROR;
+    }
+
+    if ((conf->io_buffer_size == 0) || (conf->io_buffer_size > NGX_MAX_INT32_VALUE)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_io_buffer_size must be between 1 and %d", NGX_MAX_INT32_VALUE);
+        return NGX_CONF_ERROR;
+    }
+
+    if ((conf->probesize > 0) && (conf->probesize < 32)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_probesize must be at least 32");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->tile_decoders == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_tile_decoders must be greater than 0");
+        return NGX_CONF_ERROR;
+    }
+
+#if !(NGX_THREADS)
+    if (conf->tile_decoders > 1) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_tile_decoders requires nginx built with --with-threads");
+        return NGX_CONF_ERROR;
+    }
+#else
+    // each task of the pool would start and wait for its own decoder threads, out of the limit of the pool
+    if ((conf->tile_decoders > 1) && (conf->thread_pool != NULL)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_tile_decoders can not be used with video_thumbextractor_thread_pool");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    if ((conf->remote_block_size == 0) || (conf->remote_blocks == 0)) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_remote_block_size and video_thumbextractor_remote_blocks must be greater than 0");
+        return NGX_CONF_ERROR;
+    }
+
+    if ((conf->early_start > 0) && conf->stream_output) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "video thumbextractor module: video_thumbextractor_early_start can not be used with video_thumbextractor_stream_output");
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_video_thumbextractor_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_video_thumbextractor_vars; v->name.len; v++) {
+        if ((var = ngx_http_add_variable(cf, &v->name, v->flags)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_video_thumbextractor_post_config(ngx_conf_t *cf)
 {
+    ngx_http_core_main_conf_t       *cmcf;
+    ngx_http_handler_pt             *h;
     ngx_int_t                        rc;
 
     if (!ngx_http_video_thumbextractor_used) {
@@ -358,10 +811,26 @@ ngx_http_video_thumbextractor_post_config(ngx_conf_t *cf)
         return rc;
     }
 
+    // a video read from a remote origin has no response to be filtered, the module answers the request itself
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    if ((h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_video_thumbextractor_remote_handler;
+
     return NGX_OK;
 }
 
 
+static ngx_int_t
+ngx_http_video_thumbextractor_init_module(ngx_cycle_t *cycle)
+{
+    // created before the workers are forked, so each one can notify the others
+    return ngx_http_video_thumbextractor_module_create_channels(cycle);
+}
+
+
 static ngx_int_t
 ngx_http_video_thumbextractor_init_worker(ngx_cycle_t *cycle)
 {
@@ -370,14 +839,28 @@ ngx_http_video_thumbextractor_init_worker(ngx_cycle_t *cycle)
     for (i = 0; i < NGX_MAX_PROCESSES; ++i) {
         ngx_http_video_thumbextractor_module_ipc_ctxs[i].pid = -1;
         ngx_http_video_thumbextractor_module_ipc_ctxs[i].slot = i;
+        ngx_http_video_thumbextractor_module_ipc_ctxs[i].shared_slot = -1;
+        ngx_http_video_thumbextractor_module_ipc_ctxs[i].conn = NULL;
+        ngx_http_video_thumbextractor_module_ipc_ctxs[i].processing = 0;
+        ngx_http_video_thumbextractor_module_ipc_ctxs[i].requests = 0;
     }
 
-    if ((ngx_http_video_thumbextractor_module_extract_queue = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_queue_t))) == NULL) {
+    if ((ngx_http_video_thumbextractor_module_extract_queue = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_queue_t) * NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITIES)) == NULL) {
         ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "video thumb extractor module: unable to allocate memory to queue of extractions");
         return NGX_ERROR;
     }
 
-    ngx_queue_init(ngx_http_video_thumbextractor_module_extract_queue);
+    for (i = 0; i < NGX_HTTP_VIDEO_THUMBEXTRACTOR_PRIORITIES; ++i) {
+        ngx_queue_init(&ngx_http_video_thumbextractor_module_extract_queue[i]);
+    }
+    ngx_http_video_thumbextractor_module_extract_queue_size = 0;
+    ngx_rbtree_init(&ngx_http_video_thumbextractor_module_jobs, &ngx_http_video_thumbextractor_module_jobs_sentinel, ngx_rbtree_insert_value);
+
+    ngx_http_video_thumbextractor_module_recover_shared_slots();
+
+    if (ngx_http_video_thumbextractor_module_open_channel() != NGX_OK) {
+        return NGX_ERROR;
+    }
 
     ngx_http_video_thumbextractor_init_libraries();
     return NGX_OK;
@@ -389,7 +872,12 @@ ngx_http_video_thumbextractor_exit_worker(ngx_cycle_t *cycle)
 {
     ngx_uint_t                                 i;
 
+    ngx_http_video_thumbextractor_module_cancel_retry();
+    ngx_http_video_thumbextractor_module_stop_waiting();
+
     for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        ngx_http_video_thumbextractor_module_release_shared_slot(&ngx_http_video_thumbextractor_module_ipc_ctxs[i]);
+
         if (ngx_http_video_thumbextractor_module_ipc_ctxs[i].pid != -1) {
             ngx_close_socket(ngx_http_video_thumbextractor_module_ipc_ctxs[i].pipefd[0]);
             ngx_close_socket(ngx_http_video_thumbextractor_module_ipc_ctxs[i].pipefd[1]);
@@ -411,3 +899,138 @@ ngx_http_video_thumbextractor(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     return NGX_CONF_OK;
 }
 
+
+
+static char *
+ngx_http_video_thumbextractor_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                                *value = cf->args->elts;
+#if (NGX_THREADS)
+    ngx_http_video_thumbextractor_loc_conf_t *vtlcf = conf;
+
+    if (vtlcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        vtlcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if ((vtlcf->thread_pool = ngx_thread_pool_add(cf, &value[1])) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#else
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: video_thumbextractor_thread_pool requires nginx built with --with-threads");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+
+static char *
+ngx_http_video_thumbextractor_remote_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = conf;
+    ngx_str_t                                 *value = cf->args->elts, s;
+    time_t                                     valid;
+
+    if (vtmcf->remote_cache_zone != NULL) {
+        return "is duplicate";
+    }
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "valid=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 6;
+        s.len = value[2].len - 6;
+
+        if ((valid = ngx_parse_time(&s, 1)) == (time_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: invalid valid time \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        vtmcf->remote_cache_valid = valid;
+    }
+
+    if ((vtmcf->remote_cache_zone = ngx_http_video_thumbextractor_keys_zone(cf, cmd, &value[1])) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    vtmcf->remote_cache_zone->init = ngx_http_video_thumbextractor_remote_init_cache_zone;
+    vtmcf->remote_cache_zone->data = vtmcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_video_thumbextractor_index_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_video_thumbextractor_main_conf_t *vtmcf = conf;
+    ngx_str_t                                 *value = cf->args->elts;
+
+    if (vtmcf->index_cache_zone != NULL) {
+        return "is duplicate";
+    }
+
+    if ((vtmcf->index_cache_zone = ngx_http_video_thumbextractor_keys_zone(cf, cmd, &value[1])) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    vtmcf->index_cache_zone->init = ngx_http_video_thumbextractor_index_init_zone;
+    vtmcf->index_cache_zone->data = vtmcf;
+
+    return NGX_CONF_OK;
+}
+
+
+/* add the shared memory zone of a keys_zone=name:size parameter, written as on the nginx caches */
+static ngx_shm_zone_t *
+ngx_http_video_thumbextractor_keys_zone(ngx_conf_t *cf, ngx_command_t *cmd, ngx_str_t *value)
+{
+    ngx_shm_zone_t                            *zone;
+    ngx_str_t                                  name, s;
+    ssize_t                                    size;
+    u_char                                    *p;
+
+    if ((ngx_strncmp(value->data, "keys_zone=", 10) != 0) || ((p = (u_char *) ngx_strlchr(value->data + 10, value->data + value->len, ':')) == NULL)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: %V needs a keys_zone=name:size parameter", &cmd->name);
+        return NULL;
+    }
+
+    name.data = value->data + 10;
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: %V needs a zone name", &cmd->name);
+        return NULL;
+    }
+
+    if (((size = ngx_parse_size(&s)) == NGX_ERROR) || (size < (ssize_t) (8 * ngx_pagesize))) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: %V size must be at least %uz", &cmd->name, 8 * ngx_pagesize);
+        return NULL;
+    }
+
+    if ((zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_video_thumbextractor_module)) == NULL) {
+        return NULL;
+    }
+
+    if (zone->data != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "video thumbextractor module: zone \"%V\" is already used", &name);
+        return NULL;
+    }
+
+    return zone;
+}
@@ -31,230 +31,1581 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/display.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
 #include <jpeglib.h>
 
-#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_BUFFER_SIZE 1024 * 8
-#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MEMORY_STEP 1024
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_MIN_BLOCK_SIZE     4096
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_COMPRESSION_RATIO  16
 #define NGX_HTTP_VIDEO_THUMBEXTRACTOR_RGB         "RGB"
 
-static uint32_t     ngx_http_video_thumbextractor_jpeg_compress(ngx_http_video_thumbextractor_loc_conf_t *cf, uint8_t * buffer, int linesize, int out_width, int out_height, caddr_t *out_buffer, size_t *out_len, size_t uncompressed_size, ngx_pool_t *temp_pool);
-static void         ngx_http_video_thumbextractor_jpeg_memory_dest (j_compress_ptr cinfo, caddr_t *out_buf, size_t *out_size, size_t uncompressed_size, ngx_pool_t *temp_pool);
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_PROBESIZE        32768
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_ANALYZEDURATION  (AV_TIME_BASE / 2)
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_FACTOR           8
+
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_SEEK     0
+#define NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_DECODE   1
+
+/* indexed by the video_thumbextractor_scaler values */
+static const char *ngx_http_video_thumbextractor_scaler_names[] = { "bicubic", "bilinear", "fast_bilinear", "area" };
+static int         ngx_http_video_thumbextractor_scaler_flags[] = { SWS_BICUBIC, SWS_BILINEAR, SWS_FAST_BILINEAR, SWS_AREA };
+
+/* a video opened once to extract one or more thumbs */
+typedef struct {
+    ngx_http_video_thumbextractor_file_info_t  *info;
+    AVFormatContext                            *format_ctx;
+    AVCodecContext                             *codec_ctx;
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(59, 16, 100)
+    AVCodec                                    *codec;
+#else
+    const AVCodec                              *codec;
+#endif
+    int                                         lowres;     /* the codec context was opened with */
+    AVIOContext                                *avio_ctx;
+    int                                         stream;
+    int                                         rotate;
+    ngx_http_video_thumbextractor_index_node_t *index;      /* learned by previous extractions or read from the index file */
+    ngx_flag_t                                  cached;     /* the index came from the shared cache */
+    ngx_uint_t                                  keyframes;  /* on the stream index when it was opened */
+    ngx_flag_t                                  opened;
+} ngx_http_video_thumbextractor_video_t;
+
+/* the image of a tile, each frame is written on its place as soon as it is scaled */
+typedef struct {
+    AVFrame                                    *frame;      /* rgb24 */
+    ngx_int_t                                   cols;
+    ngx_int_t                                   rows;
+    int                                         tile_width;
+    int                                         tile_height;
+    int                                         margin;
+    int                                         padding;
+    uint8_t                                     color[4];
+    ngx_flag_t                                  direct;     /* a single frame, written by the filter graph */
+} ngx_http_video_thumbextractor_sprite_t;
+
+/* scale and crop of the decoded frames, by swscale straight on the image or by a filter graph for rotated videos */
+typedef struct {
+    AVFilterGraph                              *filter_graph;
+    AVFilterContext                            *buffersrc_ctx;
+    AVFilterContext                            *buffersink_ctx;
+    AVFrame                                    *scaled;
+    struct SwsContext                          *sws_ctx;
+    int                                         flags;
+    int                                         scale_width;    /* before the crop */
+    int                                         scale_height;
+    int                                         width;          /* of the frames the context was created for */
+    int                                         height;
+    int                                         format;
+    int                                         src_x;          /* the cropped area on the decoded frames */
+    int                                         src_y;
+    int                                         src_width;
+    int                                         src_height;
+} ngx_http_video_thumbextractor_scaler_t;
+
+#if (NGX_THREADS)
+/* samples of a sprite decoded by their own decoder */
+typedef struct {
+    ngx_http_video_thumbextractor_loc_conf_t   *cf;
+    ngx_http_video_thumbextractor_thumb_ctx_t   ctx;        /* a copy starting on the first sample of the range */
+    ngx_http_video_thumbextractor_video_t      *video;      /* already opened, for the first range */
+    ngx_http_video_thumbextractor_sprite_t     *sprite;
+    ngx_uint_t                                  first;
+    ngx_uint_t                                  nsamples;
+    ngx_uint_t                                  found;      /* samples written on the image */
+    ngx_pool_t                                 *pool;
+    ngx_log_t                                  *log;
+    pthread_t                                   thread;
+    ngx_flag_t                                  started;
+    int                                         rc;
+} ngx_http_video_thumbextractor_range_t;
+#endif
+
+/* destination writing the encoded image to a chain of blocks, each one twice the size of the previous */
+typedef struct {
+    struct jpeg_destination_mgr  pub; /* public fields */
+
+    ngx_chain_t                **out;
+    ngx_chain_t                 *last;
+    size_t                      *size;
+    size_t                       block_size;
+    ngx_flag_t                   failed;
+    ngx_pool_t                  *pool;
+} ngx_http_video_thumbextractor_jpeg_destination_mgr;
+
+/* destination writing the encoded image in fixed blocks to the output of the thumb context */
+typedef struct {
+    struct jpeg_destination_mgr                 pub; /* public fields */
+
+    ngx_http_video_thumbextractor_thumb_ctx_t  *ctx;
+    size_t                                     *size;
+    u_char                                     *block;
+    size_t                                      block_size;
+    ngx_flag_t                                  failed;
+    ngx_pool_t                                 *pool;
+} ngx_http_video_thumbextractor_jpeg_stream_destination_mgr;
+
+static int          ngx_http_video_thumbextractor_open_video(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_http_video_thumbextractor_video_t *video, ngx_log_t *log);
+static int          ngx_http_video_thumbextractor_extract_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_chain_t **out, size_t *out_len, ngx_pool_t *temp_pool, ngx_log_t *log);
+static int          ngx_http_video_thumbextractor_close_video(ngx_http_video_thumbextractor_video_t *video, ngx_log_t *log);
+static void         ngx_http_video_thumbextractor_map_file(ngx_http_video_thumbextractor_file_info_t *info, ngx_log_t *log);
+static void         ngx_http_video_thumbextractor_readahead(ngx_http_video_thumbextractor_file_info_t *info, int64_t position);
+static void         ngx_http_video_thumbextractor_prefetch_second(ngx_http_video_thumbextractor_video_t *video, int64_t second);
+static const AVIndexEntry *ngx_http_video_thumbextractor_keyframe_entry(AVStream *stream, int64_t timestamp);
+static u_char      *ngx_http_video_thumbextractor_plan_samples(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, int64_t second, int64_t interval, ngx_uint_t nsamples, ngx_pool_t *temp_pool);
+static int          ngx_http_video_thumbextractor_decode_sample(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, AVFrame *pFrame, int64_t second, ngx_log_t *log);
+static ngx_int_t    ngx_http_video_thumbextractor_sprite_init(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFrame *frame, ngx_flag_t direct_allowed, ngx_log_t *log);
+static uint8_t     *ngx_http_video_thumbextractor_sprite_tile(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t sample);
+static void         ngx_http_video_thumbextractor_sprite_draw(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t sample, AVFrame *tile);
+static void         ngx_http_video_thumbextractor_sprite_finish(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t nsamples);
+static void         ngx_http_video_thumbextractor_sprite_fill(ngx_http_video_thumbextractor_sprite_t *sprite, int x, int y, int width, int height);
+static ngx_int_t    ngx_http_video_thumbextractor_scaler_init(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_scaler_t *scaler, ngx_log_t *log);
+static ngx_flag_t   ngx_http_video_thumbextractor_scaler_supported(enum AVPixelFormat format);
+static ngx_int_t    ngx_http_video_thumbextractor_scaler_context(ngx_http_video_thumbextractor_scaler_t *scaler, ngx_http_video_thumbextractor_sprite_t *sprite, AVFrame *frame, ngx_log_t *log);
+static ngx_int_t    ngx_http_video_thumbextractor_scaler_draw(ngx_http_video_thumbextractor_scaler_t *scaler, ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t sample, AVFrame *frame, ngx_log_t *log);
+static void         ngx_http_video_thumbextractor_scaler_free(ngx_http_video_thumbextractor_scaler_t *scaler);
+static void         ngx_http_video_thumbextractor_scale_size(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVCodecContext *pCodecCtx, int rotate_value, int *scale_width, int *scale_height);
+static int          ngx_http_video_thumbextractor_extract_samples(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFrame *pFrame, ngx_pool_t *temp_pool, ngx_log_t *log);
+#if (NGX_THREADS)
+static int          ngx_http_video_thumbextractor_extract_ranges(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFrame *pFrame, ngx_pool_t *temp_pool, ngx_log_t *log);
+static void        *ngx_http_video_thumbextractor_range_thread(void *data);
+static void         ngx_http_video_thumbextractor_decode_range(ngx_http_video_thumbextractor_range_t *range);
+#endif
+static int          ngx_http_video_thumbextractor_decode_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_file_info_t *info, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, AVFrame *pFrame, int videoStream, int64_t second_on_stream_time_base, ngx_log_t *log);
+static uint64_t     ngx_http_video_thumbextractor_usec(void);
+static int          ngx_http_video_thumbextractor_stream_rotation(AVStream *stream);
+static ngx_int_t    ngx_http_video_thumbextractor_find_stream_info(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video);
+static ngx_flag_t   ngx_http_video_thumbextractor_has_stream_info(AVFormatContext *format_ctx);
+static int          ngx_http_video_thumbextractor_open_codec(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_log_t *log);
+static int          ngx_http_video_thumbextractor_lowres(ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx);
+
+static uint32_t     ngx_http_video_thumbextractor_jpeg_compress(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, uint8_t * buffer, int linesize, int out_width, int out_height, ngx_chain_t **out, size_t *out_len, size_t uncompressed_size, ngx_pool_t *temp_pool);
+static ngx_int_t    ngx_http_video_thumbextractor_jpeg_memory_dest (j_compress_ptr cinfo, ngx_chain_t **out, size_t *out_size, size_t uncompressed_size, ngx_pool_t *temp_pool);
+static ngx_int_t    ngx_http_video_thumbextractor_jpeg_stream_dest (j_compress_ptr cinfo, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, size_t *out_size, size_t block_size, ngx_pool_t *temp_pool);
 
 int setup_parameters(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx);
-int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, int videoStream, AVFilterGraph **fg, AVFilterContext **buf_src_ctx, AVFilterContext **buf_sink_ctx, ngx_log_t *log);
+int setup_size(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVCodecContext *pCodecCtx, int rotate_value, ngx_log_t *log);
+int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, int videoStream, int rotate_value, ngx_uint_t scaler, AVFilterGraph **fg, AVFilterContext **buf_src_ctx, AVFilterContext **buf_sink_ctx, ngx_log_t *log);
 int filter_frame(AVFilterContext *buffersrc_ctx, AVFilterContext *buffersink_ctx, AVFrame *inFrame, AVFrame *outFrame, ngx_log_t *log);
-int get_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, AVFrame *pFrame, int videoStream, int64_t second, ngx_log_t *log);
+int get_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_file_info_t *info, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, AVFrame *pFrame, int videoStream, int64_t second, ngx_log_t *log);
+int ngx_http_video_thumbextractor_interrupt_callback(void *opaque);
+
+static void         ngx_http_video_thumbextractor_start_budget(ngx_http_video_thumbextractor_budget_t *budget, ngx_http_video_thumbextractor_loc_conf_t *cf);
+static ngx_msec_t   ngx_http_video_thumbextractor_cpu_time(ngx_http_video_thumbextractor_budget_t *budget);
+static void         ngx_http_video_thumbextractor_budget_clock(ngx_http_video_thumbextractor_budget_t *budget, ngx_flag_t per_thread);
+static ngx_int_t    ngx_http_video_thumbextractor_check_budget(ngx_http_video_thumbextractor_file_info_t *info);
+
+// the decoders of a sprite count on the same budget, so a limit reached by one of them stops all
+#define ngx_http_video_thumbextractor_budget_counters(info)                           \
+    (((info)->budget.shared != NULL) ? (info)->budget.shared : &(info)->budget)
+
+#define ngx_http_video_thumbextractor_budget_add(info, counter, n)                    \
+    (void) ngx_atomic_fetch_add(&ngx_http_video_thumbextractor_budget_counters(info)->counter, n)
+
+#define ngx_http_video_thumbextractor_budget_exceeded(info)                           \
+    ((ngx_int_t) ngx_http_video_thumbextractor_budget_counters(info)->exceeded)
+
+
+int ngx_http_video_thumbextractor_interrupt_callback(void *opaque)
+{
+    ngx_http_video_thumbextractor_file_info_t *info = (ngx_http_video_thumbextractor_file_info_t *) opaque;
+
+    return ((info->cancelled != NULL) && *info->cancelled) || (ngx_http_video_thumbextractor_check_budget(info) != NGX_OK);
+}
+
+
+static void
+ngx_http_video_thumbextractor_start_budget(ngx_http_video_thumbextractor_budget_t *budget, ngx_http_video_thumbextractor_loc_conf_t *cf)
+{
+    budget->cf = cf;
+    budget->bytes = 0;
+    budget->packets = 0;
+    budget->frames = 0;
+    budget->exceeded = NGX_OK;
+    budget->cpu_start = (cf->extract_cpu_time > 0) ? ngx_http_video_thumbextractor_cpu_time(budget) : 0;
+}
+
+
+static ngx_msec_t
+ngx_http_video_thumbextractor_cpu_time(ngx_http_video_thumbextractor_budget_t *budget)
+{
+    struct timespec ts;
+
+    // a thread shares the process with the nginx worker, only its own time counts
+    if (clock_gettime(budget->per_thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts) == -1) {
+        return 0;
+    }
+
+    return (ngx_msec_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* change the clock the CPU time is measured on, keeping the time already spent on the extraction */
+static void
+ngx_http_video_thumbextractor_budget_clock(ngx_http_video_thumbextractor_budget_t *budget, ngx_flag_t per_thread)
+{
+    ngx_msec_t      spent, now;
+
+    if ((budget->per_thread == per_thread) || (budget->cf == NULL) || (budget->cf->extract_cpu_time == 0)) {
+        budget->per_thread = per_thread;
+        return;
+    }
+
+    spent = ngx_http_video_thumbextractor_cpu_time(budget) - budget->cpu_start;
+    budget->per_thread = per_thread;
+    now = ngx_http_video_thumbextractor_cpu_time(budget);
+    budget->cpu_start = (now > spent) ? now - spent : 0;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_check_budget(ngx_http_video_thumbextractor_file_info_t *info)
+{
+    ngx_http_video_thumbextractor_budget_t   *budget = &info->budget;
+    ngx_http_video_thumbextractor_budget_t   *counters = ngx_http_video_thumbextractor_budget_counters(info);
+    ngx_http_video_thumbextractor_loc_conf_t *cf = budget->cf;
+    ngx_msec_t                                cpu_time;
+    ngx_int_t                                 exceeded = NGX_OK;
+
+    if ((counters->exceeded != NGX_OK) || (cf == NULL)) {
+        return (ngx_int_t) counters->exceeded;
+    }
+
+    if ((cf->extract_max_bytes > 0) && ((off_t) counters->bytes > cf->extract_max_bytes)) {
+        ngx_log_error(NGX_LOG_WARN, info->file.log, 0, "video thumb extractor module: extraction read more than %O bytes from \"%V\"", cf->extract_max_bytes, &info->file.name);
+        exceeded = NGX_HTTP_VIDEO_THUMBEXTRACTOR_BYTES_EXCEEDED;
+
+    } else if ((cf->extract_max_packets > 0) && (counters->packets > cf->extract_max_packets)) {
+        ngx_log_error(NGX_LOG_WARN, info->file.log, 0, "video thumb extractor module: extraction read more than %ui packets from \"%V\"", cf->extract_max_packets, &info->file.name);
+        exceeded = NGX_HTTP_VIDEO_THUMBEXTRACTOR_PACKETS_EXCEEDED;
+
+    } else if ((cf->extract_max_frames > 0) && (counters->frames > cf->extract_max_frames)) {
+        ngx_log_error(NGX_LOG_WARN, info->file.log, 0, "video thumb extractor module: extraction decoded more than %ui frames from \"%V\"", cf->extract_max_frames, &info->file.name);
+        exceeded = NGX_HTTP_VIDEO_THUMBEXTRACTOR_FRAMES_EXCEEDED;
+
+    } else if ((cf->extract_cpu_time > 0) && ((cpu_time = ngx_http_video_thumbextractor_cpu_time(budget) - budget->cpu_start) > cf->extract_cpu_time)) {
+        // each decoder thread checks its own time
+        ngx_log_error(NGX_LOG_WARN, info->file.log, 0, "video thumb extractor module: extraction used %M ms of CPU on \"%V\", more than %M ms", cpu_time, &info->file.name, cf->extract_cpu_time);
+        exceeded = NGX_HTTP_VIDEO_THUMBEXTRACTOR_CPU_TIME_EXCEEDED;
+    }
+
+    if (exceeded != NGX_OK) {
+        // the first limit reached by any of the decoders is the one reported
+        ngx_atomic_cmp_set(&counters->exceeded, NGX_OK, exceeded);
+    }
+
+    return (ngx_int_t) counters->exceeded;
+}
+
+
+static uint64_t
+ngx_http_video_thumbextractor_usec(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        return 0;
+    }
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int
+ngx_http_video_thumbextractor_stream_rotation(AVStream *stream)
+{
+    AVDictionaryEntry *rotate = av_dict_get(stream->metadata, "rotate", NULL, 0);
+    int32_t           *displaymatrix;
+
+    if (rotate) {
+        return ngx_atoi((u_char *) rotate->value, ngx_strlen(rotate->value));
+    }
+
+    displaymatrix = (int32_t *) av_stream_get_side_data(stream, AV_PKT_DATA_DISPLAYMATRIX, NULL);
+
+    return (displaymatrix != NULL) ? -1 * av_display_rotation_get(displaymatrix) : 0;
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_find_stream_info(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video)
+{
+    AVFormatContext *format_ctx = video->format_ctx;
+    int64_t          max_probesize = format_ctx->probesize;
+    int64_t          max_analyzeduration = (format_ctx->max_analyze_duration > 0) ? format_ctx->max_analyze_duration : 5 * AV_TIME_BASE;
+
+    if (!cf->adaptive_probe) {
+        video->info->stats.probe_rounds = 1;
+        return (avformat_find_stream_info(format_ctx, NULL) < 0) ? NGX_ERROR : NGX_OK;
+    }
+
+    // start with a tiny probe, most files have the parameters of the video on the first packets
+    format_ctx->probesize = ngx_min(NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_PROBESIZE, max_probesize);
+    format_ctx->max_analyze_duration = ngx_min(NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_ANALYZEDURATION, max_analyzeduration);
+
+    for ( ;; ) {
+        video->info->stats.probe_rounds++;
+
+        if (avformat_find_stream_info(format_ctx, NULL) < 0) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_video_thumbextractor_has_stream_info(format_ctx) || ((format_ctx->probesize >= max_probesize) && (format_ctx->max_analyze_duration >= max_analyzeduration))) {
+            return NGX_OK;
+        }
+
+        // the packets read so far stay buffered on the demuxer, a wider probe only reads what comes after them
+        format_ctx->probesize = ngx_min(format_ctx->probesize * NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_FACTOR, max_probesize);
+        format_ctx->max_analyze_duration = ngx_min(format_ctx->max_analyze_duration * NGX_HTTP_VIDEO_THUMBEXTRACTOR_ADAPTIVE_FACTOR, max_analyzeduration);
+    }
+}
+
+
+static int
+ngx_http_video_thumbextractor_open_codec(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_log_t *log)
+{
+    AVDictionary    *dict = NULL;
+    char             value[10];
+    int              ret;
+
+    if (video->codec_ctx != NULL) {
+        avcodec_free_context(&video->codec_ctx);
+    }
+
+    // Get a pointer to the codec context for the video stream
+    video->codec_ctx = avcodec_alloc_context3(video->codec);
+    if (video->codec_ctx == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not allocate the codec context");
+        return NGX_ERROR;
+    }
+    avcodec_parameters_to_context(video->codec_ctx, video->format_ctx->streams[video->stream]->codecpar);
+
+    ngx_sprintf((u_char *) value, "%V%Z", &cf->threads);
+    av_dict_set(&dict, "threads", value, 0);
+
+    video->lowres = 0;
+    if (cf->decode_quality == NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_FAST) {
+        // the decoder reduces the size of the frames by itself, avcodec_open2 adjusts the width and height of the context
+        video->lowres = ngx_http_video_thumbextractor_lowres(video, ctx);
+        video->codec_ctx->lowres = video->lowres;
+        video->codec_ctx->skip_loop_filter = AVDISCARD_ALL;
+        // a skipped frame would change the one returned for the requested second, only keyframes are returned anyway
+        if (cf->only_keyframe) {
+            video->codec_ctx->skip_frame = AVDISCARD_NONREF;
+        }
+    }
+
+    // Open codec
+    ret = avcodec_open2(video->codec_ctx, video->codec, &dict);
+    av_dict_free(&dict);
+    if (ret < 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not open codec");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_video_thumbextractor_lowres(ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx)
+{
+    AVCodecParameters *par = video->format_ctx->streams[video->stream]->codecpar;
+    int                width, height, w = ctx->width, h = ctx->height, lowres = 0;
+
+    // the original size was requested or the codec can't decode a reduced frame
+    if ((ctx->height == 0) || (video->codec->max_lowres == 0) || (par->width <= 0) || (par->height <= 0)) {
+        return 0;
+    }
+
+    width = par->width;
+    if ((par->sample_aspect_ratio.num > 0) && (par->sample_aspect_ratio.den > 0)) {
+        width = width * av_q2d(par->sample_aspect_ratio);
+    }
+    height = par->height;
+
+    // the requested size is on the display orientation
+    if ((video->rotate == 90) || (video->rotate == 270) || (video->rotate == -90)) {
+        w = ctx->height;
+        h = ctx->width;
+    }
+
+    // the scale covers the requested size, a frame reduced below it would be enlarged again
+    while ((lowres < video->codec->max_lowres) && ((width >> (lowres + 1)) >= w) && ((height >> (lowres + 1)) >= h)) {
+        lowres++;
+    }
+
+    return lowres;
+}
+
+
+static ngx_flag_t
+ngx_http_video_thumbextractor_has_stream_info(AVFormatContext *format_ctx)
+{
+    AVCodecParameters *par;
+    int                stream;
+
+    if ((stream = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        return 0;
+    }
+
+    par = format_ctx->streams[stream]->codecpar;
+
+    // what the filters need to be configured
+    return (par->width > 0) && (par->height > 0) && (par->format != AV_PIX_FMT_NONE);
+}
 
 
 int64_t ngx_http_video_thumbextractor_seek_data_from_file(void *opaque, int64_t offset, int whence)
 {
     ngx_http_video_thumbextractor_file_info_t *info = (ngx_http_video_thumbextractor_file_info_t *) opaque;
-    if (whence == AVSEEK_SIZE) {
+    int64_t                                    position;
+
+    // only the position is moved, the reads use it as their offset on the file
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
         return info->size;
+
+    case SEEK_SET:
+        position = offset;
+        break;
+
+    case SEEK_CUR:
+        position = info->position + offset;
+        break;
+
+    case SEEK_END:
+        position = info->size + offset;
+        break;
+
+    default:
+        return -1;
+    }
+
+    if (position < 0) {
+        return -1;
     }
 
-    if ((whence == SEEK_SET) || (whence == SEEK_CUR) || (whence == SEEK_END)) {
-        info->file.offset = lseek(info->file.fd, info->offset + offset, whence);
-        return info->file.offset < 0 ? -1 : 0;
+    // the demuxer jumped, ask the kernel to start reading what comes next before the first read blocks on it
+    if (position != info->position) {
+        ngx_http_video_thumbextractor_readahead(info, position);
     }
-    return -1;
+
+    info->position = position;
+
+    return position;
 }
 
 
 int ngx_http_video_thumbextractor_read_data_from_file(void *opaque, uint8_t *buf, int buf_len)
 {
     ngx_http_video_thumbextractor_file_info_t *info = (ngx_http_video_thumbextractor_file_info_t *) opaque;
+    ssize_t                                    r;
+    uint64_t                                   started, elapsed;
+
+    if (ngx_http_video_thumbextractor_interrupt_callback(info)) {
+        return AVERROR_EXIT;
+    }
+
+    if (info->position >= info->size) {
+        return AVERROR_EOF;
+    }
+
+    if (buf_len > info->size - info->position) {
+        buf_len = info->size - info->position;
+    }
+
+    started = ngx_http_video_thumbextractor_usec();
+
+    if (info->remote_source != NULL) {
+        if ((r = ngx_http_video_thumbextractor_remote_read(info->remote_source, buf, buf_len, info->position)) == NGX_ERROR) {
+            return AVERROR(EIO);
+        } else if (r == 0) {
+            return AVERROR_EOF;
+        }
+
+    } else if (info->map != NULL) {
+        ngx_memcpy(buf, info->map + info->offset + info->position, buf_len);
+        r = buf_len;
+
+    } else if ((r = ngx_read_file(&info->file, buf, buf_len, info->offset + info->position)) == NGX_ERROR) {
+        return AVERROR(ngx_errno);
+
+    } else if (r == 0) {
+        return AVERROR_EOF;
+    }
+
+    elapsed = ngx_http_video_thumbextractor_usec() - started;
+    info->stats.reads++;
+    info->stats.bytes += r;
+    info->stats.usec += elapsed;
+    info->stats.max_usec = ngx_max(info->stats.max_usec, elapsed);
+
+    info->position += r;
+    ngx_http_video_thumbextractor_budget_add(info, bytes, r);
+
+    return r;
+}
+
+
+static void
+ngx_http_video_thumbextractor_map_file(ngx_http_video_thumbextractor_file_info_t *info, ngx_log_t *log)
+{
+    u_char                                    *map;
 
-    if ((info->offset > 0) && (info->file.offset < info->offset)) {
-        info->file.offset = lseek(info->file.fd, info->offset, SEEK_SET);
-        if (info->file.offset < 0) {
-            return AVERROR(ngx_errno);
+    // the mapping starts at the beginning of the file, the offset of a cached body may not be page aligned
+    map = mmap(NULL, info->offset + info->size, PROT_READ, MAP_PRIVATE, info->file.fd, 0);
+    if (map == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "video thumb extractor module: unable to map file \"%V\", reading it with pread", &info->file.name);
+        return;
+    }
+
+    info->map = map;
+}
+
+
+static void
+ngx_http_video_thumbextractor_readahead(ngx_http_video_thumbextractor_file_info_t *info, int64_t position)
+{
+    int64_t                                    len, start, aligned;
+
+    if ((info->readahead == 0) || (position < 0) || (position >= info->size)) {
+        return;
+    }
+
+    // most of the region is already on its way
+    if ((position >= info->hint_start) && (position + (int64_t) info->readahead / 2 <= info->hint_end)) {
+        return;
+    }
+
+    len = ngx_min((int64_t) info->readahead, info->size - position);
+    start = info->offset + position;
+
+    info->hint_start = position;
+    info->hint_end = position + len;
+
+    if (info->map != NULL) {
+        // madvise needs a page aligned address
+        aligned = start & ~((int64_t) ngx_pagesize - 1);
+        if (madvise(info->map + aligned, len + (start - aligned), MADV_WILLNEED) == 0) {
+            info->stats.hints++;
         }
+        return;
+    }
+
+#if (NGX_HAVE_POSIX_FADVISE)
+    if (posix_fadvise(info->file.fd, start, len, POSIX_FADV_WILLNEED) == 0) {
+        info->stats.hints++;
+    }
+#endif
+}
+
+
+static void
+ngx_http_video_thumbextractor_prefetch_second(ngx_http_video_thumbextractor_video_t *video, int64_t second)
+{
+    AVStream            *stream = video->format_ctx->streams[video->stream];
+    const AVIndexEntry  *entry;
+
+    if (video->info->readahead == 0) {
+        return;
+    }
+
+    entry = ngx_http_video_thumbextractor_keyframe_entry(stream, second * stream->time_base.den / stream->time_base.num);
+
+    // formats without an index are only hinted when the seek happens
+    if ((entry != NULL) && (entry->pos >= 0)) {
+        ngx_http_video_thumbextractor_readahead(video->info, entry->pos);
+    }
+}
+
+
+/* the keyframe a backward seek to the timestamp starts decoding from, when the stream has an index */
+static const AVIndexEntry *
+ngx_http_video_thumbextractor_keyframe_entry(AVStream *stream, int64_t timestamp)
+{
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 78, 100)
+    int index = av_index_search_timestamp(stream, timestamp, AVSEEK_FLAG_BACKWARD);
+
+    return (index >= 0) ? &stream->index_entries[index] : NULL;
+#else
+    return avformat_index_get_entry_from_timestamp(stream, timestamp, AVSEEK_FLAG_BACKWARD);
+#endif
+}
+
+
+/*
+ * decide, for each sample of a sprite, if it is reached by a seek or by decoding forward from the previous one;
+ * decoding forward gives the same frame when there is no keyframe between the two samples, and saves decoding again
+ * the frames from that keyframe up to the previous sample
+ */
+static u_char *
+ngx_http_video_thumbextractor_plan_samples(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, int64_t second, int64_t interval, ngx_uint_t nsamples, ngx_pool_t *temp_pool)
+{
+    AVStream            *stream = video->format_ctx->streams[video->stream];
+    const AVIndexEntry  *entry;
+    u_char              *plan;
+    int64_t              previous, timestamp;
+    ngx_uint_t           i;
+
+    // only the first frame after the keyframe is used, or the seek goes to the keyframe after the sample, always seek
+    if ((nsamples < 2) || cf->only_keyframe || cf->next_time) {
+        return NULL;
+    }
+
+    if ((plan = ngx_palloc(temp_pool, nsamples)) == NULL) {
+        return NULL;
+    }
+
+    plan[0] = NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_SEEK;
+    previous = second * stream->time_base.den / stream->time_base.num;
+
+    for (i = 1; i < nsamples; i++) {
+        second += interval;
+        timestamp = second * stream->time_base.den / stream->time_base.num;
+
+        // without an index the keyframes are not known, a seek is the safe choice
+        entry = ngx_http_video_thumbextractor_keyframe_entry(stream, timestamp);
+        plan[i] = ((entry != NULL) && (entry->timestamp <= previous)) ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_DECODE : NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_SEEK;
+
+        previous = timestamp;
     }
 
-    ssize_t r = ngx_read_file(&info->file, buf, buf_len, info->file.offset);
-    return (r == NGX_ERROR) ? AVERROR(ngx_errno) : r;
+    return plan;
 }
 
 
 static int
-ngx_http_video_thumbextractor_get_thumb(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, caddr_t *out_buffer, size_t *out_len, ngx_pool_t *temp_pool, ngx_log_t *log)
+ngx_http_video_thumbextractor_decode_sample(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, AVFrame *pFrame, int64_t second, ngx_log_t *log)
+{
+    AVFormatContext *pFormatCtx = video->format_ctx;
+    AVStream        *stream = pFormatCtx->streams[video->stream];
+    int64_t          timestamp = second * stream->time_base.den / stream->time_base.num;
+
+    if ((pFormatCtx->duration > 0) && ((((float_t) pFormatCtx->duration / AV_TIME_BASE) - second)) < 0.1) {
+        return NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
+    }
+
+    // the frame of the previous sample is already past this one, it is the same frame a seek would find
+    if ((pFrame->pts != AV_NOPTS_VALUE) && (pFrame->pts >= timestamp)) {
+        return NGX_OK;
+    }
+
+    return ngx_http_video_thumbextractor_decode_frame(cf, video->info, pFormatCtx, video->codec_ctx, pFrame, video->stream, timestamp, log);
+}
+
+
+static int
+ngx_http_video_thumbextractor_get_thumb(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_chain_t **out, size_t *out_len, ngx_pool_t *temp_pool, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_video_t video;
+    int                                   rc;
+
+    if ((rc = ngx_http_video_thumbextractor_open_video(cf, ctx, &video, log)) == NGX_OK) {
+        rc = ngx_http_video_thumbextractor_extract_frame(cf, &video, ctx, out, out_len, temp_pool, log);
+    }
+
+    if (ngx_http_video_thumbextractor_close_video(&video, log) != NGX_OK) {
+        rc = NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static int
+ngx_http_video_thumbextractor_open_video(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_http_video_thumbextractor_video_t *video, ngx_log_t *log)
 {
     ngx_http_video_thumbextractor_file_info_t *info = &ctx->file_info;
-    int              rc, ret, videoStream;
-    AVFormatContext *pFormatCtx = NULL;
-    AVCodecContext  *pCodecCtx = NULL;
+    int              ret;
 #if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(59, 16, 100)
     AVCodec         *pCodec = NULL;
 #else
     const AVCodec   *pCodec = NULL;
 #endif
-    AVFrame         *pFrame = NULL;
-    size_t           uncompressed_size;
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(59, 0, 100)
+    AVInputFormat   *input_format = NULL;
+#else
+    const AVInputFormat *input_format = NULL;
+#endif
     unsigned char   *bufferAVIO = NULL;
-    AVIOContext     *pAVIOCtx = NULL;
     char            *filename = (char *) ctx->filename.data;
     ngx_file_info_t  fi;
-    AVFilterContext *buffersink_ctx;
-    AVFilterContext *buffersrc_ctx;
-    AVFilterGraph   *filter_graph = NULL;
-    int              need_flush = 0;
-    int64_t          second = ctx->second;
-    char             value[10];
+
+    ngx_memzero(video, sizeof(ngx_http_video_thumbextractor_video_t));
+    video->info = info;
+    video->stream = -1;
 
     ngx_memzero(&info->file, sizeof(ngx_file_t));
     info->file.name = ctx->filename;
     info->file.log = log;
+    info->position = 0;
+    info->map = NULL;
+    info->readahead = cf->readahead;
+    info->hint_start = 0;
+    info->hint_end = 0;
+    info->remote_source = NULL;
+    ngx_memzero(&info->stats, sizeof(ngx_http_video_thumbextractor_io_stats_t));
+
+    ngx_http_video_thumbextractor_start_budget(&info->budget, cf);
+
+    if (info->remote) {
+        // read from the origin with range requests, the kernel has nothing to read ahead
+        info->file.fd = NGX_INVALID_FILE;
+        info->readahead = 0;
+
+        if ((ret = ngx_http_video_thumbextractor_remote_open(info, cf, &ctx->filename, log)) != NGX_OK) {
+            return ret;
+        }
+
+    } else if (info->fd != NGX_INVALID_FILE) {
+        // opened and checked by the worker, the descriptor is owned by this extraction from now on
+        info->file.fd = info->fd;
+        info->fd = NGX_INVALID_FILE;
+        info->size = info->file_size - info->offset;
+
+    } else {
+        // Open video file
+        info->file.fd = ngx_open_file(filename, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+        if (info->file.fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't open file \"%V\"", &ctx->filename);
+            return NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND;
+        }
+
+        if (ngx_fd_info(info->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to stat file \"%V\"", &ctx->filename);
+            return NGX_ERROR;
+        }
+
+        // Get file size
+        info->size = (size_t) ngx_file_size(&fi) - info->offset;
+        info->mtime = ngx_file_mtime(&fi);
+    }
+
+    // a file truncated while mapped raises SIGBUS, which would take the whole worker down with it
+    if ((cf->io_mode == NGX_HTTP_VIDEO_THUMBEXTRACTOR_IO_MMAP) && (info->size > 0) && !info->remote && !info->in_worker) {
+        ngx_http_video_thumbextractor_map_file(info, log);
+    }
+
+    // the headers and, for most files, the index are at the beginning
+    ngx_http_video_thumbextractor_readahead(info, 0);
+
+    // a video probed before, or with an index file, skips the probe of its format
+    if ((video->index = ngx_http_video_thumbextractor_index_lookup(&ctx->filename, info->size, info->mtime, log)) != NULL) {
+        video->cached = 1;
+    } else if (ctx->index_path.len > 0) {
+        video->index = ngx_http_video_thumbextractor_index_read_file(&ctx->index_path, info->size, info->mtime, log);
+    }
+
+    if (video->index != NULL) {
+        input_format = av_find_input_format((char *) video->index->format);
+    }
+
+    video->format_ctx = avformat_alloc_context();
+    bufferAVIO = (unsigned char *) av_malloc(cf->io_buffer_size);
+    if ((video->format_ctx == NULL) || (bufferAVIO == NULL)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't alloc AVIO buffer");
+        if (bufferAVIO != NULL) av_freep(&bufferAVIO);
+        return NGX_ERROR;
+    }
+
+    video->avio_ctx = avio_alloc_context(bufferAVIO, cf->io_buffer_size, 0, info, ngx_http_video_thumbextractor_read_data_from_file, NULL, ngx_http_video_thumbextractor_seek_data_from_file);
+    if (video->avio_ctx == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't alloc AVIO context");
+        av_freep(&bufferAVIO);
+        return NGX_ERROR;
+    }
+
+    video->format_ctx->pb = video->avio_ctx;
+
+    // the library defaults are kept when the location does not set them
+    if (cf->probesize > 0) {
+        video->format_ctx->probesize = cf->probesize;
+    }
+    if (cf->analyzeduration > 0) {
+        video->format_ctx->max_analyze_duration = (int64_t) cf->analyzeduration * 1000;
+    }
+    if (cf->fpsprobesize >= 0) {
+        video->format_ctx->fps_probe_size = cf->fpsprobesize;
+    }
+    video->format_ctx->interrupt_callback.callback = ngx_http_video_thumbextractor_interrupt_callback;
+    video->format_ctx->interrupt_callback.opaque = info;
+
+    // Open video file
+    if ((ret = avformat_open_input(&video->format_ctx, filename, input_format, NULL)) != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't open file %s, error: %d", filename, ret);
+        if (ngx_http_video_thumbextractor_budget_exceeded(info) != NGX_OK) {
+            return ngx_http_video_thumbextractor_budget_exceeded(info);
+        }
+        return (ret == AVERROR(NGX_ENOENT)) ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND : NGX_ERROR;
+    }
+
+    // the parameters learned before replace the decoding of the first frames, unless the video does not match them
+    if ((video->index != NULL) && (ngx_http_video_thumbextractor_index_restore(video->index, video->format_ctx) != NGX_OK)) {
+        ngx_free(video->index);
+        video->index = NULL;
+        video->cached = 0;
+    }
+
+    if ((video->index != NULL) && !video->cached) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "video thumb extractor module: using the index file \"%V\"", &ctx->index_path);
+    }
+
+    // Retrieve stream information
+    if ((video->index == NULL) && (ngx_http_video_thumbextractor_find_stream_info(cf, video) != NGX_OK)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't find stream information");
+        return (ngx_http_video_thumbextractor_budget_exceeded(info) != NGX_OK) ? ngx_http_video_thumbextractor_budget_exceeded(info) : NGX_ERROR;
+    }
+
+    info->stats.probe_bytes = info->stats.bytes;
+
+    // the blocks read so far have the headers and the index, only they go to the shared cache
+    if (info->remote_source != NULL) {
+        info->remote_source->probing = 0;
+    }
+
+    // Find the first video stream
+    video->stream = av_find_best_stream(video->format_ctx, AVMEDIA_TYPE_VIDEO, (video->index != NULL) ? video->index->stream : -1, -1, &pCodec, 0);
+    if (video->stream < 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Didn't find a video stream");
+        return NGX_ERROR;
+    }
+
+    video->rotate = ngx_http_video_thumbextractor_stream_rotation(video->format_ctx->streams[video->stream]);
+    if ((video->rotate == 0) && (video->index != NULL)) {
+        video->rotate = video->index->rotate;
+    }
+
+    video->codec = pCodec;
+    if (ngx_http_video_thumbextractor_open_codec(cf, video, ctx, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    video->keyframes = ngx_http_video_thumbextractor_index_keyframes(video->format_ctx->streams[video->stream]);
+    video->opened = 1;
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_video_thumbextractor_extract_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_chain_t **out, size_t *out_len, ngx_pool_t *temp_pool, ngx_log_t *log)
+{
+    AVFormatContext *pFormatCtx = video->format_ctx;
+    AVCodecContext  *pCodecCtx = video->codec_ctx;
+    int              rc = NGX_ERROR;
+    AVFrame         *pFrame = NULL;
+    size_t           uncompressed_size;
+
+    if ((pFormatCtx->duration > 0) && ((((float_t) pFormatCtx->duration / AV_TIME_BASE) - ctx->second)) < 0.1) {
+        ngx_log_error(NGX_LOG_WARN, log, 0, "video thumb extractor module: seconds greater than duration");
+        return NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
+    }
+
+    // a frame of the batch bigger than the first ones needs a less reduced decode
+    if ((cf->decode_quality == NGX_HTTP_VIDEO_THUMBEXTRACTOR_DECODE_FAST) && (ngx_http_video_thumbextractor_lowres(video, ctx) < video->lowres)) {
+        if (ngx_http_video_thumbextractor_open_codec(cf, video, ctx, log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        pCodecCtx = video->codec_ctx;
+    }
+
+    // discard frames left by a previous extraction on the same video
+    avcodec_flush_buffers(pCodecCtx);
+
+    // each frame of a batch has its own budget
+    ngx_http_video_thumbextractor_start_budget(&video->info->budget, cf);
+
+    setup_parameters(cf, ctx, pFormatCtx, pCodecCtx);
+
+    // Allocate video frame
+    pFrame = av_frame_alloc();
+
+    if (pFrame == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not alloc frame memory");
+        goto exit;
+    }
+
+#if (NGX_THREADS)
+    if ((cf->tile_decoders > 1) && (ctx->tile_rows * ctx->tile_cols > 1)) {
+        rc = ngx_http_video_thumbextractor_extract_ranges(cf, video, ctx, pFrame, temp_pool, log);
+    } else
+#endif
+    rc = ngx_http_video_thumbextractor_extract_samples(cf, video, ctx, pFrame, temp_pool, log);
+
+    if (rc == NGX_OK) {
+        // Convert the image from its native format to JPEG
+        uncompressed_size = pFrame->width * pFrame->height * 3;
+        if (ngx_http_video_thumbextractor_jpeg_compress(cf, ctx, pFrame->data[0], pFrame->linesize[0], pFrame->width, pFrame->height, out, out_len, uncompressed_size, temp_pool) == 0) {
+            rc = NGX_OK;
+        } else {
+            rc = NGX_ERROR;
+        }
+    }
+
+exit:
+
+    // Free the YUV frame
+    if (pFrame != NULL) av_frame_free(&pFrame);
+
+    // a seek or read interrupted by the budget looks like any other failure to the libraries
+    if ((rc != NGX_OK) && (ngx_http_video_thumbextractor_budget_exceeded(video->info) != NGX_OK)) {
+        rc = ngx_http_video_thumbextractor_budget_exceeded(video->info);
+    }
+
+    return rc;
+}
+
+
+/* decode the samples one after the other, each one is written on the image as soon as it is scaled */
+static int
+ngx_http_video_thumbextractor_extract_samples(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFrame *pFrame, ngx_pool_t *temp_pool, ngx_log_t *log)
+{
+    AVFormatContext *pFormatCtx = video->format_ctx;
+    AVCodecContext  *pCodecCtx = video->codec_ctx;
+    int              rc = NGX_ERROR;
+    AVFrame         *decoded = NULL;
+    int64_t          second = ctx->second;
+    u_char          *plan;
+    ngx_uint_t       sample, nsamples = ctx->tile_rows * ctx->tile_cols;
+    ngx_http_video_thumbextractor_sprite_t sprite;
+    ngx_http_video_thumbextractor_scaler_t scaler;
+
+    if (ngx_http_video_thumbextractor_scaler_init(cf, ctx, video, &scaler, log) != NGX_OK) {
+        goto exit;
+    }
+
+    // a single frame of a rotated video is written by the filter graph straight to the frame of the image
+    if (ngx_http_video_thumbextractor_sprite_init(&sprite, ctx, pFrame, scaler.filter_graph != NULL, log) != NGX_OK) {
+        goto exit;
+    }
+
+    if ((decoded = av_frame_alloc()) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not alloc frame memory");
+        goto exit;
+    }
+
+    plan = ngx_http_video_thumbextractor_plan_samples(cf, video, second, ctx->tile_sample_interval, nsamples, temp_pool);
+
+    // the next sample of a sprite is read by the kernel while the current one is decoded
+    if ((nsamples > 1) && ((plan == NULL) || (plan[1] == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_SEEK))) {
+        ngx_http_video_thumbextractor_prefetch_second(video, second + ctx->tile_sample_interval);
+    }
+
+    for (sample = 0; sample < nsamples; sample++, second += ctx->tile_sample_interval) {
+        if ((plan != NULL) && (plan[sample] == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_DECODE)) {
+            rc = ngx_http_video_thumbextractor_decode_sample(cf, video, decoded, second, log);
+        } else {
+            rc = get_frame(cf, video->info, pFormatCtx, pCodecCtx, decoded, video->stream, second, log);
+        }
+
+        if ((rc == NGX_OK) && (decoded->pict_type == AV_PICTURE_TYPE_NONE)) {
+            rc = NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
+        }
+
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        if ((sample + 2 < nsamples) && ((plan == NULL) || (plan[sample + 2] == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_SEEK))) {
+            ngx_http_video_thumbextractor_prefetch_second(video, second + 2 * ctx->tile_sample_interval);
+        }
+
+        // the decoded frame is kept to be reused by the next sample, when it is past that one too
+        if (ngx_http_video_thumbextractor_scaler_draw(&scaler, &sprite, sample, decoded, log) != NGX_OK) {
+            rc = NGX_ERROR;
+            goto exit;
+        }
+    }
+
+    // the samples past the end of the video are left with the background
+    if ((sample > 0) && ((rc == NGX_OK) || (rc == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND))) {
+        ngx_http_video_thumbextractor_sprite_finish(&sprite, sample);
+        rc = NGX_OK;
+    }
+
+exit:
+
+    if (decoded != NULL) av_frame_free(&decoded);
+
+    ngx_http_video_thumbextractor_scaler_free(&scaler);
+
+    return rc;
+}
+
+
+/* the image with the background already filled, unless it is a single frame without margin written by the filter graph */
+static ngx_int_t
+ngx_http_video_thumbextractor_sprite_init(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFrame *frame, ngx_flag_t direct_allowed, ngx_log_t *log)
+{
+    ngx_int_t  row, col;
+    int        x, y, right;
+
+    sprite->frame = frame;
+    sprite->cols = ctx->tile_cols;
+    sprite->rows = ctx->tile_rows;
+    sprite->tile_width = ctx->width;
+    sprite->tile_height = ctx->height;
+    sprite->margin = ctx->tile_margin;
+    sprite->padding = ctx->tile_padding;
+
+    if (av_parse_color(sprite->color, (char *) ctx->tile_color.data, ctx->tile_color.len, NULL) < 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: invalid tile color \"%V\"", &ctx->tile_color);
+        return NGX_ERROR;
+    }
+
+    // the scaled frame is the image itself
+    sprite->direct = direct_allowed && (sprite->cols * sprite->rows == 1) && (sprite->margin == 0);
+    if (sprite->direct) {
+        return NGX_OK;
+    }
+
+    frame->format = AV_PIX_FMT_RGB24;
+    frame->width = sprite->margin * 2 + sprite->cols * sprite->tile_width + (sprite->cols - 1) * sprite->padding;
+    frame->height = sprite->margin * 2 + sprite->rows * sprite->tile_height + (sprite->rows - 1) * sprite->padding;
+
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to allocate an image of %d x %d", frame->width, frame->height);
+        return NGX_ERROR;
+    }
+
+    // only the margin and the padding, the frames cover everything else
+    right = sprite->margin + sprite->cols * sprite->tile_width + (sprite->cols - 1) * sprite->padding;
+    ngx_http_video_thumbextractor_sprite_fill(sprite, 0, 0, frame->width, sprite->margin);
+
+    for (row = 0; row < sprite->rows; row++) {
+        y = sprite->margin + row * (sprite->tile_height + sprite->padding);
+        if (row > 0) {
+            ngx_http_video_thumbextractor_sprite_fill(sprite, 0, y - sprite->padding, frame->width, sprite->padding);
+        }
+
+        ngx_http_video_thumbextractor_sprite_fill(sprite, 0, y, sprite->margin, sprite->tile_height);
+        for (col = 1; col < sprite->cols; col++) {
+            x = sprite->margin + col * (sprite->tile_width + sprite->padding);
+            ngx_http_video_thumbextractor_sprite_fill(sprite, x - sprite->padding, y, sprite->padding, sprite->tile_height);
+        }
+        ngx_http_video_thumbextractor_sprite_fill(sprite, right, y, frame->width - right, sprite->tile_height);
+    }
+
+    ngx_http_video_thumbextractor_sprite_fill(sprite, 0, frame->height - sprite->margin, frame->width, sprite->margin);
+
+    return NGX_OK;
+}
+
+
+/* the top left pixel of the place of a sample */
+static uint8_t *
+ngx_http_video_thumbextractor_sprite_tile(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t sample)
+{
+    return sprite->frame->data[0] + (sprite->margin + (sample / sprite->cols) * (sprite->tile_height + sprite->padding)) * sprite->frame->linesize[0]
+                                  + (sprite->margin + (sample % sprite->cols) * (sprite->tile_width + sprite->padding)) * 3;
+}
+
+
+/* copy the scaled frame to its place, the frames of different samples never overlap */
+static void
+ngx_http_video_thumbextractor_sprite_draw(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t sample, AVFrame *tile)
+{
+    AVFrame   *frame = sprite->frame;
+    uint8_t   *dst, *src;
+    int        i, width, height;
+
+    if (sprite->direct) {
+        // the output of the graph is already on the frame of the image
+        return;
+    }
+
+    dst = ngx_http_video_thumbextractor_sprite_tile(sprite, sample);
+    src = tile->data[0];
+    width = ngx_min(tile->width, sprite->tile_width) * 3;
+    height = ngx_min(tile->height, sprite->tile_height);
+
+    for (i = 0; i < height; i++, dst += frame->linesize[0], src += tile->linesize[0]) {
+        ngx_memcpy(dst, src, width);
+    }
+
+    av_frame_unref(tile);
+}
+
+
+/* fill the places of the samples not found with the background */
+static void
+ngx_http_video_thumbextractor_sprite_finish(ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t nsamples)
+{
+    ngx_uint_t  sample;
+
+    if (sprite->direct) {
+        return;
+    }
+
+    for (sample = nsamples; sample < (ngx_uint_t) (sprite->cols * sprite->rows); sample++) {
+        ngx_http_video_thumbextractor_sprite_fill(sprite, sprite->margin + (sample % sprite->cols) * (sprite->tile_width + sprite->padding), sprite->margin + (sample / sprite->cols) * (sprite->tile_height + sprite->padding), sprite->tile_width, sprite->tile_height);
+    }
+}
+
+
+static void
+ngx_http_video_thumbextractor_sprite_fill(ngx_http_video_thumbextractor_sprite_t *sprite, int x, int y, int width, int height)
+{
+    AVFrame   *frame = sprite->frame;
+    uint8_t   *row, *p;
+    int        i;
+
+    if ((width <= 0) || (height <= 0)) {
+        return;
+    }
+
+    row = frame->data[0] + y * frame->linesize[0] + x * 3;
+
+    // gray backgrounds, like the default black, are a plain memset of each row
+    if ((sprite->color[0] == sprite->color[1]) && (sprite->color[1] == sprite->color[2])) {
+        for (i = 0; i < height; i++, row += frame->linesize[0]) {
+            ngx_memset(row, sprite->color[0], width * 3);
+        }
+        return;
+    }
+
+    for (p = row, i = 0; i < width; i++) {
+        *p++ = sprite->color[0];
+        *p++ = sprite->color[1];
+        *p++ = sprite->color[2];
+    }
+
+    for (i = 1, p = row + frame->linesize[0]; i < height; i++, p += frame->linesize[0]) {
+        ngx_memcpy(p, row, width * 3);
+    }
+}
+
+
+/* the filter graph is only needed to rotate the frames, or for formats swscale can not read straight from the decoder */
+static ngx_int_t
+ngx_http_video_thumbextractor_scaler_init(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_scaler_t *scaler, ngx_log_t *log)
+{
+    ngx_memzero(scaler, sizeof(ngx_http_video_thumbextractor_scaler_t));
+
+    scaler->flags = ngx_http_video_thumbextractor_scaler_flags[cf->scaler];
+
+    if ((video->rotate == 0) && ngx_http_video_thumbextractor_scaler_supported(video->codec_ctx->pix_fmt)) {
+        if (setup_size(ctx, video->codec_ctx, video->rotate, log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        // the swscale context is created with the first decoded frame, which has the format and color details
+        ngx_http_video_thumbextractor_scale_size(ctx, video->codec_ctx, video->rotate, &scaler->scale_width, &scaler->scale_height);
+        return NGX_OK;
+    }
+
+    if (setup_filters(ctx, video->format_ctx, video->codec_ctx, video->stream, video->rotate, cf->scaler, &scaler->filter_graph, &scaler->buffersrc_ctx, &scaler->buffersink_ctx, log) < 0) {
+        return NGX_ERROR;
+    }
+
+    if ((scaler->scaled = av_frame_alloc()) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not alloc frame memory");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_flag_t
+ngx_http_video_thumbextractor_scaler_supported(enum AVPixelFormat format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+
+    return (desc != NULL) && !(desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)) && (sws_isSupportedInput(format) > 0);
+}
+
+
+/* scale only the area of the decoded frame kept by the crop, the same one the filter graph would keep */
+static ngx_int_t
+ngx_http_video_thumbextractor_scaler_context(ngx_http_video_thumbextractor_scaler_t *scaler, ngx_http_video_thumbextractor_sprite_t *sprite, AVFrame *frame, ngx_log_t *log)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int         crop_x, crop_y, src_range, dst_range, brightness, contrast, saturation;
+    int        *inv_table, *table;
+
+    if (scaler->sws_ctx != NULL) {
+        sws_freeContext(scaler->sws_ctx);
+        scaler->sws_ctx = NULL;
+    }
+
+    if (!ngx_http_video_thumbextractor_scaler_supported(frame->format)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unsupported pixel format %d on the decoded frame", frame->format);
+        return NGX_ERROR;
+    }
+
+    crop_x = (float) (scaler->scale_width - sprite->tile_width) / 2 + 0.5;
+    crop_y = (float) (scaler->scale_height - sprite->tile_height) / 2 + 0.5;
+
+    // the origin is aligned to the chroma samples, to point to the same pixel on every plane
+    scaler->src_x = ((int64_t) crop_x * frame->width / scaler->scale_width) & ~((1 << desc->log2_chroma_w) - 1);
+    scaler->src_y = ((int64_t) crop_y * frame->height / scaler->scale_height) & ~((1 << desc->log2_chroma_h) - 1);
+    scaler->src_width = ngx_min((int) (((int64_t) sprite->tile_width * frame->width + scaler->scale_width / 2) / scaler->scale_width), frame->width - scaler->src_x);
+    scaler->src_height = ngx_min((int) (((int64_t) sprite->tile_height * frame->height + scaler->scale_height / 2) / scaler->scale_height), frame->height - scaler->src_y);
+
+    if ((scaler->src_width <= 0) || (scaler->src_height <= 0)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: invalid area to scale on a frame of %d x %d", frame->width, frame->height);
+        return NGX_ERROR;
+    }
+
+    scaler->sws_ctx = sws_getContext(scaler->src_width, scaler->src_height, frame->format, sprite->tile_width, sprite->tile_height, AV_PIX_FMT_RGB24, scaler->flags, NULL, NULL, NULL);
+    if (scaler->sws_ctx == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to create the scale context");
+        return NGX_ERROR;
+    }
+
+    // as the scale filter does, the matrix and the range come from the frame
+    if (!(desc->flags & AV_PIX_FMT_FLAG_RGB) && (sws_getColorspaceDetails(scaler->sws_ctx, &inv_table, &src_range, &table, &dst_range, &brightness, &contrast, &saturation) >= 0)) {
+        sws_setColorspaceDetails(scaler->sws_ctx, sws_getCoefficients(frame->colorspace), src_range || (frame->color_range == AVCOL_RANGE_JPEG), table, dst_range, brightness, contrast, saturation);
+    }
+
+    scaler->width = frame->width;
+    scaler->height = frame->height;
+    scaler->format = frame->format;
+
+    return NGX_OK;
+}
+
+
+/* scale a decoded frame and write it on its place of the image */
+static ngx_int_t
+ngx_http_video_thumbextractor_scaler_draw(ngx_http_video_thumbextractor_scaler_t *scaler, ngx_http_video_thumbextractor_sprite_t *sprite, ngx_uint_t sample, AVFrame *frame, ngx_log_t *log)
+{
+    const AVPixFmtDescriptor *desc;
+    const uint8_t *src[4];
+    uint8_t       *dst[4];
+    int            src_stride[4], dst_stride[4];
+    int            plane, c, step, chroma, x, y;
+
+    if (scaler->filter_graph != NULL) {
+        if (filter_frame(scaler->buffersrc_ctx, scaler->buffersink_ctx, frame, sprite->direct ? sprite->frame : scaler->scaled, log) < 0) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_video_thumbextractor_sprite_draw(sprite, sample, scaler->scaled);
+        return NGX_OK;
+    }
+
+    if ((scaler->sws_ctx == NULL) || (frame->width != scaler->width) || (frame->height != scaler->height) || (frame->format != scaler->format)) {
+        if (ngx_http_video_thumbextractor_scaler_context(scaler, sprite, frame, log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    desc = av_pix_fmt_desc_get(frame->format);
+
+    for (plane = 0; plane < 4; plane++) {
+        src[plane] = NULL;
+        src_stride[plane] = frame->linesize[plane];
+        dst[plane] = NULL;
+        dst_stride[plane] = 0;
+
+        if (frame->data[plane] == NULL) {
+            continue;
+        }
+
+        // a plane without luma or alpha has the chroma subsampling
+        step = 0;
+        chroma = !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        for (c = 0; c < desc->nb_components; c++) {
+            if (desc->comp[c].plane == plane) {
+                step = (step == 0) ? desc->comp[c].step : step;
+                chroma = chroma && (c == 1 || c == 2);
+            }
+        }
+
+        x = chroma ? scaler->src_x >> desc->log2_chroma_w : scaler->src_x;
+        y = chroma ? scaler->src_y >> desc->log2_chroma_h : scaler->src_y;
+        src[plane] = frame->data[plane] + y * frame->linesize[plane] + x * step;
+    }
+
+    dst[0] = ngx_http_video_thumbextractor_sprite_tile(sprite, sample);
+    dst_stride[0] = sprite->frame->linesize[0];
+
+    if (sws_scale(scaler->sws_ctx, src, src_stride, 0, scaler->src_height, dst, dst_stride) <= 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: error scaling the frame");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_video_thumbextractor_scaler_free(ngx_http_video_thumbextractor_scaler_t *scaler)
+{
+    if (scaler->filter_graph != NULL) avfilter_graph_free(&scaler->filter_graph);
+
+    if (scaler->scaled != NULL) av_frame_free(&scaler->scaled);
+
+    if (scaler->sws_ctx != NULL) {
+        sws_freeContext(scaler->sws_ctx);
+        scaler->sws_ctx = NULL;
+    }
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * split the samples of a sprite in contiguous ranges, each one decoded and scaled by its own decoder on a thread,
+ * the first range uses the video already opened; each decoder writes its frames straight on their places of the image
+ */
+static int
+ngx_http_video_thumbextractor_extract_ranges(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_video_t *video, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFrame *pFrame, ngx_pool_t *temp_pool, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_range_t *ranges, *range;
+    ngx_http_video_thumbextractor_file_info_t *info;
+    ngx_http_video_thumbextractor_sprite_t sprite;
+    ngx_uint_t       i, nranges, nsamples = ctx->tile_rows * ctx->tile_cols;
+    ngx_flag_t       per_thread;
+    ngx_err_t        err;
+    int              rc;
+
+    // the size of the frames is needed before any of them is decoded, to place them on the image
+    if ((setup_size(ctx, video->codec_ctx, video->rotate, log) != NGX_OK) || (ngx_http_video_thumbextractor_sprite_init(&sprite, ctx, pFrame, 0, log) != NGX_OK)) {
+        return NGX_ERROR;
+    }
+
+    nranges = ngx_min(cf->tile_decoders, nsamples);
+
+    if ((ranges = ngx_pcalloc(temp_pool, nranges * sizeof(ngx_http_video_thumbextractor_range_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to allocate the ranges of the sprite");
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < nranges; i++) {
+        range = &ranges[i];
+        range->cf = cf;
+        range->ctx = *ctx;
+        range->video = (i == 0) ? video : NULL;
+        range->sprite = &sprite;
+        range->first = nsamples * i / nranges;
+        range->nsamples = (nsamples * (i + 1) / nranges) - range->first;
+        range->log = log;
+        range->rc = NGX_ERROR;
+        range->ctx.second = ctx->second + range->first * ctx->tile_sample_interval;
+
+        if (i == 0) {
+            continue;
+        }
+
+        if ((range->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log)) == NULL) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to allocate pool to decode a range of the sprite");
+            continue;
+        }
+
+        info = &range->ctx.file_info;
+        info->budget.per_thread = 1;
+        info->budget.shared = &video->info->budget;
+
+        // each decoder reads the video through its own descriptor, or its own requests to the origin
+        if (!info->remote) {
+            info->offset = video->info->offset;
+            info->file_size = video->info->offset + video->info->size;
+            if ((info->fd = dup(video->info->file.fd)) == NGX_INVALID_FILE) {
+                ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "video thumb extractor module: unable to duplicate the descriptor of \"%V\", opening it again", &ctx->filename);
+            }
+        }
+
+        if ((err = pthread_create(&range->thread, NULL, ngx_http_video_thumbextractor_range_thread, range)) != 0) {
+            ngx_log_error(NGX_LOG_WARN, log, err, "video thumb extractor module: unable to start a decoder thread, decoding its range on the current one");
+            continue;
+        }
+
+        range->started = 1;
+    }
+
+    // the time of the process would count the other decoders on the first one
+    per_thread = video->info->budget.per_thread;
+    ngx_http_video_thumbextractor_budget_clock(&video->info->budget, 1);
+
+    ranges[0].pool = temp_pool;
+    ngx_http_video_thumbextractor_decode_range(&ranges[0]);
+
+    for (i = 1; i < nranges; i++) {
+        range = &ranges[i];
+        if (range->started) {
+            pthread_join(range->thread, NULL);
+        } else if (range->pool != NULL) {
+            ngx_http_video_thumbextractor_decode_range(range);
+        }
+    }
+
+    ngx_http_video_thumbextractor_budget_clock(&video->info->budget, per_thread);
+
+    // a failed range is an error, a range past the end of the video only makes the sprite shorter
+    rc = NGX_OK;
+    for (i = 0; i < nranges; i++) {
+        range = &ranges[i];
+        if ((rc == NGX_OK) && (range->rc != NGX_OK) && (range->rc != NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND)) {
+            rc = range->rc;
+        }
+        if ((i > 0) && (range->pool != NULL)) {
+            ngx_destroy_pool(range->pool);
+        }
+    }
 
-    rc = NGX_ERROR;
+    // as with a single decoder, the samples after the first missing one are not used
+    for (i = 0; (i < nranges) && (ranges[i].found == ranges[i].nsamples); i++) { /* void */ }
+    nsamples = (i < nranges) ? ranges[i].first + ranges[i].found : nsamples;
 
-    // Open video file
-    info->file.fd = ngx_open_file(filename, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
-    if (info->file.fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't open file \"%V\"", &ctx->filename);
-        rc = NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND;
-        goto exit;
+    if ((rc == NGX_OK) && (nsamples == 0)) {
+        rc = ranges[0].rc;
     }
 
-    if (ngx_fd_info(info->file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to stat file \"%V\"", &ctx->filename);
-        goto exit;
+    if (rc == NGX_OK) {
+        ngx_http_video_thumbextractor_sprite_finish(&sprite, nsamples);
     }
 
-    // Get file size
-    info->size = (size_t) ngx_file_size(&fi) - info->offset;
+    return rc;
+}
 
-    pFormatCtx = avformat_alloc_context();
-    bufferAVIO = (unsigned char *) av_malloc(NGX_HTTP_VIDEO_THUMBEXTRACTOR_BUFFER_SIZE);
-    if ((pFormatCtx == NULL) || (bufferAVIO == NULL)) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't alloc AVIO buffer");
-        goto exit;
-    }
 
-    pAVIOCtx = avio_alloc_context(bufferAVIO, NGX_HTTP_VIDEO_THUMBEXTRACTOR_BUFFER_SIZE, 0, info, ngx_http_video_thumbextractor_read_data_from_file, NULL, ngx_http_video_thumbextractor_seek_data_from_file);
-    if (pAVIOCtx == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't alloc AVIO context");
-        goto exit;
-    }
+static void *
+ngx_http_video_thumbextractor_range_thread(void *data)
+{
+    ngx_http_video_thumbextractor_decode_range(data);
 
-    pFormatCtx->pb = pAVIOCtx;
+    return NULL;
+}
 
-    // Open video file
-    if ((ret = avformat_open_input(&pFormatCtx, filename, NULL, NULL)) != 0) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't open file %s, error: %d", filename, ret);
-        rc = (ret == AVERROR(NGX_ENOENT)) ? NGX_HTTP_VIDEO_THUMBEXTRACTOR_FILE_NOT_FOUND : NGX_ERROR;
-        goto exit;
-    }
 
-    // Retrieve stream information
-    if (avformat_find_stream_info(pFormatCtx, NULL) < 0) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't find stream information");
-        goto exit;
+/* decode and scale the samples of a range, writing each one on the image */
+static void
+ngx_http_video_thumbextractor_decode_range(ngx_http_video_thumbextractor_range_t *range)
+{
+    ngx_http_video_thumbextractor_loc_conf_t  *cf = range->cf;
+    ngx_http_video_thumbextractor_thumb_ctx_t *ctx = &range->ctx;
+    ngx_http_video_thumbextractor_video_t      own, *video = range->video;
+    ngx_http_video_thumbextractor_scaler_t     scaler;
+    AVFrame         *pFrame = NULL;
+    int64_t          second = ctx->second;
+    u_char          *plan;
+    ngx_uint_t       i;
+    int              rc = NGX_ERROR;
+
+    ngx_memzero(&scaler, sizeof(ngx_http_video_thumbextractor_scaler_t));
+
+    if (video == NULL) {
+        video = &own;
+        if ((rc = ngx_http_video_thumbextractor_open_video(cf, ctx, video, range->log)) != NGX_OK) {
+            goto exit;
+        }
+
+        // only the decoder of the first range keeps what was learned on the index cache
+        video->opened = 0;
+        rc = NGX_ERROR;
     }
 
-    if ((pFormatCtx->duration > 0) && ((((float_t) pFormatCtx->duration / AV_TIME_BASE) - second)) < 0.1) {
-        ngx_log_error(NGX_LOG_WARN, log, 0, "video thumb extractor module: seconds greater than duration");
-        rc = NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
+    if (ngx_http_video_thumbextractor_scaler_init(cf, ctx, video, &scaler, range->log) != NGX_OK) {
         goto exit;
     }
 
-    // Find the first video stream
-    videoStream = av_find_best_stream(pFormatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, &pCodec, 0);
-    if (videoStream == -1) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Didn't find a video stream");
+    if ((pFrame = av_frame_alloc()) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, range->log, 0, "video thumb extractor module: Could not alloc frame memory");
         goto exit;
     }
 
-    // Get a pointer to the codec context for the video stream
-    pCodecCtx = avcodec_alloc_context3(pCodec);
-    avcodec_parameters_to_context(pCodecCtx, pFormatCtx->streams[videoStream]->codecpar);
+    plan = ngx_http_video_thumbextractor_plan_samples(cf, video, second, ctx->tile_sample_interval, range->nsamples, range->pool);
 
-    AVDictionary *dict = NULL;
-    ngx_sprintf((u_char *) value, "%V%Z", &cf->threads);
-    av_dict_set(&dict, "threads", value, 0);
+    for (i = 0; i < range->nsamples; i++, second += ctx->tile_sample_interval) {
+        if ((plan != NULL) && (plan[i] == NGX_HTTP_VIDEO_THUMBEXTRACTOR_SAMPLE_DECODE)) {
+            rc = ngx_http_video_thumbextractor_decode_sample(cf, video, pFrame, second, range->log);
+        } else {
+            rc = get_frame(cf, video->info, video->format_ctx, video->codec_ctx, pFrame, video->stream, second, range->log);
+        }
 
-    // Open codec
-    if ((avcodec_open2(pCodecCtx, pCodec, &dict)) < 0) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not open codec");
-        goto exit;
-    }
+        if ((rc == NGX_OK) && (pFrame->pict_type == AV_PICTURE_TYPE_NONE)) {
+            rc = NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
+        }
 
-    setup_parameters(cf, ctx, pFormatCtx, pCodecCtx);
+        if (rc != NGX_OK) {
+            break;
+        }
 
-    if (setup_filters(ctx, pFormatCtx, pCodecCtx, videoStream, &filter_graph, &buffersrc_ctx, &buffersink_ctx, log) < 0) {
-        goto exit;
+        if (ngx_http_video_thumbextractor_scaler_draw(&scaler, range->sprite, range->first + i, pFrame, range->log) != NGX_OK) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        range->found++;
     }
 
-    // Allocate video frame
-    pFrame = av_frame_alloc();
+exit:
 
-    if (pFrame == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Could not alloc frame memory");
-        goto exit;
+    if (pFrame != NULL) av_frame_free(&pFrame);
+
+    ngx_http_video_thumbextractor_scaler_free(&scaler);
+
+    if ((rc != NGX_OK) && (ngx_http_video_thumbextractor_budget_exceeded(video->info) != NGX_OK)) {
+        rc = ngx_http_video_thumbextractor_budget_exceeded(video->info);
     }
 
-    while ((rc = get_frame(cf, pFormatCtx, pCodecCtx, pFrame, videoStream, second, log)) == 0) {
-        if (pFrame->pict_type == AV_PICTURE_TYPE_NONE) {
-            need_flush = 1;
-            break;
+    if (video == &own) {
+        if (ngx_http_video_thumbextractor_close_video(video, range->log) != NGX_OK) {
+            rc = NGX_ERROR;
         }
+    }
 
-        if (filter_frame(buffersrc_ctx, buffersink_ctx, pFrame, pFrame, log) == AVERROR(EAGAIN)) {
-            second += ctx->tile_sample_interval;
-            need_flush = 1;
-            continue;
-        }
+    range->rc = rc;
+}
 
-        need_flush = 0;
-        break;
-    }
+#endif
 
-    if (need_flush) {
-        if (filter_frame(buffersrc_ctx, buffersink_ctx, NULL, pFrame, log) < 0) {
-            goto exit;
-        }
 
-        rc = NGX_OK;
+static int
+ngx_http_video_thumbextractor_close_video(ngx_http_video_thumbextractor_video_t *video, ngx_log_t *log)
+{
+    ngx_http_video_thumbextractor_file_info_t *info = video->info;
+    int                                        rc = NGX_OK;
+
+    if (info->stats.reads > 0) {
+        ngx_log_error(NGX_LOG_INFO, log, 0, "video thumb extractor module: read %O bytes of \"%V\" in %ui reads, waited %uL us, slowest read %uL us, %ui readahead hints, %O bytes to probe in %ui rounds", info->stats.bytes, &info->file.name, info->stats.reads, info->stats.usec, info->stats.max_usec, info->stats.hints, info->stats.probe_bytes, info->stats.probe_rounds);
     }
 
+    if (info->map != NULL) {
+        munmap(info->map, info->offset + info->size);
+        info->map = NULL;
+    }
 
-    if (rc == NGX_OK) {
-        // Convert the image from its native format to JPEG
-        uncompressed_size = pFrame->width * pFrame->height * 3;
-        if (ngx_http_video_thumbextractor_jpeg_compress(cf, pFrame->data[0], pFrame->linesize[0], pFrame->width, pFrame->height, out_buffer, out_len, uncompressed_size, temp_pool) == 0) {
-            rc = NGX_OK;
-        }
+    if (info->remote_source != NULL) {
+        ngx_http_video_thumbextractor_remote_close(info->remote_source);
+        info->remote_source = NULL;
     }
 
-exit:
+    // what was probed, and the keyframes found by the seeks, are kept for the next extractions of the same video
+    if (video->opened && (!video->cached || (ngx_http_video_thumbextractor_index_keyframes(video->format_ctx->streams[video->stream]) > video->keyframes))) {
+        ngx_http_video_thumbextractor_index_store(&info->file.name, info->size, info->mtime, video->format_ctx, video->stream, video->rotate);
+    }
+
+    if (video->index != NULL) {
+        ngx_free(video->index);
+        video->index = NULL;
+    }
 
     if ((info->file.fd != NGX_INVALID_FILE) && (ngx_close_file(info->file.fd) == NGX_FILE_ERROR)) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't close file %s", filename);
+        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: Couldn't close file %V", &info->file.name);
         rc = NGX_ERROR;
     }
 
     /* destroy unneeded objects */
 
-    // Free the YUV frame
-    if (pFrame != NULL) av_frame_free(&pFrame);
-
     // Close the codec
-    if (pCodecCtx != NULL) {
-        avcodec_close(pCodecCtx);
-        avcodec_free_context(&pCodecCtx);
+    if (video->codec_ctx != NULL) {
+        avcodec_close(video->codec_ctx);
+        avcodec_free_context(&video->codec_ctx);
     }
 
     // Close the video file
-    if (pFormatCtx != NULL) avformat_close_input(&pFormatCtx);
+    if (video->format_ctx != NULL) avformat_close_input(&video->format_ctx);
 
     // Free AVIO context
-    if (pAVIOCtx != NULL) {
-        if (pAVIOCtx->buffer != NULL) av_freep(&pAVIOCtx->buffer);
-        av_freep(&pAVIOCtx);
+    if (video->avio_ctx != NULL) {
+        if (video->avio_ctx->buffer != NULL) av_freep(&video->avio_ctx->buffer);
+        av_freep(&video->avio_ctx);
     }
 
-    if (filter_graph != NULL) avfilter_graph_free(&filter_graph);
-
     return rc;
 }
 
@@ -274,17 +1625,31 @@ ngx_http_video_thumbextractor_init_libraries(void)
 
 
 static uint32_t
-ngx_http_video_thumbextractor_jpeg_compress(ngx_http_video_thumbextractor_loc_conf_t *cf, uint8_t * buffer, int linesize, int out_width, int out_height, caddr_t *out_buffer, size_t *out_len, size_t uncompressed_size, ngx_pool_t *temp_pool)
+ngx_http_video_thumbextractor_jpeg_compress(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, uint8_t * buffer, int linesize, int out_width, int out_height, ngx_chain_t **out, size_t *out_len, size_t uncompressed_size, ngx_pool_t *temp_pool)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     JSAMPROW row_pointer[1];
+    uint32_t failed;
+    ngx_int_t rc;
 
     if ( !buffer ) return 1;
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
-    ngx_http_video_thumbextractor_jpeg_memory_dest(&cinfo, out_buffer, out_len, uncompressed_size, temp_pool);
+
+    if (ctx->output != NULL) {
+        // the blocks are handed over as soon as they are filled, nothing is kept on out
+        *out = NULL;
+        rc = ngx_http_video_thumbextractor_jpeg_stream_dest(&cinfo, ctx, out_len, cf->stream_buffer_size, temp_pool);
+    } else {
+        rc = ngx_http_video_thumbextractor_jpeg_memory_dest(&cinfo, out, out_len, uncompressed_size, temp_pool);
+    }
+
+    if (rc != NGX_OK) {
+        jpeg_destroy_compress(&cinfo);
+        return 1;
+    }
 
     cinfo.image_width = out_width;
     cinfo.image_height = out_height;
@@ -317,46 +1682,75 @@ ngx_http_video_thumbextractor_jpeg_compress(ngx_http_video_thumbextractor_loc_co
     }
 
     jpeg_finish_compress(&cinfo);
+
+    if (ctx->output != NULL) {
+        failed = ((ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *) cinfo.dest)->failed;
+    } else {
+        failed = ((ngx_http_video_thumbextractor_jpeg_destination_mgr *) cinfo.dest)->failed;
+    }
+
     jpeg_destroy_compress(&cinfo);
 
-    return 0;
+    return failed;
 }
 
 
-typedef struct {
-    struct jpeg_destination_mgr  pub; /* public fields */
+static ngx_int_t ngx_http_video_thumbextractor_add_output_block (ngx_http_video_thumbextractor_jpeg_destination_mgr *dest)
+{
+    ngx_chain_t                                        *cl;
 
-    unsigned char              **buf;
-    size_t                      *size;
-    size_t                       uncompressed_size;
-    ngx_pool_t                  *pool;
-} ngx_http_video_thumbextractor_jpeg_destination_mgr;
+    if ((cl = ngx_alloc_chain_link(dest->pool)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if ((cl->buf = ngx_create_temp_buf(dest->pool, dest->block_size)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->next = NULL;
+
+    if (dest->last == NULL) {
+        *(dest->out) = cl;
+    } else {
+        dest->last->next = cl;
+    }
+
+    dest->last = cl;
+    dest->pub.next_output_byte = cl->buf->pos;
+    dest->pub.free_in_buffer = dest->block_size;
+    dest->block_size *= 2;
+
+    return NGX_OK;
+}
 
 
 static void ngx_http_video_thumbextractor_init_destination (j_compress_ptr cinfo)
 {
     ngx_http_video_thumbextractor_jpeg_destination_mgr * dest = (ngx_http_video_thumbextractor_jpeg_destination_mgr *) cinfo->dest;
 
-    *(dest->buf) = ngx_palloc(dest->pool, dest->uncompressed_size);
-    *(dest->size) = dest->uncompressed_size;
-    dest->pub.next_output_byte = *(dest->buf);
-    dest->pub.free_in_buffer = dest->uncompressed_size;
+    *(dest->size) = 0;
+    dest->pub.next_output_byte = dest->last->buf->pos;
+    dest->pub.free_in_buffer = dest->last->buf->end - dest->last->buf->pos;
 }
 
 
 static boolean ngx_http_video_thumbextractor_empty_output_buffer (j_compress_ptr cinfo)
 {
     ngx_http_video_thumbextractor_jpeg_destination_mgr *dest = (ngx_http_video_thumbextractor_jpeg_destination_mgr *) cinfo->dest;
-    unsigned char                                      *ret;
-
-    ret = ngx_palloc(dest->pool, *(dest->size) + NGX_HTTP_VIDEO_THUMBEXTRACTOR_MEMORY_STEP);
-    ngx_memcpy(ret, *(dest->buf), *(dest->size));
-
-    *(dest->buf) = ret;
-    (*dest->size) += NGX_HTTP_VIDEO_THUMBEXTRACTOR_MEMORY_STEP;
-
-    dest->pub.next_output_byte = *(dest->buf) + *(dest->size) - NGX_HTTP_VIDEO_THUMBEXTRACTOR_MEMORY_STEP ;
-    dest->pub.free_in_buffer = NGX_HTTP_VIDEO_THUMBEXTRACTOR_MEMORY_STEP;
+    ngx_buf_t                                          *b = dest->last->buf;
+
+    // the filled block is kept as it is, the encoder continues on a new one
+    b->last = b->end;
+    *(dest->size) += b->last - b->pos;
+
+    if (ngx_http_video_thumbextractor_add_output_block(dest) != NGX_OK) {
+        // the encoder can not be interrupted, overwrite the last block and discard the image at the end
+        dest->failed = 1;
+        b->last = b->pos;
+        *(dest->size) -= b->end - b->pos;
+        dest->pub.next_output_byte = b->pos;
+        dest->pub.free_in_buffer = b->end - b->pos;
+    }
 
     return TRUE;
 }
@@ -365,12 +1759,15 @@ static boolean ngx_http_video_thumbextractor_empty_output_buffer (j_compress_ptr
 static void ngx_http_video_thumbextractor_term_destination (j_compress_ptr cinfo)
 {
     ngx_http_video_thumbextractor_jpeg_destination_mgr *dest = (ngx_http_video_thumbextractor_jpeg_destination_mgr *) cinfo->dest;
-    *(dest->size) -= dest->pub.free_in_buffer;
+    ngx_buf_t                                          *b = dest->last->buf;
+
+    b->last = b->end - dest->pub.free_in_buffer;
+    *(dest->size) += b->last - b->pos;
 }
 
 
-static void
-ngx_http_video_thumbextractor_jpeg_memory_dest (j_compress_ptr cinfo, caddr_t *out_buf, size_t *out_size, size_t uncompressed_size, ngx_pool_t *temp_pool)
+static ngx_int_t
+ngx_http_video_thumbextractor_jpeg_memory_dest (j_compress_ptr cinfo, ngx_chain_t **out, size_t *out_size, size_t uncompressed_size, ngx_pool_t *temp_pool)
 {
     ngx_http_video_thumbextractor_jpeg_destination_mgr *dest;
 
@@ -382,10 +1779,85 @@ ngx_http_video_thumbextractor_jpeg_memory_dest (j_compress_ptr cinfo, caddr_t *o
     dest->pub.init_destination = ngx_http_video_thumbextractor_init_destination;
     dest->pub.empty_output_buffer = ngx_http_video_thumbextractor_empty_output_buffer;
     dest->pub.term_destination = ngx_http_video_thumbextractor_term_destination;
-    dest->buf = (unsigned char **)out_buf;
+    dest->out = out;
+    dest->last = NULL;
+    dest->size = out_size;
+    dest->failed = 0;
+    dest->pool = temp_pool;
+
+    // a JPEG is usually much smaller than the raw image, the next blocks cover a bad guess
+    dest->block_size = ngx_max(uncompressed_size / NGX_HTTP_VIDEO_THUMBEXTRACTOR_COMPRESSION_RATIO, NGX_HTTP_VIDEO_THUMBEXTRACTOR_MIN_BLOCK_SIZE);
+
+    *out = NULL;
+
+    return ngx_http_video_thumbextractor_add_output_block(dest);
+}
+
+
+static void ngx_http_video_thumbextractor_init_stream_destination (j_compress_ptr cinfo)
+{
+    ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *dest = (ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *) cinfo->dest;
+
+    *(dest->size) = 0;
+    dest->pub.next_output_byte = dest->block;
+    dest->pub.free_in_buffer = dest->block_size;
+}
+
+
+static void ngx_http_video_thumbextractor_flush_stream_block (ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *dest, size_t len)
+{
+    if ((len > 0) && !dest->failed) {
+        // after a failure the remaining of the image is discarded, the encoder can not be interrupted
+        dest->failed = (dest->ctx->output(dest->ctx->output_data, dest->block, len) != NGX_OK);
+        *(dest->size) += len;
+    }
+
+    dest->pub.next_output_byte = dest->block;
+    dest->pub.free_in_buffer = dest->block_size;
+}
+
+
+static boolean ngx_http_video_thumbextractor_empty_stream_buffer (j_compress_ptr cinfo)
+{
+    ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *dest = (ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *) cinfo->dest;
+
+    // libjpeg only calls it with the whole block filled
+    ngx_http_video_thumbextractor_flush_stream_block(dest, dest->block_size);
+
+    return TRUE;
+}
+
+
+static void ngx_http_video_thumbextractor_term_stream_destination (j_compress_ptr cinfo)
+{
+    ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *dest = (ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *) cinfo->dest;
+
+    ngx_http_video_thumbextractor_flush_stream_block(dest, dest->block_size - dest->pub.free_in_buffer);
+}
+
+
+static ngx_int_t
+ngx_http_video_thumbextractor_jpeg_stream_dest (j_compress_ptr cinfo, ngx_http_video_thumbextractor_thumb_ctx_t *ctx, size_t *out_size, size_t block_size, ngx_pool_t *temp_pool)
+{
+    ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *dest;
+
+    cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(ngx_http_video_thumbextractor_jpeg_stream_destination_mgr));
+
+    dest = (ngx_http_video_thumbextractor_jpeg_stream_destination_mgr *) cinfo->dest;
+    dest->pub.init_destination = ngx_http_video_thumbextractor_init_stream_destination;
+    dest->pub.empty_output_buffer = ngx_http_video_thumbextractor_empty_stream_buffer;
+    dest->pub.term_destination = ngx_http_video_thumbextractor_term_stream_destination;
+    dest->ctx = ctx;
     dest->size = out_size;
-    dest->uncompressed_size = uncompressed_size;
+    dest->block_size = block_size;
+    dest->failed = 0;
     dest->pool = temp_pool;
+
+    if ((dest->block = ngx_palloc(temp_pool, block_size)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
@@ -429,49 +1901,14 @@ int setup_parameters(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_vide
 }
 
 
-int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, int videoStream, AVFilterGraph **fg, AVFilterContext **buffersrc_ctx, AVFilterContext **buffersink_ctx, ngx_log_t *log)
+/* the size of each frame of the image, when only the height or none of them was requested */
+int setup_size(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVCodecContext *pCodecCtx, int rotate_value, ngx_log_t *log)
 {
-    AVFilterGraph   *filter_graph = NULL;
-
-    AVFilterContext *transpose_ctx = NULL;
-    AVFilterContext *transpose_cw_ctx = NULL;
-    AVFilterContext *scale_ctx = NULL;
-    AVFilterContext *crop_ctx = NULL;
-    AVFilterContext *tile_ctx = NULL;
-    AVFilterContext *format_ctx = NULL;
-
-    int              rc = 0;
-    char             args[512];
-
-    unsigned int     needs_crop = 0;
-    int              crop_x = 0, crop_y = 0;
-    float            new_aspect_ratio = 0.0, scale_sws = 0.0, scale_w = 0.0, scale_h = 0.0;
-    int              scale_width = 0, scale_height = 0;
-
-    unsigned int     rotate90 = 0, rotate180 = 0, rotate270 = 0;
-    int              rotate_value = 0;
-
-    AVDictionaryEntry *rotate = av_dict_get(pFormatCtx->streams[videoStream]->metadata, "rotate", NULL, 0);
-    if (rotate) {
-        rotate_value = ngx_atoi((u_char *) rotate->value, ngx_strlen(rotate->value));
-    } else {
-        int32_t *displaymatrix = (int32_t *) av_stream_get_side_data(pFormatCtx->streams[videoStream], AV_PKT_DATA_DISPLAYMATRIX, NULL);
-        if (displaymatrix) {
-            rotate_value = -1 * av_display_rotation_get(displaymatrix);
-        }
-    }
-
-    if (rotate_value) {
-        rotate90 = rotate_value == 90;
-        rotate180 = rotate_value == 180 || rotate_value == -180;
-        rotate270 = rotate_value == 270 || rotate_value == -90;
-    }
-
     float aspect_ratio = display_aspect_ratio(pCodecCtx);
     int width = display_width(pCodecCtx);
     int height = pCodecCtx->height;
 
-    if (rotate90 || rotate270) {
+    if ((rotate_value == 90) || (rotate_value == 270) || (rotate_value == -90)) {
         height = width;
         width = pCodecCtx->height;
         aspect_ratio = 1.0 / aspect_ratio;
@@ -491,22 +1928,71 @@ int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContex
         return NGX_ERROR;
     }
 
-    new_aspect_ratio = (float) ctx->width / ctx->height;
+    return NGX_OK;
+}
+
+
+/* the size of the frame scaled to cover the requested one, before the crop */
+static void
+ngx_http_video_thumbextractor_scale_size(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVCodecContext *pCodecCtx, int rotate_value, int *scale_width, int *scale_height)
+{
+    float aspect_ratio = display_aspect_ratio(pCodecCtx);
+    int width = display_width(pCodecCtx);
+    int height = pCodecCtx->height;
+    float new_aspect_ratio = (float) ctx->width / ctx->height, scale_sws = 0.0, scale_w = 0.0, scale_h = 0.0;
+
+    if ((rotate_value == 90) || (rotate_value == 270) || (rotate_value == -90)) {
+        height = width;
+        width = pCodecCtx->height;
+        aspect_ratio = 1.0 / aspect_ratio;
+    }
 
-    scale_width = ctx->width;
-    scale_height = ctx->height;
+    *scale_width = ctx->width;
+    *scale_height = ctx->height;
 
     if (aspect_ratio != new_aspect_ratio) {
         scale_w = (float) ctx->width / width;
         scale_h = (float) ctx->height / height;
         scale_sws = (scale_w > scale_h) ? scale_w : scale_h;
 
-        scale_width = width * scale_sws + 0.5;
-        scale_height = height * scale_sws + 0.5;
+        *scale_width = width * scale_sws + 0.5;
+        *scale_height = height * scale_sws + 0.5;
+    }
+}
+
+
+int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, int videoStream, int rotate_value, ngx_uint_t scaler, AVFilterGraph **fg, AVFilterContext **buffersrc_ctx, AVFilterContext **buffersink_ctx, ngx_log_t *log)
+{
+    AVFilterGraph   *filter_graph = NULL;
+
+    AVFilterContext *transpose_ctx = NULL;
+    AVFilterContext *transpose_cw_ctx = NULL;
+    AVFilterContext *scale_ctx = NULL;
+    AVFilterContext *crop_ctx = NULL;
+    AVFilterContext *format_ctx = NULL;
+
+    int              rc = 0;
+    char             args[512];
+
+    unsigned int     needs_crop = 0;
+    int              crop_x = 0, crop_y = 0;
+    int              scale_width = 0, scale_height = 0;
+
+    unsigned int     rotate90 = 0, rotate180 = 0, rotate270 = 0;
+
+    if (rotate_value) {
+        rotate90 = rotate_value == 90;
+        rotate180 = rotate_value == 180 || rotate_value == -180;
+        rotate270 = rotate_value == 270 || rotate_value == -90;
+    }
 
-        needs_crop = 1;
+    if (setup_size(ctx, pCodecCtx, rotate_value, log) != NGX_OK) {
+        return NGX_ERROR;
     }
 
+    ngx_http_video_thumbextractor_scale_size(ctx, pCodecCtx, rotate_value, &scale_width, &scale_height);
+    needs_crop = (scale_width != ctx->width) || (scale_height != ctx->height);
+
     // create filters to scale and crop the selected frame
     if ((*fg = filter_graph = avfilter_graph_alloc()) == NULL) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: unable to create filter graph: out of memory");
@@ -535,7 +2021,7 @@ int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContex
         return NGX_ERROR;
     }
 
-    snprintf(args, sizeof(args), "%d:%d:flags=bicubic", scale_width, scale_height);
+    snprintf(args, sizeof(args), "%d:%d:flags=%s", scale_width, scale_height, ngx_http_video_thumbextractor_scaler_names[scaler]);
     if (avfilter_graph_create_filter(&scale_ctx, avfilter_get_by_name("scale"), NULL, args, NULL, filter_graph) < 0) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: error initializing scale filter");
         return NGX_ERROR;
@@ -552,12 +2038,7 @@ int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContex
         }
     }
 
-    ngx_snprintf((u_char *) args, sizeof(args), "%dx%d:margin=%d:padding=%d:color=%V%Z", ctx->tile_cols, ctx->tile_rows, ctx->tile_margin, ctx->tile_padding, &ctx->tile_color);
-    if (avfilter_graph_create_filter(&tile_ctx, avfilter_get_by_name("tile"), NULL, args, NULL, filter_graph) < 0) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: error initializing tile filter");
-        return NGX_ERROR;
-    }
-
+    // each frame is converted by itself and written on its place of the image
     if (avfilter_graph_create_filter(&format_ctx, avfilter_get_by_name("format"), NULL, "pix_fmts=rgb24", NULL, filter_graph) < 0) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "video thumb extractor module: error initializing format filter");
         return NGX_ERROR;
@@ -584,12 +2065,11 @@ int setup_filters(ngx_http_video_thumbextractor_thumb_ctx_t *ctx, AVFormatContex
 
     if (needs_crop) {
         if (rc >= 0) rc = avfilter_link(scale_ctx, 0, crop_ctx, 0);
-        if (rc >= 0) rc = avfilter_link(crop_ctx, 0, tile_ctx, 0);
+        if (rc >= 0) rc = avfilter_link(crop_ctx, 0, format_ctx, 0);
     } else {
-        if (rc >= 0) rc = avfilter_link(scale_ctx, 0, tile_ctx, 0);
+        if (rc >= 0) rc = avfilter_link(scale_ctx, 0, format_ctx, 0);
     }
 
-    if (rc >= 0) rc = avfilter_link(tile_ctx, 0, format_ctx, 0);
     if (rc >= 0) rc = avfilter_link(format_ctx, 0, *buffersink_ctx, 0);
 
     if (rc < 0) {
@@ -625,13 +2105,8 @@ int filter_frame(AVFilterContext *buffersrc_ctx, AVFilterContext *buffersink_ctx
 }
 
 
-int get_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, AVFrame *pFrame, int videoStream, int64_t second, ngx_log_t *log)
+int get_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_file_info_t *info, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, AVFrame *pFrame, int videoStream, int64_t second, ngx_log_t *log)
 {
-    AVPacket packet;
-    int      frameFinished = 0;
-    int      rc;
-    int      decodeStatus;
-
     int64_t second_on_stream_time_base = second * pFormatCtx->streams[videoStream]->time_base.den / pFormatCtx->streams[videoStream]->time_base.num;
 
     if ((pFormatCtx->duration > 0) && ((((float_t) pFormatCtx->duration / AV_TIME_BASE) - second)) < 0.1) {
@@ -643,16 +2118,41 @@ int get_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, AVFormatContext *pFo
         return NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
     }
 
+    return ngx_http_video_thumbextractor_decode_frame(cf, info, pFormatCtx, pCodecCtx, pFrame, videoStream, second_on_stream_time_base, log);
+}
+
+
+static int
+ngx_http_video_thumbextractor_decode_frame(ngx_http_video_thumbextractor_loc_conf_t *cf, ngx_http_video_thumbextractor_file_info_t *info, AVFormatContext *pFormatCtx, AVCodecContext *pCodecCtx, AVFrame *pFrame, int videoStream, int64_t second_on_stream_time_base, ngx_log_t *log)
+{
+    AVPacket packet;
+    int      frameFinished = 0;
+    int      rc;
+    int      decodeStatus;
+
     rc = NGX_HTTP_VIDEO_THUMBEXTRACTOR_SECOND_NOT_FOUND;
     // Find the nearest frame
     while (!frameFinished && av_read_frame(pFormatCtx, &packet) >= 0) {
+        ngx_http_video_thumbextractor_budget_add(info, packets, 1);
+
+        // the request went away or the extraction is over its budget, stop decoding
+        if (ngx_http_video_thumbextractor_interrupt_callback(info)) {
+            av_packet_unref(&packet);
+            return (ngx_http_video_thumbextractor_budget_exceeded(info) != NGX_OK) ? ngx_http_video_thumbextractor_budget_exceeded(info) : NGX_ERROR;
+        }
+
         // Is this a packet from the video stream?
         if (packet.stream_index == videoStream) {
             // Decode video frame
             if (avcodec_send_packet(pCodecCtx, &packet) == AVERROR(EAGAIN)) continue;
+            // the keyframes found are where the next seeks on formats without an index start from
+            if ((packet.flags & AV_PKT_FLAG_KEY) && (packet.pos >= 0) && (packet.dts != AV_NOPTS_VALUE) && ngx_http_video_thumbextractor_index_learns(pFormatCtx)) {
+                av_add_index_entry(pFormatCtx->streams[videoStream], packet.pos, packet.dts, packet.size, 0, AVINDEX_KEYFRAME);
+            }
             if ((decodeStatus = avcodec_receive_frame(pCodecCtx, pFrame)) == AVERROR(EAGAIN)) continue;
             // Did we get a video frame?
             if (decodeStatus == 0) {
+                ngx_http_video_thumbextractor_budget_add(info, frames, 1);
                 rc = NGX_OK;
                 if (!cf->only_keyframe && (pFrame->pts < second_on_stream_time_base)) {
                     frameFinished = 0;
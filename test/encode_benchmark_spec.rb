@@ -0,0 +1,27 @@
+require File.expand_path("./spec_helper", File.dirname(__FILE__))
+require 'net/http'
+require 'uri'
+require 'benchmark'
+
+describe "when encoding large tiles", benchmark: true do
+  let(:iterations) { (ENV['ITERATIONS'] || 20).to_i }
+
+  def encode_throughput(label, options)
+    nginx_run_server(options.merge(jpeg_quality: 95, tile_cols: 8, tile_rows: 8, persistent_processes: "on", processes_per_worker: 1)) do
+      bytes = image('/test_video.mp4?second=2&width=640').bytesize
+
+      elapsed = Benchmark.realtime do
+        iterations.times { image('/test_video.mp4?second=2&width=640') }
+      end
+
+      puts format("%-24s %8.1f ms/image %8.2f MB/s (%d bytes)", label, elapsed * 1000 / iterations, bytes * iterations / elapsed / 1024 / 1024, bytes)
+    end
+  end
+
+  it "should report the encode throughput of each output path" do
+    encode_throughput("pipe", {})
+    encode_throughput("memfd", result_transport: "memfd")
+    encode_throughput("stream", stream_output: "on")
+    encode_throughput("thread pool", thread_pool: "thumbs")
+  end
+end
@@ -0,0 +1,476 @@
+require File.expand_path("./spec_helper", File.dirname(__FILE__))
+require 'net/http'
+require 'uri'
+require 'socket'
+
+describe "when extracting the thumbs on other processes" do
+  let!(:default_image) do
+    nginx_run_server do
+      image('/test_video.mp4?second=2')
+    end
+  end
+
+  context "using persistent processes" do
+    it "should return the same image as the fork per request mode" do
+      nginx_run_server(persistent_processes: "on") do
+        expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        expect(image('/test_video.mp4?second=2')).to eq(default_image)
+      end
+    end
+
+    it "should keep answering after a failed extraction" do
+      nginx_run_server(persistent_processes: "on") do
+        expect(image('/unexistent_video.mp4?second=2', {}, "404")).to be_nil
+        expect(image('/test_video.mp4?second=20', {}, "404")).to be_nil
+        expect(image('/test_video.mp4?second=2')).to eq(default_image)
+      end
+    end
+
+    it "should replace the process after the max number of requests" do
+      nginx_run_server(persistent_processes: "on", process_max_requests: 1) do
+        3.times do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+      end
+    end
+
+    it "should accept requests from a proxy cache file" do
+      FileUtils.rm_rf File.join(NginxTestHelper.nginx_tests_tmp_dir, "cache")
+
+      nginx_run_server(persistent_processes: "on") do
+        expect(image('/test_video.mp4?second=2', {"Host" => 'proxied_server'})).to eq(default_image)
+      end
+    end
+  end
+
+  context "sharing the processes between the workers" do
+    it "should answer all concurrent requests" do
+      nginx_run_server(shared_processes: 1, nginx_workers: 2) do
+        threads = 4.times.map { Thread.new { image('/test_video.mp4?second=2') } }
+        threads.each { |thread| expect(thread.value).to eq(default_image) }
+      end
+    end
+
+    it "should work together with persistent processes" do
+      nginx_run_server(shared_processes: 2, persistent_processes: "on", nginx_workers: 2) do
+        threads = 4.times.map { Thread.new { image('/test_video.mp4?second=2') } }
+        threads.each { |thread| expect(thread.value).to eq(default_image) }
+      end
+    end
+  end
+
+  context "receiving identical requests at the same time" do
+    it "should send the same image to all of them" do
+      nginx_run_server(processes_per_worker: 1) do
+        threads = 5.times.map { Thread.new { image('/test_video.mp4?second=2') } }
+        threads.each { |thread| expect(thread.value).to eq(default_image) }
+      end
+    end
+
+    it "should send the error to all of them" do
+      nginx_run_server(processes_per_worker: 1) do
+        threads = 5.times.map { Thread.new { image('/test_video.mp4?second=20', {}, "404") } }
+        threads.each { |thread| expect(thread.value).to be_nil }
+      end
+    end
+
+    it "should not mix requests with different parameters" do
+      nginx_run_server(processes_per_worker: 1) do
+        other_image = image('/test_video.mp4?second=6')
+        threads = 6.times.map { |i| Thread.new { [i, image("/test_video.mp4?second=#{i.even? ? 2 : 6}")] } }
+        threads.each do |thread|
+          i, content = thread.value
+          expect(content).to eq(i.even? ? default_image : other_image)
+        end
+      end
+    end
+
+    it "should do one extraction per request when disabled" do
+      nginx_run_server(processes_per_worker: 1, coalesce_requests: "off") do
+        threads = 3.times.map { Thread.new { image('/test_video.mp4?second=2') } }
+        threads.each { |thread| expect(thread.value).to eq(default_image) }
+      end
+    end
+  end
+
+  context "when the queue is saturated" do
+    def concurrent_responses(count)
+      threads = count.times.map do
+        Thread.new do
+          uri = URI.parse(nginx_address + '/test_video.mp4?second=2')
+          Net::HTTP.start(uri.host, uri.port) { |http| http.read_timeout = 120; http.get(uri.request_uri) }
+        end
+      end
+      threads.map(&:value)
+    end
+
+    it "should reject the requests above the max queue size" do
+      nginx_run_server(processes_per_worker: 1, max_queue_size: 1, coalesce_requests: "off", retry_after: "3s", tile_cols: 4, tile_rows: 4) do
+        responses = concurrent_responses(6)
+        rejected = responses.select { |response| response.code == "503" }
+
+        expect(rejected).not_to be_empty
+        expect(rejected.map { |response| response["Retry-After"] }.uniq).to eq(["3"])
+        expect(responses.count { |response| response.code == "200" }).to be >= 2
+      end
+    end
+
+    it "should reject the requests waiting longer than the queue timeout" do
+      nginx_run_server(processes_per_worker: 1, queue_timeout: "1ms", coalesce_requests: "off", tile_cols: 4, tile_rows: 4) do
+        responses = concurrent_responses(4)
+        rejected = responses.select { |response| response.code == "503" }
+
+        expect(rejected).not_to be_empty
+        expect(rejected.map { |response| response["Retry-After"] }.uniq).to eq(["1"])
+        expect(responses.count { |response| response.code == "200" }).to be >= 1
+      end
+    end
+
+    it "should answer all requests without limits" do
+      nginx_run_server(processes_per_worker: 1, coalesce_requests: "off") do
+        expect(concurrent_responses(4).map(&:code).uniq).to eq(["200"])
+      end
+    end
+  end
+
+  context "using priority lanes" do
+    it "should answer the requests of both priorities" do
+      nginx_run_server(processes_per_worker: 2, reserved_processes: 1, high_priority_weight: 2, priority: "$arg_priority", coalesce_requests: "off") do
+        threads = 6.times.map { |i| Thread.new { image("/test_video.mp4?second=2&priority=#{i.even? ? 'low' : 'high'}") } }
+        threads.each { |thread| expect(thread.value).to eq(default_image) }
+      end
+    end
+
+    it "should answer a high priority request while the low priority ones use all the other processes" do
+      nginx_run_server(processes_per_worker: 2, reserved_processes: 1, priority: "$arg_priority", coalesce_requests: "off", tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+        low = 3.times.map { Thread.new { image('/test_video.mp4?second=2&priority=low&cols=4&rows=4'); Time.now } }
+        sleep 0.2
+
+        expect(image('/test_video.mp4?second=2&priority=high')).to eq(default_image)
+        high_finished_at = Time.now
+
+        expect(low.map(&:value).min).to be > high_finished_at
+      end
+    end
+  end
+
+  context "when the client goes away" do
+    def abandoned_request(url, wait = 0.2)
+      uri = URI.parse(nginx_address + url)
+      socket = TCPSocket.new(uri.host, uri.port)
+      socket.write("GET #{uri.request_uri} HTTP/1.1\r\nHost: localhost\r\n\r\n")
+      sleep wait
+      socket.close
+    end
+
+    def elapsed
+      started_at = Time.now
+      yield
+      Time.now - started_at
+    end
+
+    shared_examples_for "releasing the extractor" do
+      it "should give the slot to the next request" do
+        nginx_run_server(options.merge(coalesce_requests: "off", tile_cols: "$arg_cols", tile_rows: "$arg_rows")) do
+          sprite_time = elapsed { image('/test_video.mp4?second=2&cols=6&rows=6') }
+
+          abandoned_request('/test_video.mp4?second=2&cols=6&rows=6')
+
+          frame_time = elapsed { expect(image('/test_video.mp4?second=2')).to eq(default_image) }
+          expect(frame_time).to be < sprite_time
+        end
+      end
+    end
+
+    context "using a process per request" do
+      let(:options) { { processes_per_worker: 1 } }
+      it_should_behave_like "releasing the extractor"
+    end
+
+    context "using persistent processes" do
+      let(:options) { { processes_per_worker: 1, persistent_processes: "on" } }
+      it_should_behave_like "releasing the extractor"
+
+      it "should keep the process to answer the next request" do
+        extractors = -> { `ps -eo pid,args`.lines.select { |line| line.include?("thumb extractor") }.map(&:to_i) }
+
+        nginx_run_server(options.merge(coalesce_requests: "off", tile_cols: "$arg_cols", tile_rows: "$arg_rows")) do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          pids = extractors.call
+
+          abandoned_request('/test_video.mp4?second=2&cols=6&rows=6')
+
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          expect(extractors.call).to eq(pids)
+        end
+      end
+
+      it "should answer the other requests of the batch when a waiting one goes away" do
+        nginx_run_server(options.merge(coalesce_requests: "off", tile_cols: "$arg_cols", tile_rows: "$arg_rows")) do
+          other_image = image('/test_video.mp4?second=6')
+          sprite_time = elapsed { image('/test_video.mp4?second=2&cols=6&rows=6') }
+
+          # the second sprite is extracted after the first one, with the others waiting on the same batch
+          first = Thread.new { image('/test_video.mp4?second=2&cols=6&rows=6') }
+          sleep 0.05
+          current = Thread.new { image('/test_video.mp4?second=2&cols=6&rows=6') }
+          abandoned = Thread.new { abandoned_request('/test_video.mp4?second=4&cols=6&rows=6', sprite_time * 1.5) }
+          last = Thread.new { image('/test_video.mp4?second=6') }
+
+          abandoned.join
+          expect(first.value).not_to be_nil
+          expect(current.value).not_to be_nil
+          expect(last.value).to eq(other_image)
+        end
+      end
+    end
+  end
+
+  context "limiting the resources of an extraction" do
+    shared_examples_for "stopping the extraction" do
+      it "should answer with gateway timeout when the extraction takes too long" do
+        nginx_run_server(options.merge(extract_timeout: "1ms", tile_cols: 6, tile_rows: 6)) do
+          expect(image('/test_video.mp4?second=2', {}, "504")).to be_nil
+        end
+      end
+
+      it "should answer with gateway timeout when the extraction reads too much" do
+        nginx_run_server(options.merge(extract_max_bytes: "1k")) do
+          expect(image('/test_video.mp4?second=2', {}, "504")).to be_nil
+        end
+      end
+
+      it "should answer with gateway timeout when the extraction decodes too many frames" do
+        nginx_run_server(options.merge(extract_max_frames: 2, tile_cols: 4, tile_rows: 4)) do
+          expect(image('/test_video.mp4?second=2', {}, "504")).to be_nil
+        end
+      end
+
+      it "should answer with gateway timeout when the extraction reads too many packets" do
+        nginx_run_server(options.merge(extract_max_packets: 2, tile_cols: 4, tile_rows: 4)) do
+          expect(image('/test_video.mp4?second=2', {}, "504")).to be_nil
+        end
+      end
+
+      it "should extract the image inside the limits" do
+        nginx_run_server(options.merge(extract_timeout: "30s", extract_cpu_time: "30s", extract_max_bytes: "100m", extract_max_packets: 10000, extract_max_frames: 10000)) do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+      end
+    end
+
+    context "using a process per request" do
+      let(:options) { {} }
+      it_should_behave_like "stopping the extraction"
+    end
+
+    context "using persistent processes" do
+      let(:options) { { persistent_processes: "on" } }
+      it_should_behave_like "stopping the extraction"
+
+      it "should keep answering after an extraction over the limits" do
+        nginx_run_server(persistent_processes: "on", processes_per_worker: 1, extract_max_frames: 2, tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          expect(image('/test_video.mp4?second=2&cols=4&rows=4', {}, "504")).to be_nil
+          expect(image('/test_video.mp4?second=2&cols=1&rows=1')).not_to be_nil
+        end
+      end
+    end
+
+    context "using a thread pool" do
+      let(:options) { { thread_pool: "thumbs" } }
+      it_should_behave_like "stopping the extraction"
+    end
+  end
+
+  context "batching requests for the same file" do
+    it "should send the right image to each request" do
+      nginx_run_server(persistent_processes: "on", processes_per_worker: 1, coalesce_requests: "off") do
+        other_image = image('/test_video.mp4?second=6')
+        threads = 6.times.map { |i| Thread.new { [i, image("/test_video.mp4?second=#{i.even? ? 2 : 6}")] } }
+        threads.each do |thread|
+          i, content = thread.value
+          expect(content).to eq(i.even? ? default_image : other_image)
+        end
+      end
+    end
+
+    it "should answer the requests of other files and failed extractions" do
+      nginx_run_server(persistent_processes: "on", processes_per_worker: 1, coalesce_requests: "off") do
+        threads = 6.times.map { |i| Thread.new { [i, image(i.even? ? '/test_video.mp4?second=2' : '/test_video.mp4?second=20', {}, i.even? ? "200" : "404")] } }
+        threads.each do |thread|
+          i, content = thread.value
+          expect(content).to eq(i.even? ? default_image : nil)
+        end
+      end
+    end
+
+    it "should extract one request at a time when disabled" do
+      nginx_run_server(persistent_processes: "on", processes_per_worker: 1, coalesce_requests: "off", batch_size: 1) do
+        threads = 3.times.map { Thread.new { image('/test_video.mp4?second=2') } }
+        threads.each { |thread| expect(thread.value).to eq(default_image) }
+      end
+    end
+  end
+
+  context "streaming the image while it is encoded" do
+    def streamed_response(url)
+      uri = URI.parse(nginx_address + url)
+      Net::HTTP.start(uri.host, uri.port) { |http| http.read_timeout = 120; http.get(uri.request_uri) }
+    end
+
+    shared_examples_for "streaming the image" do
+      it "should send the same image using chunked transfer encoding" do
+        nginx_run_server(options.merge(stream_output: "on", stream_buffer_size: "1k")) do
+          response = streamed_response('/test_video.mp4?second=2')
+          expect(response.code).to eq("200")
+          expect(response["Transfer-Encoding"]).to eq("chunked")
+          expect(response["Content-Length"]).to be_nil
+          expect(response.body).to eq(default_image)
+        end
+      end
+
+      it "should return not found for invalid seconds" do
+        nginx_run_server(options.merge(stream_output: "on")) do
+          expect(image('/test_video.mp4?second=20', {}, "404")).to be_nil
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+      end
+    end
+
+    context "using a process per request" do
+      let(:options) { {} }
+      it_should_behave_like "streaming the image"
+    end
+
+    context "using persistent processes" do
+      let(:options) { { persistent_processes: "on", processes_per_worker: 1 } }
+      it_should_behave_like "streaming the image"
+
+      it "should send the right image to each request of a batch" do
+        nginx_run_server(options.merge(stream_output: "on")) do
+          other_image = image('/test_video.mp4?second=6')
+          threads = 4.times.map { |i| Thread.new { [i, image("/test_video.mp4?second=#{i.even? ? 2 : 6}")] } }
+          threads.each do |thread|
+            i, content = thread.value
+            expect(content).to eq(i.even? ? default_image : other_image)
+          end
+        end
+      end
+    end
+  end
+
+  context "opening the video through the open file cache" do
+    shared_examples_for "using the descriptor of the worker" do
+      it "should return the same images for repeated requests" do
+        nginx_run_server(options.merge(open_file_cache: "max=10")) do
+          other_image = image('/test_video.mp4?second=6')
+          3.times do
+            expect(image('/test_video.mp4?second=2')).to eq(default_image)
+            expect(image('/test_video.mp4?second=6')).to eq(other_image)
+          end
+        end
+      end
+
+      it "should return not found for missing files" do
+        nginx_run_server(options.merge(open_file_cache: "max=10")) do
+          2.times { expect(image('/unexistent_video.mp4?second=2', {}, "404")).to be_nil }
+        end
+      end
+
+      it "should keep reading files from a proxy cache by their name" do
+        FileUtils.rm_rf File.join(NginxTestHelper.nginx_tests_tmp_dir, "cache")
+
+        nginx_run_server(options.merge(open_file_cache: "max=10")) do
+          expect(image('/test_video.mp4?second=2', {"Host" => 'proxied_server'})).to eq(default_image)
+        end
+      end
+    end
+
+    context "using a process per request" do
+      let(:options) { {} }
+      it_should_behave_like "using the descriptor of the worker"
+    end
+
+    context "using persistent processes" do
+      let(:options) { { persistent_processes: "on", processes_per_worker: 1 } }
+      it_should_behave_like "using the descriptor of the worker"
+
+      it "should send the descriptor once for a batch" do
+        nginx_run_server(options.merge(open_file_cache: "max=10", coalesce_requests: "off")) do
+          other_image = image('/test_video.mp4?second=6')
+          threads = 6.times.map { |i| Thread.new { [i, image("/test_video.mp4?second=#{i.even? ? 2 : 6}")] } }
+          threads.each do |thread|
+            i, content = thread.value
+            expect(content).to eq(i.even? ? default_image : other_image)
+          end
+        end
+      end
+    end
+
+    context "using a thread pool" do
+      let(:options) { { thread_pool: "thumbs" } }
+      it_should_behave_like "using the descriptor of the worker"
+    end
+  end
+
+  context "handing the image over through a memfd" do
+    it "should return the same image as the pipe" do
+      nginx_run_server(result_transport: "memfd") do
+        expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        expect(image('/test_video.mp4?second=20', {}, "404")).to be_nil
+      end
+    end
+
+    it "should return the same image using persistent processes" do
+      nginx_run_server(result_transport: "memfd", persistent_processes: "on", processes_per_worker: 1, coalesce_requests: "off") do
+        other_image = image('/test_video.mp4?second=6')
+        threads = 4.times.map { |i| Thread.new { [i, image("/test_video.mp4?second=#{i.even? ? 2 : 6}")] } }
+        threads.each do |thread|
+          i, content = thread.value
+          expect(content).to eq(i.even? ? default_image : other_image)
+        end
+      end
+    end
+  end
+
+  context "using a thread pool" do
+    it "should return the same image as the fork per request mode" do
+      nginx_run_server(thread_pool: "thumbs") do
+        expect(image('/test_video.mp4?second=2')).to eq(default_image)
+      end
+    end
+
+    it "should return not found for invalid seconds and files" do
+      nginx_run_server(thread_pool: "thumbs") do
+        expect(image('/unexistent_video.mp4?second=2', {}, "404")).to be_nil
+        expect(image('/test_video.mp4?second=20', {}, "404")).to be_nil
+      end
+    end
+
+    it "should answer concurrent requests" do
+      nginx_run_server(thread_pool: "thumbs") do
+        other_image = image('/test_video.mp4?second=6')
+        threads = 6.times.map { |i| Thread.new { [i, image("/test_video.mp4?second=#{i.even? ? 2 : 6}")] } }
+        threads.each do |thread|
+          i, content = thread.value
+          expect(content).to eq(i.even? ? default_image : other_image)
+        end
+      end
+    end
+
+    it "should return the same image when io_mode is mmap" do
+      nginx_run_server(thread_pool: "thumbs", io_mode: "mmap") do
+        expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        expect(image('/test_video_moov_atom_at_end.mp4?second=2')).to eq(default_image)
+      end
+    end
+
+    it "should accept requests from a proxy cache file" do
+      FileUtils.rm_rf File.join(NginxTestHelper.nginx_tests_tmp_dir, "cache")
+
+      nginx_run_server(thread_pool: "thumbs") do
+        expect(image('/test_video.mp4?second=2', {"Host" => 'proxied_server'})).to eq(default_image)
+      end
+    end
+  end
+end
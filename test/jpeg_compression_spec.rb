@@ -32,4 +32,21 @@ describe "when compressing an image" do
       expect(image('/test_video.mp4?second=2')).not_to eq(default_image)
     end
   end
+
+  it "should return a whole image bigger than the first output block" do
+    sprite = nginx_run_server(jpeg_quality: 100, tile_cols: 6, tile_rows: 6) do
+      image('/test_video.mp4?second=2&width=640')
+    end
+
+    expect(sprite[0, 2].bytes).to eq([0xFF, 0xD8])
+    expect(sprite[-2, 2].bytes).to eq([0xFF, 0xD9])
+
+    nginx_run_server(jpeg_quality: 100, tile_cols: 6, tile_rows: 6, thread_pool: "thumbs") do
+      expect(image('/test_video.mp4?second=2&width=640')).to eq(sprite)
+    end
+
+    nginx_run_server(jpeg_quality: 100, tile_cols: 6, tile_rows: 6, persistent_processes: "on", result_transport: "memfd") do
+      expect(image('/test_video.mp4?second=2&width=640')).to eq(sprite)
+    end
+  end
 end
@@ -12,6 +12,31 @@ module NginxConfiguration
 
       only_keyframe: "on",
       next_time: "on",
+      coalesce_requests: nil,
+      queue_timeout: nil,
+      retry_after: nil,
+      extract_timeout: nil,
+      extract_cpu_time: nil,
+      extract_max_bytes: nil,
+      extract_max_packets: nil,
+      extract_max_frames: nil,
+      stream_output: nil,
+      stream_buffer_size: nil,
+      io_mode: nil,
+      io_buffer_size: nil,
+      readahead: nil,
+      open_file_cache: nil,
+      early_start: nil,
+      remote_cache: nil,
+      index_cache: nil,
+      index_path: nil,
+      probesize: nil,
+      analyzeduration: nil,
+      fpsprobesize: nil,
+      adaptive_probe: nil,
+      decode_quality: nil,
+      scaler: nil,
+      tile_decoders: nil,
 
       jpeg_baseline: nil,
       jpeg_progressive_mode: nil,
@@ -29,6 +54,19 @@ module NginxConfiguration
       tile_padding: nil,
       tile_color: nil,
 
+      priority: nil,
+
+      batch_size: nil,
+      result_transport: nil,
+      high_priority_weight: nil,
+      max_queue_size: nil,
+      persistent_processes: nil,
+      process_max_requests: nil,
+      processes_per_worker: nil,
+      reserved_processes: nil,
+      shared_processes: nil,
+      thread_pool: nil,
+
       extra_location: nil
     }
   end
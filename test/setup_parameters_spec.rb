@@ -56,5 +56,137 @@ describe "when checking configuration" do
     it "should accept jpeg_dpi" do
       expect(nginx_test_configuration(jpeg_dpi: "1")).not_to include "video thumbextractor module:"
     end
+
+    it "should accept persistent_processes" do
+      expect(nginx_test_configuration(persistent_processes: "on", process_max_requests: "10")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept shared_processes" do
+      expect(nginx_test_configuration(shared_processes: "4")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept coalesce_requests" do
+      expect(nginx_test_configuration(coalesce_requests: "off")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept queue limits" do
+      expect(nginx_test_configuration(max_queue_size: "10", queue_timeout: "500ms", retry_after: "2s")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept priority lanes" do
+      expect(nginx_test_configuration(priority: "$arg_priority", processes_per_worker: "4", reserved_processes: "1", high_priority_weight: "2")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept thread_pool" do
+      expect(nginx_test_configuration(thread_pool: "thumbs")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept extraction limits" do
+      expect(nginx_test_configuration(extract_timeout: "10s", extract_cpu_time: "5s", extract_max_bytes: "100m", extract_max_packets: "1000", extract_max_frames: "500")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept batch_size" do
+      expect(nginx_test_configuration(persistent_processes: "on", batch_size: "4")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept stream_output" do
+      expect(nginx_test_configuration(stream_output: "on", stream_buffer_size: "4k")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept io_mode and io_buffer_size" do
+      expect(nginx_test_configuration(io_mode: "mmap", io_buffer_size: "64k")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept readahead" do
+      expect(nginx_test_configuration(readahead: "2m")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept early_start" do
+      expect(nginx_test_configuration(early_start: "64k")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept remote_cache" do
+      expect(nginx_test_configuration(remote_cache: "keys_zone=remote:10m valid=5m")).not_to include "video thumbextractor module:"
+    end
+
+    it "should not accept a too small remote_cache" do
+      expect(nginx_test_configuration(remote_cache: "keys_zone=remote:1k")).to include "video thumbextractor module: video_thumbextractor_remote_cache size must be at least"
+    end
+
+    it "should not accept a remote_cache without keys_zone" do
+      expect(nginx_test_configuration(remote_cache: "10m")).to include "video thumbextractor module: video_thumbextractor_remote_cache needs a keys_zone=name:size parameter"
+    end
+
+    it "should accept probe limits" do
+      expect(nginx_test_configuration(probesize: "1m", analyzeduration: "2s", fpsprobesize: 10, adaptive_probe: "on")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept decode_quality" do
+      expect(nginx_test_configuration(decode_quality: "fast")).not_to include "video thumbextractor module:"
+    end
+
+    it "should not accept an unknown decode_quality" do
+      expect(nginx_test_configuration(decode_quality: "slow")).to include "invalid value \"slow\""
+    end
+
+    it "should accept scaler" do
+      expect(nginx_test_configuration(scaler: "area")).not_to include "video thumbextractor module:"
+    end
+
+    it "should not accept an unknown scaler" do
+      expect(nginx_test_configuration(scaler: "lanczos")).to include "invalid value \"lanczos\""
+    end
+
+    it "should accept tile_decoders" do
+      expect(nginx_test_configuration(tile_decoders: 4)).not_to include "video thumbextractor module:"
+    end
+
+    it "should not accept zero tile_decoders" do
+      expect(nginx_test_configuration(tile_decoders: 0)).to include "video thumbextractor module: video_thumbextractor_tile_decoders must be greater than 0"
+    end
+
+    it "should not accept tile_decoders with thread_pool" do
+      expect(nginx_test_configuration(tile_decoders: 4, thread_pool: "thumbs")).to include "video thumbextractor module: video_thumbextractor_tile_decoders can not be used with video_thumbextractor_thread_pool"
+    end
+
+    it "should not accept a too small probesize" do
+      expect(nginx_test_configuration(probesize: 16)).to include "video thumbextractor module: video_thumbextractor_probesize must be at least 32"
+    end
+
+    it "should accept index_path" do
+      expect(nginx_test_configuration(index_path: "$request_filename.thumbidx")).not_to include "video thumbextractor module:"
+    end
+
+    it "should accept index_cache" do
+      expect(nginx_test_configuration(index_cache: "keys_zone=index:10m")).not_to include "video thumbextractor module:"
+    end
+
+    it "should not accept an index_cache without a zone name" do
+      expect(nginx_test_configuration(index_cache: "keys_zone=:10m")).to include "video thumbextractor module: video_thumbextractor_index_cache needs a zone name"
+    end
+
+    it "should not accept the same zone on remote_cache and index_cache" do
+      expect(nginx_test_configuration(remote_cache: "keys_zone=cache:10m", index_cache: "keys_zone=cache:10m")).to include "video thumbextractor module: zone \"cache\" is already used"
+    end
+
+    it "should accept result_transport" do
+      expect(nginx_test_configuration(result_transport: "memfd")).not_to include "video thumbextractor module:"
+    end
+
+    it "should not accept reserving all processes" do
+      expect(nginx_test_configuration(processes_per_worker: "2", reserved_processes: "2")).to include "video thumbextractor module: video_thumbextractor_reserved_processes must be less than video_thumbextractor_processes_per_worker"
+    end
+
+    it "should not accept a zero high priority weight" do
+      expect(nginx_test_configuration(high_priority_weight: "0")).to include "video thumbextractor module: video_thumbextractor_high_priority_weight must be greater than 0"
+    end
+
+    it "should not accept early_start with stream_output" do
+      expect(nginx_test_configuration(early_start: "64k", stream_output: "on")).to include "video thumbextractor module: video_thumbextractor_early_start can not be used with video_thumbextractor_stream_output"
+    end
+
+    it "should not accept a zero batch size" do
+      expect(nginx_test_configuration(batch_size: "0")).to include "video thumbextractor module: video_thumbextractor_batch_size must be between 1 and 64"
+    end
   end
 end
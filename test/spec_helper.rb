@@ -12,6 +12,8 @@ RSpec.configure do |config|
   end
   config.order = "random"
   config.run_all_when_everything_filtered = true
+  # run them with: rspec --tag benchmark
+  config.filter_run_excluding benchmark: true
 end
 
 RSpec::Matchers.define :be_perceptual_equal_to do |expected, accuracy=99|
@@ -82,6 +84,15 @@ class Pixmap
     end
   end
 
+  # a region of the image
+  def crop(x, y, width, height)
+    bitmap = self.class.new(width, height)
+    bitmap.each_pixel do |i, j|
+      bitmap[i, j] = self[x + i, y + j]
+    end
+    bitmap
+  end
+
   # the difference between two images
   def -(a_pixmap)
     if @width != a_pixmap.width or @height != a_pixmap.height
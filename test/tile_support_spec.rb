@@ -44,6 +44,50 @@ describe "when composing a panel with multiple frames" do
         end
       end
     end
+
+    context "and samples closer than the keyframes" do
+      it "should use the same frames found seeking to each sample" do
+        frames = nginx_run_server(only_keyframe: 'off', next_time: 'off') do
+          [2, 3, 4].map { |second| Pixmap.from_jpeg_buffer(image("/test_video.mp4?second=#{second}&height=64", {}, "200")) }
+        end
+
+        nginx_run_server(tile_cols: 3, tile_rows: 1, tile_sample_interval: 1, only_keyframe: 'off', next_time: 'off') do
+          sprite = Pixmap.from_jpeg_buffer(image('/test_video.mp4?second=2&height=64', {}, "200"))
+          frames.each_with_index do |frame, i|
+            expect((sprite.crop(i * frame.width, 0, frame.width, frame.height) - frame).percentage_pixels_non_zero).to be < 2
+          end
+        end
+      end
+    end
+  end
+
+  context "using multiple decoders" do
+    it "should return the same image of a single decoder" do
+      nginx_run_server(tile_cols: 4, tile_rows: 4, tile_sample_interval: 3, tile_decoders: 3, only_keyframe: 'off') do
+        content = image('/test_video.mp4?second=2&height=64', {}, "200")
+        expect(content).to be_perceptual_equal_to('test_video_4_cols_4_rows_3s_interval.jpg')
+      end
+
+      nginx_run_server(tile_cols: 2, tile_sample_interval: 2, tile_max_rows: 2, tile_decoders: 4, only_keyframe: 'off') do
+        content = image('/test_video.mp4?second=2&height=64', {}, "200")
+        expect(content).to be_perceptual_equal_to('test_video_2_cols_2s_interval_2_max_rows.jpg')
+      end
+    end
+
+    it "should count the frames of all decoders on the same limit" do
+      nginx_run_server(tile_cols: 4, tile_rows: 4, tile_decoders: 4, extract_max_frames: 8) do
+        expect(image('/test_video.mp4?second=2', {}, "504")).to be_nil
+      end
+    end
+
+    it "should check the CPU time of each decoder on its own thread" do
+      [{}, { persistent_processes: "on" }].each do |options|
+        nginx_run_server(options.merge(tile_cols: 4, tile_rows: 4, tile_sample_interval: 3, tile_decoders: 4, only_keyframe: 'off', extract_cpu_time: "2s")) do
+          content = image('/test_video.mp4?second=2&height=64', {}, "200")
+          expect(content).to be_perceptual_equal_to('test_video_4_cols_4_rows_3s_interval.jpg')
+        end
+      end
+    end
   end
 
   context "setting the number of rows" do
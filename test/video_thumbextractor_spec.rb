@@ -1,6 +1,7 @@
 require File.expand_path("./spec_helper", File.dirname(__FILE__))
 require 'net/http'
 require 'uri'
+require 'tmpdir'
 
 describe "when getting a thumb" do
 
@@ -141,6 +142,219 @@ describe "when getting a thumb" do
           end
         end
       end
+
+      context "when reading the file through mmap" do
+        it "should skip the cache header and return the same image" do
+          nginx_run_server(io_mode: "mmap") do
+            expect(image('/test_video_moov_atom_at_end.mp4?second=2', {"Host" => 'proxied_server'})).to eq(image('/test_video.mp4?second=2'))
+          end
+        end
+      end
+
+      context "when starting the extraction before the whole video is received" do
+        it "should return the same image" do
+          nginx_run_server(early_start: "64k") do
+            expect(image('/test_video.mp4?second=2', {"Host" => 'proxied_server'})).to eq(image('/test_video.mp4?second=2'))
+          end
+        end
+
+        it "should wait for the whole video when the moov atom is at the end of the file" do
+          nginx_run_server(early_start: "64k") do
+            expect(image('/test_video_moov_atom_at_end.mp4?second=2', {"Host" => 'proxied_server'})).to eq(image('/test_video.mp4?second=2'))
+          end
+        end
+      end
+    end
+
+    describe "and reading the video from a remote origin" do
+      let!(:configuration) do {
+        extra_location: %{
+
+    location /origin/ {
+      alias #{ File.expand_path(File.dirname(__FILE__)) }/;
+    }
+
+    location ~ ^/remote(?<remote_video>/.+)$ {
+      video_thumbextractor;
+      video_thumbextractor_video_second          $arg_second;
+      video_thumbextractor_remote_url            http://#{nginx_host}:#{nginx_port}/origin$remote_video;
+      video_thumbextractor_remote_block_size     32k;
+      video_thumbextractor_remote_blocks         4;
+    }
+        }
+        }
+      end
+
+      it "should return the same image of the local file" do
+        nginx_run_server(configuration) do
+          expect(image('/remote/test_video.mp4?second=2')).to eq(image('/test_video.mp4?second=2'))
+          expect(image('/remote/test_video_moov_atom_at_end.mp4?second=2')).to eq(image('/test_video.mp4?second=2'))
+        end
+      end
+
+      it "should return a 404 when the video does not exist on the origin" do
+        nginx_run_server(configuration) do
+          expect(image('/remote/unexistent_video.mp4?second=2', {}, "404")).to be_nil
+        end
+      end
+
+      it "should return the same image reading the index from the shared cache" do
+        nginx_run_server(configuration.merge(remote_cache: "keys_zone=remote:1m")) do
+          image_1 = image('/remote/test_video_moov_atom_at_end.mp4?second=2')
+          expect(image_1).to eq(image('/test_video.mp4?second=2'))
+          expect(image('/remote/test_video_moov_atom_at_end.mp4?second=2')).to eq(image_1)
+        end
+      end
+    end
+
+    describe "and keeping the probed videos on the index cache" do
+      it "should return the same images when the video was already probed" do
+        default_image, default_tile = nginx_run_server(tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          [image('/test_video.mp4?second=2'), image('/test_video.mp4?second=2&cols=2&rows=2')]
+        end
+
+        nginx_run_server(index_cache: "keys_zone=index:1m", tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          2.times do
+            expect(image('/test_video.mp4?second=2')).to eq(default_image)
+            expect(image('/test_video_moov_atom_at_end.mp4?second=2')).to eq(default_image)
+            expect(image('/test_video.mp4?second=2&cols=2&rows=2')).to eq(default_tile)
+          end
+        end
+      end
+    end
+
+    describe "and limiting the probe of the video" do
+      it "should return the same images starting with a tiny probe" do
+        default_image, default_tile = nginx_run_server(tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          [image('/test_video.mp4?second=2'), image('/test_video.mp4?second=2&cols=2&rows=2')]
+        end
+
+        nginx_run_server(adaptive_probe: "on", tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          expect(image('/test_video_moov_atom_at_end.mp4?second=2')).to eq(default_image)
+          expect(image('/test_video.mp4?second=2&cols=2&rows=2')).to eq(default_tile)
+        end
+
+        nginx_run_server(probesize: "64k", analyzeduration: "1s", fpsprobesize: 0) do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+      end
+    end
+
+    describe "and decoding the frames on fast mode" do
+      it "should return images with the requested size" do
+        nginx_run_server(decode_quality: "fast") do
+          content = image('/test_video.mp4?second=2&width=200&height=60')
+          expect(content).to be_perceptual_equal_to('test_video_200_x_60.jpg', 95)
+
+          jpeg = Jpeg.open_buffer(image('/test_video.mp4?second=2&height=90'))
+          expect([jpeg.width, jpeg.height]).to eq([160, 90])
+        end
+      end
+    end
+
+    describe "and choosing the scaler" do
+      it "should return images with the requested size" do
+        ["fast_bilinear", "bilinear", "area"].each do |scaler|
+          nginx_run_server(scaler: scaler) do
+            content = image('/test_video.mp4?second=2&width=200&height=60')
+            expect(content).to be_perceptual_equal_to('test_video_200_x_60.jpg', 95)
+
+            content = image('/test_video.mp4?second=2')
+            expect(content).to be_perceptual_equal_to('test_video_640_x_360.jpg', 95)
+          end
+        end
+      end
+    end
+
+    describe "and reading the index file of the video" do
+      it "should return the same image when the index file does not exist or is invalid" do
+        default_image = nginx_run_server { image('/test_video.mp4?second=2') }
+
+        nginx_run_server(index_path: "#{File.expand_path(File.dirname(__FILE__))}$uri.thumbidx") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+
+        nginx_run_server(index_path: "#{File.expand_path(File.dirname(__FILE__))}/test_video_640_x_360.jpg") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+      end
+
+      it "should return the same image reading a valid index file" do
+        default_image = nginx_run_server { image('/test_video.mp4?second=2') }
+
+        Dir.mktmpdir do |dir|
+          root = File.expand_path("..", File.dirname(__FILE__))
+          tool = File.join(dir, "video_thumbextractor_index")
+          expect(system("cc", "-I#{root}/include", "-o", tool, "#{root}/tools/video_thumbextractor_index.c", "-lavformat", "-lavcodec", "-lavutil")).to be true
+
+          ["test_video.mp4", "test_video_moov_atom_at_end.mp4"].each do |video|
+            expect(system(tool, File.expand_path(video, File.dirname(__FILE__)), File.join(dir, "#{video}.thumbidx"), out: File::NULL)).to be true
+          end
+
+          nginx_run_server(index_path: "#{dir}$uri.thumbidx") do
+            expect(image('/test_video.mp4?second=2')).to eq(default_image)
+            expect(image('/test_video_moov_atom_at_end.mp4?second=2')).to eq(default_image)
+          end
+
+          # a rotation only known by the index file shows it was used instead of probing the video
+          index = File.join(dir, "test_video.mp4.thumbidx")
+          File.binwrite(index, [90].pack("l"), 68)
+
+          nginx_run_server(index_path: "#{dir}$uri.thumbidx") do
+            jpeg = Jpeg.open_buffer(image('/test_video.mp4?second=2'))
+            expect([jpeg.width, jpeg.height]).to eq([360, 640])
+          end
+
+          # and it is ignored once the modification time of the video does not match it
+          File.binwrite(index, [0].pack("q"), 24)
+
+          nginx_run_server(index_path: "#{dir}$uri.thumbidx") do
+            expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          end
+        end
+      end
+    end
+
+    describe "and manipulating 'io_mode' configuration" do
+      it "should return the same image reading the file through mmap" do
+        default_image = nginx_run_server { image('/test_video.mp4?second=2') }
+
+        nginx_run_server(io_mode: "mmap") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          expect(image('/test_video_moov_atom_at_end.mp4?second=2')).to eq(default_image)
+          expect(image('/unexistent_video.mp4?second=2', {}, "404")).to be_nil
+        end
+      end
+
+      it "should return the same images hinting the kernel to read ahead" do
+        default_image, default_tile = nginx_run_server(tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          [image('/test_video.mp4?second=2'), image('/test_video.mp4?second=2&cols=2&rows=2')]
+        end
+
+        nginx_run_server(readahead: "256k", tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          expect(image('/test_video_moov_atom_at_end.mp4?second=2')).to eq(default_image)
+          expect(image('/test_video.mp4?second=2&cols=2&rows=2')).to eq(default_tile)
+        end
+
+        nginx_run_server(readahead: "256k", io_mode: "mmap", tile_cols: "$arg_cols", tile_rows: "$arg_rows") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+          expect(image('/test_video.mp4?second=2&cols=2&rows=2')).to eq(default_tile)
+        end
+      end
+
+      it "should return the same image with any read buffer size" do
+        default_image = nginx_run_server { image('/test_video.mp4?second=2') }
+
+        nginx_run_server(io_buffer_size: "1k") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+
+        nginx_run_server(io_buffer_size: "1m") do
+          expect(image('/test_video.mp4?second=2')).to eq(default_image)
+        end
+      end
     end
 
     describe "and manipulating 'filename' configuration" do
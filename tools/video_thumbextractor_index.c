@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2011 Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ * This file is part of Nginx Video Thumb Extractor Module.
+ *
+ * Nginx Video Thumb Extractor Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Video Thumb Extractor Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Video Thumb Extractor Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * video_thumbextractor_index.c
+ *
+ * Writes the sidecar index file of a video, read by the module when
+ * video_thumbextractor_index_path is set.
+ *
+ * Created:  Nov 22, 2011
+ * Author:   Wandenberg Peixoto <wandenberg@gmail.com>
+ *
+ */
+#include <ngx_http_video_thumbextractor_module_index_file.h>
+#include <libavformat/avformat.h>
+#include <libavutil/display.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define INDEX_SUFFIX ".thumbidx"
+
+typedef struct {
+    ngx_http_video_thumbextractor_index_keyframe_t *elts;
+    size_t                                          nelts;
+    size_t                                          nalloc;
+} keyframes_t;
+
+static int add_keyframe(keyframes_t *keyframes, int64_t pos, int64_t timestamp);
+static int stream_rotation(AVStream *stream);
+static int write_index(const char *path, ngx_http_video_thumbextractor_index_file_header_t *header, keyframes_t *keyframes, AVCodecParameters *par);
+
+
+int
+main(int argc, char **argv)
+{
+    ngx_http_video_thumbextractor_index_file_header_t  header;
+    keyframes_t                                        keyframes = { NULL, 0, 0 };
+    AVFormatContext                                   *format_ctx = NULL;
+    AVCodecParameters                                 *par;
+    AVStream                                          *stream;
+    const AVIndexEntry                                *entry;
+    AVPacket                                           packet;
+    struct stat                                        st;
+    char                                              *index_path;
+    int                                                i, entries, learns, restores, rc = 1;
+
+    if ((argc < 2) || (argc > 3)) {
+        fprintf(stderr, "usage: %s video [index file]\n", argv[0]);
+        fprintf(stderr, "the index file defaults to the name of the video followed by " INDEX_SUFFIX "\n");
+        return 1;
+    }
+
+    if (argc == 3) {
+        index_path = argv[2];
+    } else {
+        if ((index_path = malloc(strlen(argv[1]) + sizeof(INDEX_SUFFIX))) == NULL) {
+            fprintf(stderr, "unable to allocate memory\n");
+            return 1;
+        }
+        sprintf(index_path, "%s" INDEX_SUFFIX, argv[1]);
+    }
+
+    if (stat(argv[1], &st) != 0) {
+        fprintf(stderr, "unable to stat \"%s\": %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 10, 100)
+    av_register_all();
+#endif
+
+    if (avformat_open_input(&format_ctx, argv[1], NULL, NULL) != 0) {
+        fprintf(stderr, "unable to open \"%s\"\n", argv[1]);
+        return 1;
+    }
+
+    if (avformat_find_stream_info(format_ctx, NULL) < 0) {
+        fprintf(stderr, "unable to find the stream information of \"%s\"\n", argv[1]);
+        goto exit;
+    }
+
+    if ((i = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        fprintf(stderr, "\"%s\" has no video stream\n", argv[1]);
+        goto exit;
+    }
+
+    stream = format_ctx->streams[i];
+    par = stream->codecpar;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.version = NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.size = st.st_size;
+    header.mtime = st.st_mtime;
+    // the first of the names of the demuxer is enough to find it again
+    for (entries = 0; (entries < NGX_HTTP_VIDEO_THUMBEXTRACTOR_INDEX_FORMAT_LEN - 1) && (format_ctx->iformat->name[entries] != '\0') && (format_ctx->iformat->name[entries] != ','); entries++) {
+        header.format[entries] = format_ctx->iformat->name[entries];
+    }
+    header.stream = i;
+    header.rotate = stream_rotation(stream);
+    header.duration = format_ctx->duration;
+    header.start_time = format_ctx->start_time;
+
+    header.params.codec_id = par->codec_id;
+    header.params.width = par->width;
+    header.params.height = par->height;
+    header.params.format = par->format;
+    header.params.sample_aspect_num = par->sample_aspect_ratio.num;
+    header.params.sample_aspect_den = par->sample_aspect_ratio.den;
+    header.params.profile = par->profile;
+    header.params.level = par->level;
+    header.params.field_order = par->field_order;
+    header.params.color_range = par->color_range;
+    header.params.color_primaries = par->color_primaries;
+    header.params.color_trc = par->color_trc;
+    header.params.color_space = par->color_space;
+    header.params.chroma_location = par->chroma_location;
+    header.params.video_delay = par->video_delay;
+
+    // MPEG-TS and MPEG-PS have no index, the keyframes are where their packets start,
+    // the other demuxers index the keyframes by themselves while the whole video is read
+    learns = (strcmp(format_ctx->iformat->name, "mpegts") == 0) || (strcmp(format_ctx->iformat->name, "mpeg") == 0);
+    // the module only restores the keyframes of these formats, as ngx_http_video_thumbextractor_index_restores,
+    // the index of the others (like MP4) keeps the stream parameters and extradata alone
+    restores = learns || (strcmp(format_ctx->iformat->name, "matroska,webm") == 0);
+
+    while (av_read_frame(format_ctx, &packet) >= 0) {
+        if (learns && (packet.stream_index == i) && (packet.flags & AV_PKT_FLAG_KEY) && (packet.pos >= 0) && (packet.dts != AV_NOPTS_VALUE)) {
+            if (add_keyframe(&keyframes, packet.pos, packet.dts) != 0) {
+                av_packet_unref(&packet);
+                goto exit;
+            }
+        }
+        av_packet_unref(&packet);
+    }
+
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 78, 100)
+    entries = (learns || !restores) ? 0 : stream->nb_index_entries;
+#else
+    entries = (learns || !restores) ? 0 : avformat_index_get_entries_count(stream);
+#endif
+
+    for (i = 0; i < entries; i++) {
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 78, 100)
+        entry = &stream->index_entries[i];
+#else
+        entry = avformat_index_get_entry(stream, i);
+#endif
+        if ((entry->flags & AVINDEX_KEYFRAME) && (add_keyframe(&keyframes, entry->pos, entry->timestamp) != 0)) {
+            goto exit;
+        }
+    }
+
+    header.nkeyframes = keyframes.nelts;
+    header.extradata_size = par->extradata_size;
+
+    if (write_index(index_path, &header, &keyframes, par) == 0) {
+        printf("%s: %u keyframes\n", index_path, header.nkeyframes);
+        rc = 0;
+    }
+
+exit:
+
+    free(keyframes.elts);
+    avformat_close_input(&format_ctx);
+
+    return rc;
+}
+
+
+static int
+add_keyframe(keyframes_t *keyframes, int64_t pos, int64_t timestamp)
+{
+    ngx_http_video_thumbextractor_index_keyframe_t *elts;
+
+    if (keyframes->nelts == keyframes->nalloc) {
+        keyframes->nalloc = (keyframes->nalloc > 0) ? keyframes->nalloc * 2 : 1024;
+        if ((elts = realloc(keyframes->elts, keyframes->nalloc * sizeof(ngx_http_video_thumbextractor_index_keyframe_t))) == NULL) {
+            fprintf(stderr, "unable to allocate memory for %zu keyframes\n", keyframes->nalloc);
+            return -1;
+        }
+        keyframes->elts = elts;
+    }
+
+    keyframes->elts[keyframes->nelts].pos = pos;
+    keyframes->elts[keyframes->nelts].timestamp = timestamp;
+    keyframes->nelts++;
+
+    return 0;
+}
+
+
+static int
+stream_rotation(AVStream *stream)
+{
+    AVDictionaryEntry *rotate = av_dict_get(stream->metadata, "rotate", NULL, 0);
+    int32_t           *displaymatrix;
+
+    if (rotate) {
+        return atoi(rotate->value);
+    }
+
+    displaymatrix = (int32_t *) av_stream_get_side_data(stream, AV_PKT_DATA_DISPLAYMATRIX, NULL);
+
+    return (displaymatrix != NULL) ? -1 * av_display_rotation_get(displaymatrix) : 0;
+}
+
+
+static int
+write_index(const char *path, ngx_http_video_thumbextractor_index_file_header_t *header, keyframes_t *keyframes, AVCodecParameters *par)
+{
+    char  *temp_path;
+    FILE  *file;
+    int    failed;
+
+    // the module never reads a partially written index
+    if ((temp_path = malloc(strlen(path) + sizeof(".tmp"))) == NULL) {
+        fprintf(stderr, "unable to allocate memory\n");
+        return -1;
+    }
+    sprintf(temp_path, "%s.tmp", path);
+
+    if ((file = fopen(temp_path, "wb")) == NULL) {
+        fprintf(stderr, "unable to create \"%s\": %s\n", temp_path, strerror(errno));
+        free(temp_path);
+        return -1;
+    }
+
+    failed = (fwrite(header, sizeof(*header), 1, file) != 1) ||
+             ((keyframes->nelts > 0) && (fwrite(keyframes->elts, sizeof(ngx_http_video_thumbextractor_index_keyframe_t), keyframes->nelts, file) != keyframes->nelts)) ||
+             ((par->extradata_size > 0) && (fwrite(par->extradata, par->extradata_size, 1, file) != 1));
+
+    if ((fclose(file) != 0) || failed || (rename(temp_path, path) != 0)) {
+        fprintf(stderr, "unable to write \"%s\": %s\n", path, strerror(errno));
+        unlink(temp_path);
+        free(temp_path);
+        return -1;
+    }
+
+    free(temp_path);
+
+    return 0;
+}